@@ -0,0 +1,798 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <inttypes.h>
+#include "../cmd/cmd.h"
+#include "../mini.h"
+
+/* Lexicon to benchmark, stored as a sorted array of words. */
+struct lexicon {
+   char *data;          /* Words, separated with nul bytes. */
+   const char **words;
+   size_t *lens;
+   size_t nr;
+};
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xmalloc(size_t size)
+{
+   void *mem = malloc(size);
+   if (!mem && size)
+      die("out of memory:");
+   return mem;
+}
+
+static void index_lexicon(struct lexicon *lex, size_t size)
+{
+   size_t nr = 0;
+   for (size_t i = 0; i < size; i++)
+      nr += lex->data[i] == '\n';
+
+   lex->words = xmalloc(nr * sizeof *lex->words);
+   lex->lens = xmalloc(nr * sizeof *lex->lens);
+   lex->nr = 0;
+
+   char *word = lex->data;
+   for (char *end; (end = memchr(word, '\n', lex->data + size - word)); word = end + 1) {
+      *end = '\0';
+      if (end == word)
+         continue;
+      lex->words[lex->nr] = word;
+      lex->lens[lex->nr++] = end - word;
+   }
+}
+
+static void read_lexicon(struct lexicon *lex, const char *path)
+{
+   FILE *fp = fopen(path, "rb");
+   if (!fp)
+      die("cannot open '%s':", path);
+
+   size_t size = 0, alloc = 1 << 20;
+   lex->data = xmalloc(alloc);
+   size_t nr;
+   while ((nr = fread(lex->data + size, 1, alloc - size - 1, fp))) {
+      size += nr;
+      if (alloc - size == 1) {
+         alloc *= 2;
+         lex->data = realloc(lex->data, alloc);
+         if (!lex->data)
+            die("out of memory:");
+      }
+   }
+   if (ferror(fp))
+      die("IO error:");
+   fclose(fp);
+
+   if (size && lex->data[size - 1] != '\n')
+      lex->data[size++] = '\n';
+   index_lexicon(lex, size);
+}
+
+static int cmp_words(const void *a, const void *b)
+{
+   return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Generates a sorted lexicon of about "nr" words, made of all combinations of
+ * a set of fixed-length stems and a set of endings. Such a lexicon is heavily
+ * suffix-shared, which is the typical case for inflected word lists.
+ */
+static void make_lexicon(struct lexicon *lex, size_t nr)
+{
+   enum { STEM_LEN = 6, NUM_ENDINGS = 256 };
+   const size_t num_stems = nr / NUM_ENDINGS + 1;
+
+   uint32_t seed = 12345;
+   #define RAND() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff)
+
+   char (*endings)[12] = xmalloc(NUM_ENDINGS * sizeof *endings);
+   const char *ending_ptrs[NUM_ENDINGS];
+   for (size_t i = 0; i < NUM_ENDINGS; i++) {
+      size_t len = 1 + RAND() % (sizeof *endings - 1);
+      for (size_t j = 0; j < len; j++)
+         endings[i][j] = 'a' + RAND() % 26;
+      endings[i][len] = '\0';
+      ending_ptrs[i] = endings[i];
+   }
+   qsort(ending_ptrs, NUM_ENDINGS, sizeof *ending_ptrs, cmp_words);
+
+   char (*stems)[STEM_LEN + 1] = xmalloc(num_stems * sizeof *stems);
+   const char **stem_ptrs = xmalloc(num_stems * sizeof *stem_ptrs);
+   for (size_t i = 0; i < num_stems; i++) {
+      for (size_t j = 0; j < STEM_LEN; j++)
+         stems[i][j] = 'a' + RAND() % 26;
+      stems[i][STEM_LEN] = '\0';
+      stem_ptrs[i] = stems[i];
+   }
+   qsort(stem_ptrs, num_stems, sizeof *stem_ptrs, cmp_words);
+   #undef RAND
+
+   size_t size = num_stems * NUM_ENDINGS * (STEM_LEN + sizeof *endings + 1);
+   lex->data = xmalloc(size);
+   char *str = lex->data;
+   for (size_t i = 0; i < num_stems; i++) {
+      if (i && !strcmp(stem_ptrs[i], stem_ptrs[i - 1]))
+         continue;
+      for (size_t j = 0; j < NUM_ENDINGS; j++) {
+         if (j && !strcmp(ending_ptrs[j], ending_ptrs[j - 1]))
+            continue;
+         str += sprintf(str, "%s%s\n", stem_ptrs[i], ending_ptrs[j]);
+      }
+   }
+   index_lexicon(lex, str - lex->data);
+
+   free(stems);
+   free(stem_ptrs);
+   free(endings);
+}
+
+static void get_lexicon(struct lexicon *lex, int argc, char **argv,
+                        size_t synthetic)
+{
+   if (synthetic) {
+      if (argc != 0)
+         die("wrong number of arguments");
+      make_lexicon(lex, synthetic);
+   } else {
+      if (argc != 1)
+         die("wrong number of arguments");
+      read_lexicon(lex, *argv);
+   }
+}
+
+static enum mn_type type_from_str(const char *name)
+{
+   if (!strcmp(name, "standard"))
+      return MN_STANDARD;
+   if (!strcmp(name, "numbered"))
+      return MN_NUMBERED;
+   die("invalid automaton type: '%s'", name);
+}
+
+static int count_write(void *arg, const void *data, size_t size)
+{
+   (void)data;
+   *(size_t *)arg += size;
+   return 0;
+}
+
+static void build(int argc, char **argv)
+{
+   const char *type = "standard";
+   size_t synthetic = 0;
+   size_t rounds = 3;
+   size_t threads = 1;
+   bool stream = false;
+   bool buffer = false;
+   struct option opts[] = {
+      {'t', "type", OPT_STR(type)},
+      {'s', "synthetic", OPT_SIZE_T(synthetic)},
+      {'r', "rounds", OPT_SIZE_T(rounds)},
+      {'j', "threads", OPT_SIZE_T(threads)},
+      {'S', "stream", OPT_BOOL(stream)},
+      {'b', "buffer", OPT_BOOL(buffer)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+
+   struct lexicon lex;
+   get_lexicon(&lex, argc, argv, synthetic);
+   /* Words are separated with nul bytes in the lexicon data. */
+   const size_t data_size = lex.nr ? lex.words[lex.nr - 1] + lex.lens[lex.nr - 1] + 1 - lex.data : 0;
+
+   struct mini_enc *enc = mn_enc_new(type_from_str(type));
+   double best_add = 0, best_dump = 0;
+   size_t size = 0;
+   struct mn_enc_stats stats;
+   for (size_t round = 0; round < rounds; round++) {
+      mn_enc_clear(enc);
+      FILE *fp = NULL;
+      if (stream) {
+         fp = tmpfile();
+         if (!fp)
+            die("cannot create temporary file:");
+         int ret = mn_enc_set_stream(enc, fp);
+         if (ret)
+            die("cannot switch to streaming mode: %s", mn_strerror(ret));
+      }
+      double start = now();
+      int ret;
+      if (threads > 1) {
+         ret = mn_enc_add_batch(enc, (const void *const *)lex.words, lex.lens, lex.nr, threads);
+         if (ret)
+            die("cannot add words: %s", mn_strerror(ret));
+      } else if (buffer) {
+         size_t offset;
+         ret = mn_enc_add_buffer(enc, lex.data, data_size, '\0', &offset);
+         if (ret)
+            die("cannot add word '%s': %s", &lex.data[offset], mn_strerror(ret));
+      } else {
+         for (size_t i = 0; i < lex.nr; i++) {
+            ret = mn_enc_add(enc, lex.words[i], lex.lens[i]);
+            if (ret)
+               die("cannot add word '%s': %s", lex.words[i], mn_strerror(ret));
+         }
+      }
+      double mid = now();
+      size = 0;
+      if (fp) {
+         ret = mn_enc_dump_file(enc, fp);
+         size = ftell(fp);
+      } else {
+         ret = mn_enc_dump(enc, count_write, &size);
+      }
+      if (ret)
+         die("cannot dump automaton: %s", mn_strerror(ret));
+      double end = now();
+      if (!round || mid - start < best_add)
+         best_add = mid - start;
+      if (!round || end - mid < best_dump)
+         best_dump = end - mid;
+      mn_enc_stats(enc, &stats);
+      if (fp)
+         fclose(fp);
+   }
+   mn_enc_free(enc);
+
+   printf("words      %zu\n", lex.nr);
+   printf("size       %zu bytes\n", size);
+   printf("memory     %zu bytes\n", stats.peak_memory);
+   const uint64_t states = stats.states_created + stats.states_merged;
+   printf("states     %"PRIu64" created, %"PRIu64" merged\n", stats.states_created, stats.states_merged);
+   printf("probes     %.2f avg, %"PRIu64" max\n",
+          (double)stats.probes / (states ? states : 1), stats.max_probes);
+   printf("add        %.3f s\n", best_add);
+   printf("dump       %.3f s\n", best_dump);
+   printf("total      %.3f s\n", best_add + best_dump);
+}
+
+/* Shuffles the words of a lexicon, adding one duplicate every eight words. */
+static void shuffle_lexicon(struct lexicon *lex)
+{
+   const size_t nr = lex->nr + lex->nr / 8;
+   lex->words = realloc(lex->words, nr * sizeof *lex->words);
+   lex->lens = realloc(lex->lens, nr * sizeof *lex->lens);
+   if (!lex->words || !lex->lens)
+      die("out of memory:");
+   for (size_t i = lex->nr; i < nr; i++) {
+      lex->words[i] = lex->words[(i - lex->nr) * 8];
+      lex->lens[i] = lex->lens[(i - lex->nr) * 8];
+   }
+   lex->nr = nr;
+
+   uint64_t seed = 12345;
+   for (size_t i = nr; i-- > 1; ) {
+      seed = seed * 6364136223846793005 + 1442695040888963407;
+      size_t j = (seed >> 33) % (i + 1);
+      const char *word = lex->words[i];
+      lex->words[i] = lex->words[j];
+      lex->words[j] = word;
+      size_t len = lex->lens[i];
+      lex->lens[i] = lex->lens[j];
+      lex->lens[j] = len;
+   }
+}
+
+static void sort(int argc, char **argv)
+{
+   const char *type = "standard";
+   size_t synthetic = 0;
+   size_t rounds = 3;
+   size_t memory = 256;
+   struct option opts[] = {
+      {'t', "type", OPT_STR(type)},
+      {'s', "synthetic", OPT_SIZE_T(synthetic)},
+      {'r', "rounds", OPT_SIZE_T(rounds)},
+      {'m', "memory", OPT_SIZE_T(memory)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+
+   struct lexicon lex;
+   get_lexicon(&lex, argc, argv, synthetic);
+   shuffle_lexicon(&lex);
+   const char **words = xmalloc(lex.nr * sizeof *words);
+
+   double best_sort = 0, best_unsorted = 0;
+   size_t sort_size = 0, unsorted_size = 0;
+   size_t sort_memory = 0, unsorted_memory = 0;
+   for (size_t round = 0; round < rounds; round++) {
+      /* Sort in memory, then add words in order. */
+      double start = now();
+      memcpy(words, lex.words, lex.nr * sizeof *words);
+      qsort(words, lex.nr, sizeof *words, cmp_words);
+      struct mini_enc *enc = mn_enc_new(type_from_str(type));
+      for (size_t i = 0; i < lex.nr; i++) {
+         if (i && !strcmp(words[i], words[i - 1]))
+            continue;
+         int ret = mn_enc_add(enc, words[i], strlen(words[i]));
+         if (ret)
+            die("cannot add word '%s': %s", words[i], mn_strerror(ret));
+      }
+      sort_size = 0;
+      int ret = mn_enc_dump(enc, count_write, &sort_size);
+      if (ret)
+         die("cannot dump automaton: %s", mn_strerror(ret));
+      double end = now();
+      if (!round || end - start < best_sort)
+         best_sort = end - start;
+      sort_memory = mn_enc_peak_memory(enc) + lex.nr * sizeof *words;
+      mn_enc_free(enc);
+
+      /* Let the encoder sort words. */
+      start = now();
+      enc = mn_enc_new(type_from_str(type));
+      ret = mn_enc_set_unsorted(enc, memory << 20);
+      for (size_t i = 0; i < lex.nr && !ret; i++)
+         ret = mn_enc_add(enc, lex.words[i], lex.lens[i]);
+      if (ret)
+         die("cannot add words: %s", mn_strerror(ret));
+      unsorted_size = 0;
+      ret = mn_enc_dump(enc, count_write, &unsorted_size);
+      if (ret)
+         die("cannot dump automaton: %s", mn_strerror(ret));
+      end = now();
+      if (!round || end - start < best_unsorted)
+         best_unsorted = end - start;
+      unsorted_memory = mn_enc_peak_memory(enc);
+      mn_enc_free(enc);
+   }
+   if (sort_size != unsorted_size)
+      die("automata differ");
+   free(words);
+
+   printf("words      %zu (shuffled, with duplicates)\n", lex.nr);
+   printf("size       %zu bytes\n", sort_size);
+   printf("sort+add   %.3f s, %zu bytes\n", best_sort, sort_memory);
+   printf("unsorted   %.3f s, %zu bytes\n", best_unsorted, unsorted_memory);
+}
+
+/* Automaton serialized in memory. */
+struct buffer {
+   char *data;
+   size_t size;
+   size_t alloc;
+};
+
+static int buffer_write(void *arg, const void *data, size_t size)
+{
+   struct buffer *buf = arg;
+   if (buf->size + size > buf->alloc) {
+      while (buf->size + size > buf->alloc)
+         buf->alloc = buf->alloc ? buf->alloc * 2 : 1 << 20;
+      buf->data = realloc(buf->data, buf->alloc);
+      if (!buf->data)
+         die("out of memory:");
+   }
+   memcpy(&buf->data[buf->size], data, size);
+   buf->size += size;
+   return 0;
+}
+
+static int buffer_read(void *arg, void *data, size_t size)
+{
+   struct buffer *buf = arg;
+   if (size > buf->size)
+      return -1;
+   memcpy(data, buf->data, size);
+   buf->data += size;
+   buf->size -= size;
+   return 0;
+}
+
+static enum mn_layout layout_from_str(const char *name)
+{
+   if (!strcmp(name, "default"))
+      return MN_LAYOUT_DEFAULT;
+   if (!strcmp(name, "bfs"))
+      return MN_LAYOUT_BFS;
+   if (!strcmp(name, "dfs"))
+      return MN_LAYOUT_DFS;
+   if (!strcmp(name, "profile"))
+      return MN_LAYOUT_PROFILE;
+   die("invalid layout: '%s'", name);
+}
+
+static enum mn_format aut_format_from_str(const char *name)
+{
+   if (!strcmp(name, "fixed"))
+      return MN_FORMAT_FIXED;
+   if (!strcmp(name, "compact"))
+      return MN_FORMAT_COMPACT;
+   if (!strcmp(name, "packed"))
+      return MN_FORMAT_PACKED;
+   die("invalid automaton format: '%s'", name);
+}
+
+static enum mn_counts counts_from_str(const char *name)
+{
+   if (!strcmp(name, "full"))
+      return MN_COUNTS_FULL;
+   if (!strcmp(name, "narrow"))
+      return MN_COUNTS_NARROW;
+   if (!strcmp(name, "interleaved"))
+      return MN_COUNTS_INTERLEAVED;
+   die("invalid counts encoding: '%s'", name);
+}
+
+/* With the profile-guided layout, one word out of "step" is used as sample.
+ * The size of the serialized automaton is stored in "size".
+ */
+static struct mini *load_lexicon(const struct lexicon *lex, enum mn_type type,
+                                 enum mn_layout layout, size_t step,
+                                 enum mn_format format, enum mn_counts counts,
+                                 size_t *size)
+{
+   struct mini_enc *enc = mn_enc_new(type);
+   mn_enc_set_format(enc, format);
+   mn_enc_set_counts(enc, counts);
+   const size_t nr = (lex->nr + step - 1) / step;
+   const void **queries = xmalloc(nr * sizeof *queries);
+   size_t *lens = xmalloc(nr * sizeof *lens);
+   for (size_t i = 0; i < nr; i++) {
+      queries[i] = lex->words[i * step];
+      lens[i] = lex->lens[i * step];
+   }
+   mn_enc_set_layout(enc, layout, queries, lens, nr);
+   for (size_t i = 0; i < lex->nr; i++) {
+      int ret = mn_enc_add(enc, lex->words[i], lex->lens[i]);
+      if (ret)
+         die("cannot add word '%s': %s", lex->words[i], mn_strerror(ret));
+   }
+   struct buffer buf = {0};
+   int ret = mn_enc_dump(enc, buffer_write, &buf);
+   if (ret)
+      die("cannot dump automaton: %s", mn_strerror(ret));
+   mn_enc_free(enc);
+   free(queries);
+   free(lens);
+
+   *size = buf.size;
+   char *data = buf.data;
+   struct mini *fsa;
+   ret = mn_load(&fsa, buffer_read, &buf);
+   if (ret)
+      die("cannot load automaton: %s", mn_strerror(ret));
+   free(data);
+   return fsa;
+}
+
+/* Builds jump tables for the states of at least "min_fanout" transitions, if
+ * not zero, without limit on memory.
+ */
+static void accelerate(struct mini *fsa, size_t min_fanout)
+{
+   if (!min_fanout)
+      return;
+   int ret = mn_accelerate(fsa, (unsigned)min_fanout, SIZE_MAX);
+   if (ret)
+      die("cannot build jump tables: %s", mn_strerror(ret));
+}
+
+static void lookup(int argc, char **argv)
+{
+   const char *type = "standard";
+   size_t synthetic = 0;
+   size_t rounds = 3;
+   size_t changes = 0;
+   const char *layout = "default";
+   size_t hot = 0;
+   const char *format = "fixed";
+   bool huge_pages = false;
+   size_t jump = 0;
+   struct option opts[] = {
+      {'t', "type", OPT_STR(type)},
+      {'s', "synthetic", OPT_SIZE_T(synthetic)},
+      {'r', "rounds", OPT_SIZE_T(rounds)},
+      {'c', "changes", OPT_SIZE_T(changes)},
+      {'l', "layout", OPT_STR(layout)},
+      {'H', "hot", OPT_SIZE_T(hot)},
+      {'f', "format", OPT_STR(format)},
+      {'P', "huge-pages", OPT_BOOL(huge_pages)},
+      {'J', "jump-tables", OPT_SIZE_T(jump)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+
+   struct lexicon lex;
+   get_lexicon(&lex, argc, argv, synthetic);
+   if (hot > lex.nr)
+      hot = lex.nr;
+   const size_t step = hot ? lex.nr / hot : 16;
+   size_t size;
+   struct mini *fsa = load_lexicon(&lex, type_from_str(type), layout_from_str(layout), step,
+                                   aut_format_from_str(format), MN_COUNTS_FULL, &size);
+   if (huge_pages)
+      mn_advise(fsa, MN_ADVISE_HUGE_PAGES | MN_ADVISE_PREFAULT);
+   accelerate(fsa, jump);
+
+   /* Half of the changes are removals, half are insertions of words that are
+    * not in the lexicon.
+    */
+   struct mini_overlay *ov = mn_overlay_new(fsa);
+   if (!ov)
+      die("out of memory:");
+   for (size_t i = 0; i < changes && lex.nr; i++) {
+      const size_t n = i * 7919 % lex.nr;
+      char word[MN_MAX_WORD_LEN + 1];
+      size_t len = lex.lens[n];
+      memcpy(word, lex.words[n], len);
+      if (i % 2 == 0 || len == MN_MAX_WORD_LEN) {
+         mn_overlay_remove(ov, word, len);
+      } else {
+         word[len++] = '\x01';
+         mn_overlay_insert(ov, word, len);
+      }
+   }
+
+   /* Only look up the words used as sample, as many times as there are words
+    * in the lexicon.
+    */
+   if (hot) {
+      const char **words = xmalloc(hot * sizeof *words);
+      size_t *lens = xmalloc(hot * sizeof *lens);
+      for (size_t i = 0; i < hot; i++) {
+         words[i] = lex.words[i * step];
+         lens[i] = lex.lens[i * step];
+      }
+      for (size_t i = 0; i < lex.nr; i++) {
+         lex.words[i] = words[i % hot];
+         lex.lens[i] = lens[i % hot];
+      }
+      free(words);
+      free(lens);
+   }
+   shuffle_lexicon(&lex);
+
+   double best_plain = 0, best_overlay = 0;
+   size_t found_plain = 0, found_overlay = 0;
+   for (size_t round = 0; round < rounds; round++) {
+      double start = now();
+      found_plain = 0;
+      for (size_t i = 0; i < lex.nr; i++)
+         found_plain += mn_contains(fsa, lex.words[i], lex.lens[i]);
+      double mid = now();
+      found_overlay = 0;
+      for (size_t i = 0; i < lex.nr; i++)
+         found_overlay += mn_overlay_contains(ov, lex.words[i], lex.lens[i]);
+      double end = now();
+      if (!round || mid - start < best_plain)
+         best_plain = mid - start;
+      if (!round || end - mid < best_overlay)
+         best_overlay = end - mid;
+   }
+   mn_overlay_free(ov);
+   mn_free(fsa);
+
+   printf("size       %zu bytes\n", size);
+   printf("lookups    %zu (shuffled)\n", lex.nr);
+   printf("changes    %zu\n", changes);
+   printf("plain      %.3f s, %.1f ns/lookup, %zu found\n",
+          best_plain, best_plain * 1e9 / (lex.nr ? lex.nr : 1), found_plain);
+   printf("overlay    %.3f s, %.1f ns/lookup, %zu found\n",
+          best_overlay, best_overlay * 1e9 / (lex.nr ? lex.nr : 1), found_overlay);
+}
+
+static void number(int argc, char **argv)
+{
+   size_t synthetic = 0;
+   size_t rounds = 3;
+   const char *format = "fixed";
+   const char *counts = "full";
+   size_t jump = 0;
+   struct option opts[] = {
+      {'s', "synthetic", OPT_SIZE_T(synthetic)},
+      {'r', "rounds", OPT_SIZE_T(rounds)},
+      {'f', "format", OPT_STR(format)},
+      {'c', "counts", OPT_STR(counts)},
+      {'J', "jump-tables", OPT_SIZE_T(jump)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+
+   struct lexicon lex;
+   get_lexicon(&lex, argc, argv, synthetic);
+   size_t size;
+   struct mini *fsa = load_lexicon(&lex, MN_NUMBERED, MN_LAYOUT_DEFAULT, 16,
+                                   aut_format_from_str(format), counts_from_str(counts), &size);
+   accelerate(fsa, jump);
+
+   /* Ordinals are extracted in the order in which words were located. */
+   shuffle_lexicon(&lex);
+   uint32_t *indexes = xmalloc(lex.nr * sizeof *indexes);
+
+   double best_locate = 0, best_extract = 0;
+   size_t found = 0, extracted = 0;
+   for (size_t round = 0; round < rounds; round++) {
+      double start = now();
+      found = 0;
+      for (size_t i = 0; i < lex.nr; i++) {
+         indexes[i] = mn_locate(fsa, lex.words[i], lex.lens[i]);
+         found += indexes[i] != 0;
+      }
+      double mid = now();
+      extracted = 0;
+      for (size_t i = 0; i < lex.nr; i++) {
+         char word[MN_MAX_WORD_LEN + 1];
+         extracted += mn_extract(fsa, indexes[i], word) == lex.lens[i];
+      }
+      double end = now();
+      if (!round || mid - start < best_locate)
+         best_locate = mid - start;
+      if (!round || end - mid < best_extract)
+         best_extract = end - mid;
+   }
+   free(indexes);
+   mn_free(fsa);
+
+   printf("size       %zu bytes\n", size);
+   printf("words      %zu (shuffled)\n", lex.nr);
+   printf("locate     %.3f s, %.1f ns/word, %zu found\n",
+          best_locate, best_locate * 1e9 / (lex.nr ? lex.nr : 1), found);
+   printf("extract    %.3f s, %.1f ns/word, %zu extracted\n",
+          best_extract, best_extract * 1e9 / (lex.nr ? lex.nr : 1), extracted);
+}
+
+static int file_write(void *fp, const void *data, size_t size)
+{
+   return fwrite(data, 1, size, fp) != size;
+}
+
+static void load(int argc, char **argv)
+{
+   const char *type = "numbered";
+   size_t synthetic = 0;
+   size_t rounds = 5;
+   size_t threads = 4;
+   const char *format = "fixed";
+   const char *counts = "full";
+   bool native = false;
+   struct option opts[] = {
+      {'t', "type", OPT_STR(type)},
+      {'s', "synthetic", OPT_SIZE_T(synthetic)},
+      {'r', "rounds", OPT_SIZE_T(rounds)},
+      {'j', "threads", OPT_SIZE_T(threads)},
+      {'f', "format", OPT_STR(format)},
+      {'c', "counts", OPT_STR(counts)},
+      {'n', "native", OPT_BOOL(native)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+
+   struct lexicon lex;
+   get_lexicon(&lex, argc, argv, synthetic);
+   struct mini_enc *enc = mn_enc_new(type_from_str(type));
+   if (!enc)
+      die("out of memory:");
+   mn_enc_set_format(enc, aut_format_from_str(format));
+   mn_enc_set_counts(enc, counts_from_str(counts));
+   mn_enc_set_native(enc, native);
+   for (size_t i = 0; i < lex.nr; i++) {
+      int ret = mn_enc_add(enc, lex.words[i], lex.lens[i]);
+      if (ret)
+         die("cannot add word '%s': %s", lex.words[i], mn_strerror(ret));
+   }
+
+   /* The file stays in the page cache, so this measures decoding, not IO. */
+   FILE *fp = tmpfile();
+   if (!fp)
+      die("cannot create temporary file:");
+   int ret = mn_enc_dump(enc, file_write, fp);
+   if (ret || fflush(fp))
+      die("cannot dump automaton: %s", ret ? mn_strerror(ret) : "IO error");
+   const long size = ftell(fp);
+   mn_enc_free(enc);
+
+   const char *names[] = {"read", "parallel", "mmap"};
+   double best[3] = {0};
+   for (size_t round = 0; round < rounds; round++) {
+      for (size_t i = 0; i < 3; i++) {
+         rewind(fp);
+         struct mini *fsa;
+         double start = now();
+         ret = i == 0 ? mn_load_file(&fsa, fp) :
+               i == 1 ? mn_load_parallel(&fsa, fp, threads) :
+               mn_load_mmap(&fsa, fp);
+         double end = now();
+         if (ret)
+            die("cannot load automaton: %s", mn_strerror(ret));
+         if (mn_size(fsa) != lex.nr)
+            die("wrong number of words");
+         mn_free(fsa);
+         if (!round || end - start < best[i])
+            best[i] = end - start;
+      }
+   }
+   fclose(fp);
+
+   printf("size       %ld bytes\n", size);
+   for (size_t i = 0; i < 3; i++)
+      printf("%-10s %.3f ms, %.0f MB/s\n", names[i], best[i] * 1e3, size / best[i] / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+   struct command cmds[] = {
+      {"build", build},
+      {"sort", sort},
+      {"lookup", lookup},
+      {"number", number},
+      {"load", load},
+      {0}
+   };
+   const char *help =
+      "Usage: %s <command> [option] [<lexicon_path>]\n"
+      "Benchmark the library.\n"
+      "\n"
+      "Commands:\n"
+      "   build [-t | --type=<standard|numbered>] [-r | --rounds=<num>]\n"
+      "         [-s | --synthetic=<num_words>] [-j | --threads=<num>]\n"
+      "         [-S | --stream] [-b | --buffer] [<lexicon_path>]\n"
+      "      Time the construction of an automaton. The lexicon is read from a\n"
+      "      sorted word list, unless --synthetic is given, in which case a\n"
+      "      heavily suffix-shared lexicon of about <num_words> words is\n"
+      "      generated. The best time over 3 rounds is reported by default.\n"
+      "      With --threads, words are added with mn_enc_add_batch(). With\n"
+      "      --stream, the automaton is written to a temporary file while it is\n"
+      "      being built. With --buffer, the whole lexicon is added with a\n"
+      "      single call to mn_enc_add_buffer().\n"
+      "   sort [-t | --type=<standard|numbered>] [-r | --rounds=<num>]\n"
+      "        [-s | --synthetic=<num_words>] [-m | --memory=<MiB>]\n"
+      "        [<lexicon_path>]\n"
+      "      Shuffle a lexicon and add duplicates to it, then compare the time\n"
+      "      needed to build an automaton by sorting it in memory with qsort()\n"
+      "      beforehand, and by adding words to an encoder in unsorted mode,\n"
+      "      with a sort buffer of <MiB> megabytes (256 by default).\n"
+      "   lookup [-t | --type=<standard|numbered>] [-r | --rounds=<num>]\n"
+      "          [-s | --synthetic=<num_words>] [-c | --changes=<num>]\n"
+      "          [-l | --layout=<default|bfs|dfs|profile>] [-H | --hot=<num>]\n"
+      "          [-f | --format=<fixed|compact|packed>] [-P | --huge-pages]\n"
+      "          [-J | --jump-tables=<min_fanout>] [<lexicon_path>]\n"
+      "      Time the lookup of all the words of a lexicon, in random order,\n"
+      "      with mn_contains(), and through an overlay holding <num> changes\n"
+      "      (none by default) with mn_overlay_contains(). With --layout,\n"
+      "      states are reordered; the profile-guided layout uses one word out\n"
+      "      of 16 as sample queries. With --hot, only <num> words evenly\n"
+      "      spread over the lexicon are looked up, repeatedly, and used as\n"
+      "      sample queries. With --format, the automaton is stored in the\n"
+      "      given format. With --huge-pages, it is moved to huge pages with\n"
+      "      mn_advise(), to measure the effect of TLB misses. With\n"
+      "      --jump-tables, jump tables are built with mn_accelerate() for the\n"
+      "      states of at least <min_fanout> transitions.\n"
+      "   number [-r | --rounds=<num>] [-s | --synthetic=<num_words>]\n"
+      "          [-f | --format=<fixed|compact|packed>]\n"
+      "          [-c | --counts=<full|narrow|interleaved>]\n"
+      "          [-J | --jump-tables=<min_fanout>] [<lexicon_path>]\n"
+      "      Time the conversion of all the words of a numbered lexicon to\n"
+      "      their ordinal with mn_locate(), in random order, and back with\n"
+      "      mn_extract(). With --format and --counts, the automaton is stored\n"
+      "      in the given format, with counts of the given encoding. With\n"
+      "      --jump-tables, jump tables are built as for lookup.\n"
+      "   load [-t | --type=<standard|numbered>] [-r | --rounds=<num>]\n"
+      "        [-s | --synthetic=<num_words>] [-j | --threads=<num>]\n"
+      "        [-f | --format=<fixed|compact|packed>]\n"
+      "        [-c | --counts=<full|narrow|interleaved>] [-n | --native]\n"
+      "        [<lexicon_path>]\n"
+      "      Time the loading of an automaton, numbered by default, from a\n"
+      "      file in the page cache, with mn_load_file(), with\n"
+      "      mn_load_parallel() and <num> threads (4 by default), and with\n"
+      "      mn_load_mmap(). With --native, the automaton is written with\n"
+      "      mn_enc_set_native(). The best time over 5 rounds is reported by\n"
+      "      default.\n"
+      "\n"
+      "Common option:\n"
+      "   -h | --help     Display this message\n"
+   ;
+
+   parse_command(cmds, help, argc, argv);
+}
@@ -1,5 +1,12 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "cmd.h"
 #include "../mini.h"
 
@@ -12,50 +19,487 @@ static enum mn_type type_from_str(const char *name)
    die("invalid automaton type: '%s'", name);
 }
 
-static const char *read_line(size_t *len_p, size_t *line_no_p)
+static void print_stats(const struct mini_enc *enc)
 {
-   static char line[MN_MAX_WORD_LEN + 2];    /* word, newline, zero */
-   static size_t line_no;
+   struct mn_enc_stats stats;
+   mn_enc_stats(enc, &stats);
 
-   while (fgets(line, sizeof line, stdin)) {
-      size_t len = strlen(line);
+   const uint64_t lookups = stats.states_created + stats.states_merged;
+   fprintf(stderr, "states created    %"PRIu64"\n", stats.states_created);
+   fprintf(stderr, "states merged     %"PRIu64"\n", stats.states_merged);
+   fprintf(stderr, "average probes    %.2f\n", lookups ? (double)stats.probes / lookups : 0);
+   fprintf(stderr, "max probes        %"PRIu64"\n", stats.max_probes);
+   fprintf(stderr, "buckets           %zu\n", stats.buckets);
+   fprintf(stderr, "load factor       %.2f\n", stats.load_factor);
+   fprintf(stderr, "minimize time     %.3f s\n", stats.minimize_time);
+   fprintf(stderr, "peak memory       %zu bytes\n", stats.peak_memory);
+   fprintf(stderr, "overlap saved     %"PRIu64"\n", stats.overlap_saved);
+}
+
+static void *xrealloc(void *mem, size_t size)
+{
+   mem = realloc(mem, size);
+   if (!mem)
+      die("out of memory:");
+   return mem;
+}
+
+static int cmp_words(const char *a, size_t alen, const char *b, size_t blen)
+{
+   int ret = memcmp(a, b, alen < blen ? alen : blen);
+   if (ret)
+      return ret;
+   return (alen > blen) - (alen < blen);
+}
+
+#define READ_SIZE (1 << 20)
+
+static size_t count_lines(const char *data, size_t size)
+{
+   size_t nr = 0;
+   for (const char *end = data + size; (data = memchr(data, '\n', end - data)); data++)
+      nr++;
+   return nr;
+}
+
+static void die_word(const char *word, size_t len, size_t line_no, int err)
+{
+   if (len > MN_MAX_WORD_LEN)
+      die("word '%.*s' too long at line %zu (length limit is %d)",
+          MN_MAX_WORD_LEN + 1, word, line_no, MN_MAX_WORD_LEN);
+   die("cannot add word '%.*s' at line %zu: %s", (int)len, word, line_no, mn_strerror(err));
+}
+
+/* Maps the standard input in memory, if it is a regular file. Returns NULL
+ * if it is not, e.g. if it is a pipe.
+ */
+static char *map_input(size_t *size)
+{
+   struct stat st;
+   if (fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode) || lseek(STDIN_FILENO, 0, SEEK_CUR) != 0)
+      return NULL;
+   if (st.st_size == 0) {
+      *size = 0;
+      return "";
+   }
+   char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+   if (data == MAP_FAILED)
+      return NULL;
+   posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+   *size = st.st_size;
+   return data;
+}
+
+static void unmap_input(char *data, size_t size)
+{
+   if (size)
+      munmap(data, size);
+}
+
+/* Reads a whole file in memory. */
+static char *read_file(FILE *fp, size_t *size_p)
+{
+   char *data = NULL;
+   size_t size = 0, alloc = 0;
+
+   do {
+      if (size + READ_SIZE > alloc) {
+         alloc = alloc ? alloc * 2 : READ_SIZE;
+         data = xrealloc(data, alloc);
+      }
+      size += fread(&data[size], 1, READ_SIZE, fp);
+   } while (!feof(fp) && !ferror(fp));
+   if (ferror(fp))
+      die("IO error:");
+   *size_p = size;
+   return data;
+}
+
+/* Adds the words of a buffer, "line_no" being the number of lines preceding
+ * it. Returns the number of lines in the buffer.
+ */
+static size_t add_buffer(struct mini_enc *enc, const char *data, size_t size, size_t line_no)
+{
+   size_t offset;
+   int ret = mn_enc_add_buffer(enc, data, size, '\n', &offset);
+   if (ret) {
+      const char *word = &data[offset];
+      const char *end = memchr(word, '\n', size - offset);
+      die_word(word, end ? (size_t)(end - word) : size - offset,
+               line_no + count_lines(data, offset) + 1, ret);
+   }
+   return count_lines(data, size);
+}
+
+/* Encodes the standard input. If it is a regular file, it is mapped in memory
+ * and encoded in one go. Otherwise, it is read in blocks, each of which is
+ * encoded up to its last newline.
+ */
+static void add_words(struct mini_enc *enc)
+{
+   size_t size;
+   char *data = map_input(&size);
+   if (data) {
+      add_buffer(enc, data, size, 0);
+      unmap_input(data, size);
+      return;
+   }
+
+   data = xrealloc(NULL, READ_SIZE);
+   size_t line_no = 0;
+   size = 0;
+   for (;;) {
+      size_t got = fread(&data[size], 1, READ_SIZE - size, stdin);
+      if (ferror(stdin))
+         die("IO error:");
+      size += got;
+      if (!got) {
+         add_buffer(enc, data, size, line_no);
+         break;
+      }
+      size_t used = size;
+      while (used && data[used - 1] != '\n')
+         used--;
+      if (!used) {
+         if (size < READ_SIZE)
+            continue;
+         die_word(data, size, line_no + 1, MN_EWORD);
+      }
+      line_no += add_buffer(enc, data, used, line_no);
+      memmove(data, &data[used], size - used);
+      size -= used;
+   }
+   free(data);
+}
+
+/* Loads the whole lexicon in memory, and encodes it with several threads.
+ * The order of words is checked beforehand, so that errors can be reported
+ * with a line number. Words are not copied, but point into the input buffer.
+ */
+static void add_words_batch(struct mini_enc *enc, size_t threads)
+{
+   size_t size;
+   char *data = map_input(&size);
+   const bool mapped = data;
+   if (!mapped)
+      data = read_file(stdin, &size);
+
+   const void **words = NULL;
+   size_t *lens = NULL;
+   size_t nr = 0, nr_alloc = 0;
+
+   size_t line_no = 0;
+   for (const char *word = data, *end = data + size; word < end; ) {
+      const char *word_end = memchr(word, '\n', end - word);
+      if (!word_end)
+         word_end = end;
+      const size_t len = word_end - word;
       line_no++;
-      if (len && line[len - 1] == '\n')
-         line[--len] = '\0';
-      if (!len)
-         continue;
       if (len > MN_MAX_WORD_LEN)
-         die("word '%s' too long at line %zu (length limit is %d)", line, line_no, MN_MAX_WORD_LEN);
-      *len_p = len;
-      *line_no_p = line_no;
-      return line;
+         die_word(word, len, line_no, MN_EWORD);
+      if (len) {
+         if (nr && cmp_words(words[nr - 1], lens[nr - 1], word, len) >= 0)
+            die_word(word, len, line_no, MN_EORDER);
+         if (nr == nr_alloc) {
+            nr_alloc = nr_alloc ? nr_alloc * 2 : 1 << 16;
+            words = xrealloc(words, nr_alloc * sizeof *words);
+            lens = xrealloc(lens, nr_alloc * sizeof *lens);
+         }
+         words[nr] = word;
+         lens[nr++] = len;
+      }
+      word = word_end + 1;
    }
-   if (ferror(stdin))
-      die("IO error:");
-   return NULL;
+
+   int ret = mn_enc_add_batch(enc, words, lens, nr, threads);
+   if (ret)
+      die("cannot add words: %s", mn_strerror(ret));
+
+   free(words);
+   free(lens);
+   if (mapped)
+      unmap_input(data, size);
+   else
+      free(data);
+}
+
+static enum mn_format aut_format_from_str(const char *name)
+{
+   if (!strcmp(name, "fixed"))
+      return MN_FORMAT_FIXED;
+   if (!strcmp(name, "compact"))
+      return MN_FORMAT_COMPACT;
+   if (!strcmp(name, "packed"))
+      return MN_FORMAT_PACKED;
+   die("invalid automaton format: '%s'", name);
+}
+
+static enum mn_counts counts_from_str(const char *name)
+{
+   if (!strcmp(name, "full"))
+      return MN_COUNTS_FULL;
+   if (!strcmp(name, "narrow"))
+      return MN_COUNTS_NARROW;
+   if (!strcmp(name, "interleaved"))
+      return MN_COUNTS_INTERLEAVED;
+   die("invalid counts encoding: '%s'", name);
+}
+
+/* Sample queries, for the profile-guided layout. */
+struct profile {
+   char *data;
+   const void **words;
+   size_t *lens;
+   size_t nr;
+};
+
+static enum mn_layout layout_from_str(const char *name)
+{
+   if (!strcmp(name, "default"))
+      return MN_LAYOUT_DEFAULT;
+   if (!strcmp(name, "bfs"))
+      return MN_LAYOUT_BFS;
+   if (!strcmp(name, "dfs"))
+      return MN_LAYOUT_DFS;
+   if (!strcmp(name, "profile"))
+      return MN_LAYOUT_PROFILE;
+   die("invalid layout: '%s'", name);
+}
+
+/* Reads a query log, one query per line. Queries needn't be sorted. */
+static void read_profile(struct profile *prof, const char *path)
+{
+   FILE *fp = fopen(path, "rb");
+   if (!fp)
+      die("cannot open '%s':", path);
+   size_t size;
+   prof->data = read_file(fp, &size);
+   fclose(fp);
+
+   size_t nr_alloc = 0;
+   prof->words = NULL;
+   prof->lens = NULL;
+   prof->nr = 0;
+   for (const char *word = prof->data, *end = word + size; word < end; ) {
+      const char *word_end = memchr(word, '\n', end - word);
+      if (!word_end)
+         word_end = end;
+      if (prof->nr == nr_alloc) {
+         nr_alloc = nr_alloc ? nr_alloc * 2 : 1 << 16;
+         prof->words = xrealloc(prof->words, nr_alloc * sizeof *prof->words);
+         prof->lens = xrealloc(prof->lens, nr_alloc * sizeof *prof->lens);
+      }
+      prof->words[prof->nr] = word;
+      prof->lens[prof->nr++] = word_end - word;
+      word = word_end + 1;
+   }
+}
+
+static void set_layout(struct mini_enc *enc, const char *layout, const char *profile,
+                       struct profile *prof)
+{
+   enum mn_layout l = layout_from_str(layout);
+   if (l == MN_LAYOUT_PROFILE) {
+      if (!profile)
+         die("the profile layout needs a query log");
+      read_profile(prof, profile);
+   }
+   mn_enc_set_layout(enc, l, prof->words, prof->lens, prof->nr);
+}
+
+static void free_profile(struct profile *prof)
+{
+   free(prof->data);
+   free(prof->words);
+   free(prof->lens);
 }
 
 static void create(int argc, char **argv)
 {
    const char *type = "standard";
+   bool stats = false;
+   size_t threads = 1;
+   bool unsorted = false;
+   size_t memory = 256;
+   bool stream = false;
+   const char *layout = "default";
+   const char *profile = NULL;
+   const char *format = "fixed";
+   bool overlap = false;
+   const char *counts = "full";
+   bool native = false;
    struct option opts[] = {
       {'t', "type", OPT_STR(type)},
+      {'s', "stats", OPT_BOOL(stats)},
+      {'j', "threads", OPT_SIZE_T(threads)},
+      {'u', "unsorted", OPT_BOOL(unsorted)},
+      {'m', "memory", OPT_SIZE_T(memory)},
+      {'S', "stream", OPT_BOOL(stream)},
+      {'l', "layout", OPT_STR(layout)},
+      {'p', "profile", OPT_STR(profile)},
+      {'f', "format", OPT_STR(format)},
+      {'o', "overlap", OPT_BOOL(overlap)},
+      {'c', "counts", OPT_STR(counts)},
+      {'n', "native", OPT_BOOL(native)},
       {0}
    };
    parse_options(opts, NULL, &argc, &argv);
    if (argc != 1)
       die("wrong number of arguments");
+   if (unsorted && !memory)
+      die("memory limit must be greater than zero");
 
    struct mini_enc *enc = mn_enc_new(type_from_str(type));
+   if (!enc)
+      die("out of memory:");
+   mn_enc_set_timing(enc, stats);
+   struct profile prof = {0};
+   set_layout(enc, layout, profile, &prof);
+   mn_enc_set_format(enc, aut_format_from_str(format));
+   mn_enc_set_overlap(enc, overlap);
+   mn_enc_set_counts(enc, counts_from_str(counts));
+   mn_enc_set_native(enc, native);
+   if (unsorted) {
+      int ret = mn_enc_set_unsorted(enc, memory << 20);
+      if (ret)
+         die("cannot switch to unsorted mode: %s", mn_strerror(ret));
+   }
+
+   /* In streaming mode, the automaton is written while words are added. */
+   const char *path = *argv;
+   FILE *fp = NULL;
+   if (stream) {
+      fp = fopen(path, "w+b");
+      if (!fp)
+         die("cannot open '%s' for writing:", path);
+      int ret = mn_enc_set_stream(enc, fp);
+      if (ret)
+         die("cannot switch to streaming mode: %s", mn_strerror(ret));
+   }
+   if (threads > 1 && !unsorted) {
+      add_words_batch(enc, threads);
+   } else {
+      add_words(enc);
+   }
+
+   if (!fp) {
+      fp = fopen(path, "wb");
+      if (!fp)
+         die("cannot open '%s' for writing:", path);
+   }
+   int ret = mn_enc_dump_file(enc, fp);
+   if (ret)
+      die("cannot dump automaton: %s", mn_strerror(ret));
+   if (fclose(fp))
+      die("IO error:");
+
+   if (stats)
+      print_stats(enc);
+   mn_enc_free(enc);
+   free_profile(&prof);
+}
+
+static struct mini *load(const char *path)
+{
+   FILE *fp = fopen(path, "rb");
+   if (!fp)
+      die("cannot open '%s':", path);
+
+   struct mini *mn;
+   int ret = mn_load_mmap(&mn, fp);
+   fclose(fp);
+   if (ret)
+      die("cannot load automaton '%s': %s", path, mn_strerror(ret));
+   return mn;
+}
+
+static void merge(int argc, char **argv)
+{
+   const char *type = NULL;
+   bool stream = false;
+   const char *format = "fixed";
+   const char *counts = "full";
+   bool native = false;
+   struct option opts[] = {
+      {'t', "type", OPT_STR(type)},
+      {'S', "stream", OPT_BOOL(stream)},
+      {'f', "format", OPT_STR(format)},
+      {'c', "counts", OPT_STR(counts)},
+      {'n', "native", OPT_BOOL(native)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 3)
+      die("wrong number of arguments");
+
+   struct mini *mn1 = load(argv[0]);
+   struct mini *mn2 = load(argv[1]);
+   struct mini_enc *enc = mn_enc_new(type ? type_from_str(type) : mn_type(mn1));
+   if (!enc)
+      die("out of memory:");
+   mn_enc_set_format(enc, aut_format_from_str(format));
+   mn_enc_set_counts(enc, counts_from_str(counts));
+   mn_enc_set_native(enc, native);
+
+   const char *path = argv[2];
+   FILE *fp = fopen(path, stream ? "w+b" : "wb");
+   if (!fp)
+      die("cannot open '%s' for writing:", path);
+   if (stream) {
+      int ret = mn_enc_set_stream(enc, fp);
+      if (ret)
+         die("cannot switch to streaming mode: %s", mn_strerror(ret));
+   }
+   int ret = mn_merge(enc, mn1, mn2);
+   if (ret)
+      die("cannot merge automata: %s", mn_strerror(ret));
+   mn_free(mn1);
+   mn_free(mn2);
+
+   ret = mn_enc_dump_file(enc, fp);
+   if (ret)
+      die("cannot dump automaton: %s", mn_strerror(ret));
+   if (fclose(fp))
+      die("IO error:");
+   mn_enc_free(enc);
+}
+
+/* The automaton is encoded again, as its states are reordered at dump time. */
+static void relayout(int argc, char **argv)
+{
+   const char *layout = NULL;
+   const char *profile = NULL;
+   struct option opts[] = {
+      {'l', "layout", OPT_STR(layout)},
+      {'p', "profile", OPT_STR(profile)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 2)
+      die("wrong number of arguments");
+
+   struct mini *mn = load(argv[0]);
+   struct mini_enc *enc = mn_enc_new(mn_type(mn));
+   if (!enc)
+      die("out of memory:");
+   mn_enc_set_format(enc, mn_format(mn));
+   mn_enc_set_counts(enc, mn_counts(mn));
+   mn_enc_set_native(enc, mn_native(mn));
+   struct profile prof = {0};
+   set_layout(enc, layout ? layout : profile ? "profile" : "dfs", profile, &prof);
+
+   struct mini_iter it;
+   mn_iter_init(&it, mn);
    const char *word;
-   size_t len, line_no;
-   while ((word = read_line(&len, &line_no))) {
+   size_t len;
+   while ((word = mn_iter_next(&it, &len))) {
       int ret = mn_enc_add(enc, word, len);
       if (ret)
-         die("cannot add word '%s' at line %zu: %s", word, line_no, mn_strerror(ret));
+         die("cannot add word '%s': %s", word, mn_strerror(ret));
    }
+   mn_free(mn);
 
-   const char *path = *argv;
+   const char *path = argv[1];
    FILE *fp = fopen(path, "wb");
    if (!fp)
       die("cannot open '%s' for writing:", path);
@@ -64,8 +508,8 @@ static void create(int argc, char **argv)
       die("cannot dump automaton: %s", mn_strerror(ret));
    if (fclose(fp))
       die("IO error:");
-
    mn_enc_free(enc);
+   free_profile(&prof);
 }
 
 static enum mn_dump_format format_from_str(const char *name)
@@ -91,29 +535,134 @@ static void dump(int argc, char **argv)
       die("wrong number of arguments");
 
    enum mn_dump_format fmt = format_from_str(format);
+   struct mini *mn = load(*argv);
+
+   int ret = mn_dump(mn, stdout, fmt);
+   if (ret)
+      die("cannot dump automaton: %s", mn_strerror(ret));
+
+   mn_free(mn);
+}
+
+/* Bytes of the array written by embed, and number of them on the current line. */
+struct embed_output {
+   uint64_t size;
+   unsigned column;
+};
+
+static int embed_write(void *arg, const void *data, size_t size)
+{
+   struct embed_output *out = arg;
+   const unsigned char *bytes = data;
+
+   for (size_t i = 0; i < size; i++) {
+      if (out->column == 12) {
+         putchar('\n');
+         out->column = 0;
+      }
+      printf(out->column ? " 0x%02x," : "   0x%02x,", bytes[i]);
+      out->column++;
+   }
+   out->size += size;
+   return ferror(stdout);
+}
+
+static void embed(int argc, char **argv)
+{
+   const char *name = NULL;
+   struct option opts[] = {
+      {'n', "name", OPT_STR(name)},
+      {0}
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+
+   /* The default name is the one of the file, without directories. */
    const char *path = *argv;
-   FILE *fp = fopen(path, "rb");
-   if (!fp)
-      die("cannot open '%s':", path);
+   const char *base = strrchr(path, '/');
+   char *ident = strdup(name ? name : base ? base + 1 : path);
+   if (!ident)
+      die("out of memory:");
+   for (char *c = ident; *c; c++) {
+      if (!isalnum((unsigned char)*c))
+         *c = '_';
+   }
+   if (!*ident || isdigit((unsigned char)*ident))
+      die("invalid array name: '%s'", ident);
 
-   struct mini *mn;
-   int ret = mn_load_file(&mn, fp);
-   fclose(fp);
+   struct mini *mn = load(path);
+   const uint16_t one = 1;
+   printf("/* Generated by \"mini embed\" from '%s'.\n"
+          " * Automaton in the native layout of %s-endian hosts, for mn_wrap().\n"
+          " */\n"
+          "#include <stddef.h>\n"
+          "\n"
+          "_Alignas(8) const unsigned char %s[] = {\n",
+          path, *(const uint8_t *)&one ? "little" : "big", ident);
+   struct embed_output out = {0};
+   int ret = mn_save_native(mn, embed_write, &out);
    if (ret)
-      die("cannot load automaton: %s", mn_strerror(ret));
+      die("cannot write automaton: %s", mn_strerror(ret));
+   printf("\n};\n"
+          "\n"
+          "const size_t %s_size = %"PRIu64";\n", ident, out.size);
+   if (fflush(stdout) || ferror(stdout))
+      die("IO error:");
+
+   mn_free(mn);
+   free(ident);
+}
 
-   ret = mn_dump(mn, stdout, fmt);
+static void publish(int argc, char **argv)
+{
+   parse_options(NULL, NULL, &argc, &argv);
+   if (argc != 2)
+      die("wrong number of arguments");
+
+   struct mini *mn = load(argv[0]);
+   int ret = mn_publish(mn, argv[1]);
+   if (ret == MN_EIO)
+      die("cannot publish automaton as '%s':", argv[1]);
    if (ret)
-      die("cannot dump automaton: %s", mn_strerror(ret));
+      die("cannot publish automaton as '%s': %s", argv[1], mn_strerror(ret));
+   mn_free(mn);
+}
 
+static void verify(int argc, char **argv)
+{
+   parse_options(NULL, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+
+   struct mini *mn = load(*argv);
+   int ret = mn_verify(mn);
+   if (ret)
+      die("automaton '%s' is invalid: %s", *argv, mn_strerror(ret));
    mn_free(mn);
 }
 
+static void unpublish(int argc, char **argv)
+{
+   parse_options(NULL, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+
+   if (mn_unpublish(*argv))
+      die("cannot remove '%s':", *argv);
+}
+
 int main(int argc, char **argv)
 {
    struct command cmds[] = {
       {"create", create},
       {"dump", dump},
+      {"embed", embed},
+      {"merge", merge},
+      {"publish", publish},
+      {"relayout", relayout},
+      {"unpublish", unpublish},
+      {"verify", verify},
       {0}
    };
    const char *help =
@@ -3,6 +3,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../mini.h"
 
@@ -33,6 +35,15 @@ static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 #define MN_MT "mini"
 #define MN_ENC_MT "mini.enc"
 #define MN_ITER_MT "mini.iter"
+#define MN_OV_MT "mini.overlay"
+
+struct mini_lua_enc {
+   struct mini_enc *enc;
+   FILE *stream;        /* Output file in streaming mode, or NULL. */
+   const void **queries;   /* Sample queries of the profile-guided layout. */
+   size_t *query_lens;
+   int queries_ref;     /* Reference to a table anchoring these queries. */
+};
 
 static int mn_lua_enc_new(lua_State *lua)
 {
@@ -43,8 +54,12 @@ static int mn_lua_enc_new(lua_State *lua)
    };
    enum mn_type type = luaL_checkoption(lua, 1, "standard", types);
 
-   struct mini_enc **enc = lua_newuserdata(lua, sizeof *enc);
-   *enc = mn_enc_new(type);
+   struct mini_lua_enc *enc = lua_newuserdata(lua, sizeof *enc);
+   enc->enc = mn_enc_new(type);
+   enc->stream = NULL;
+   enc->queries = NULL;
+   enc->query_lens = NULL;
+   enc->queries_ref = LUA_NOREF;
 
    luaL_getmetatable(lua, MN_ENC_MT);
    lua_setmetatable(lua, -2);
@@ -53,11 +68,65 @@ static int mn_lua_enc_new(lua_State *lua)
 
 static int mn_lua_enc_add(lua_State *lua)
 {
-   struct mini_enc **enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
    size_t len;
    const void *word = luaL_checklstring(lua, 2, &len);
 
-   int ret = mn_enc_add(*enc, word, len);
+   int ret = mn_enc_add(enc->enc, word, len);
+   if (ret) {
+      /* Programming error. */
+      lua_pushstring(lua, mn_strerror(ret));
+      return lua_error(lua);
+   }
+   return 0;
+}
+
+static int mn_lua_enc_add_buffer(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   size_t size, delim_len;
+   const char *data = luaL_checklstring(lua, 2, &size);
+   const char *delim = luaL_optlstring(lua, 3, "\n", &delim_len);
+   luaL_argcheck(lua, delim_len == 1, 3, "expect a single byte");
+
+   size_t offset;
+   int ret = mn_enc_add_buffer(enc->enc, data, size, (unsigned char)*delim, &offset);
+   if (ret) {
+      /* Programming error. */
+      return luaL_error(lua, "%s (at offset %d)", mn_strerror(ret), (int)offset);
+   }
+   return 0;
+}
+
+static int mn_lua_enc_add_batch(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   luaL_checktype(lua, 2, LUA_TTABLE);
+   unsigned threads = luaL_optnumber(lua, 3, 1);
+
+   /* Strings are anchored in the table meanwhile. */
+   const size_t nr = lua_rawlen(lua, 2);
+   const void **words = malloc((nr + 1) * sizeof *words);
+   size_t *lens = malloc((nr + 1) * sizeof *lens);
+   if (!words || !lens) {
+      free(words);
+      free(lens);
+      return luaL_error(lua, "out of memory");
+   }
+   for (size_t i = 0; i < nr; i++) {
+      lua_rawgeti(lua, 2, i + 1);
+      words[i] = lua_tolstring(lua, -1, &lens[i]);
+      lua_pop(lua, 1);
+      if (!words[i]) {
+         free(words);
+         free(lens);
+         return luaL_error(lua, "bad value at index %d (expect string)", (int)i + 1);
+      }
+   }
+
+   int ret = mn_enc_add_batch(enc->enc, words, lens, nr, threads);
+   free(words);
+   free(lens);
    if (ret) {
       /* Programming error. */
       lua_pushstring(lua, mn_strerror(ret));
@@ -66,19 +135,83 @@ static int mn_lua_enc_add(lua_State *lua)
    return 0;
 }
 
+static int mn_lua_enc_set_unsorted(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   size_t max_memory = luaL_checknumber(lua, 2);
+
+   int ret = mn_enc_set_unsorted(enc->enc, max_memory);
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, mn_strerror(ret));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
+/* Switches back to the default mode, if in streaming mode. */
+static void mn_lua_enc_close_stream(struct mini_lua_enc *enc)
+{
+   if (enc->stream) {
+      fclose(enc->stream);
+      enc->stream = NULL;
+   }
+}
+
+static int mn_lua_enc_set_stream(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   const char *path = luaL_optstring(lua, 2, NULL);
+
+   int ret = mn_enc_set_stream(enc->enc, NULL);
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, mn_strerror(ret));
+      return 2;
+   }
+   mn_lua_enc_close_stream(enc);
+   if (!path) {
+      lua_pushboolean(lua, 1);
+      return 1;
+   }
+
+   FILE *fp = fopen(path, "w+b");
+   if (!fp) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, strerror(errno));
+      return 2;
+   }
+   ret = mn_enc_set_stream(enc->enc, fp);
+   if (ret) {
+      fclose(fp);
+      lua_pushnil(lua);
+      lua_pushstring(lua, mn_strerror(ret));
+      return 2;
+   }
+   enc->stream = fp;
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
 static int mn_lua_enc_dump(lua_State *lua)
 {
-   struct mini_enc **enc = luaL_checkudata(lua, 1, MN_ENC_MT);
-   const char *path = luaL_checkstring(lua, 2);
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   const char *path = enc->stream ? luaL_optstring(lua, 2, NULL) : luaL_checkstring(lua, 2);
 
-   FILE *fp = fopen(path, "wb");
+   /* The output file of the streaming mode is kept open until the encoder is
+    * cleared, for further dumps.
+    */
+   FILE *fp = path ? fopen(path, "wb") : enc->stream;
    if (!fp) {
       lua_pushnil(lua);
       lua_pushstring(lua, strerror(errno));
       return 2;
    }
 
-   int ret = mn_enc_dump_file(*enc, fp);
+   int ret = mn_enc_dump_file(enc->enc, fp);
+   if (ret && fp != enc->stream)
+      fclose(fp);
    switch (ret) {
    case MN_OK:
       break;
@@ -92,7 +225,7 @@ static int mn_lua_enc_dump(lua_State *lua)
       return lua_error(lua);
    }
 
-   if (fclose(fp)) {
+   if (fp != enc->stream && fclose(fp)) {
       lua_pushnil(lua);
       lua_pushstring(lua, strerror(errno));
       return 2;
@@ -101,17 +234,146 @@ static int mn_lua_enc_dump(lua_State *lua)
    return 1;
 }
 
+static void mn_lua_enc_free_queries(lua_State *lua, struct mini_lua_enc *enc)
+{
+   free(enc->queries);
+   free(enc->query_lens);
+   enc->queries = NULL;
+   enc->query_lens = NULL;
+   luaL_unref(lua, LUA_REGISTRYINDEX, enc->queries_ref);
+   enc->queries_ref = LUA_NOREF;
+}
+
+static int mn_lua_enc_set_layout(lua_State *lua)
+{
+   static const char *const layouts[] = {
+      [MN_LAYOUT_DEFAULT] = "default",
+      [MN_LAYOUT_BFS] = "bfs",
+      [MN_LAYOUT_DFS] = "dfs",
+      [MN_LAYOUT_PROFILE] = "profile",
+      NULL
+   };
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   enum mn_layout layout = luaL_checkoption(lua, 2, NULL, layouts);
+   if (layout == MN_LAYOUT_PROFILE)
+      luaL_checktype(lua, 3, LUA_TTABLE);
+
+   mn_enc_set_layout(enc->enc, MN_LAYOUT_DEFAULT, NULL, NULL, 0);
+   mn_lua_enc_free_queries(lua, enc);
+   if (layout != MN_LAYOUT_PROFILE) {
+      mn_enc_set_layout(enc->enc, layout, NULL, NULL, 0);
+      return 0;
+   }
+
+   /* Queries must stay valid until the automaton is dumped, so they are
+    * anchored in a private copy of the table.
+    */
+   const size_t nr = lua_rawlen(lua, 3);
+   enc->queries = malloc((nr + 1) * sizeof *enc->queries);
+   enc->query_lens = malloc((nr + 1) * sizeof *enc->query_lens);
+   if (!enc->queries || !enc->query_lens) {
+      mn_lua_enc_free_queries(lua, enc);
+      return luaL_error(lua, "out of memory");
+   }
+   lua_createtable(lua, nr, 0);
+   for (size_t i = 0; i < nr; i++) {
+      lua_rawgeti(lua, 3, i + 1);
+      enc->queries[i] = lua_tolstring(lua, -1, &enc->query_lens[i]);
+      if (!enc->queries[i]) {
+         mn_lua_enc_free_queries(lua, enc);
+         return luaL_error(lua, "bad value at index %d (expect string)", (int)i + 1);
+      }
+      lua_rawseti(lua, -2, i + 1);
+   }
+   enc->queries_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+   mn_enc_set_layout(enc->enc, layout, enc->queries, enc->query_lens, nr);
+   return 0;
+}
+
+static const char *const formats[] = {
+   [MN_FORMAT_FIXED] = "fixed",
+   [MN_FORMAT_COMPACT] = "compact",
+   [MN_FORMAT_PACKED] = "packed",
+   NULL
+};
+
+static int mn_lua_enc_set_format(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   mn_enc_set_format(enc->enc, luaL_checkoption(lua, 2, NULL, formats));
+   return 0;
+}
+
+static const char *const count_formats[] = {
+   [MN_COUNTS_FULL] = "full",
+   [MN_COUNTS_NARROW] = "narrow",
+   [MN_COUNTS_INTERLEAVED] = "interleaved",
+   NULL
+};
+
+static int mn_lua_enc_set_counts(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   mn_enc_set_counts(enc->enc, luaL_checkoption(lua, 2, NULL, count_formats));
+   return 0;
+}
+
+static int mn_lua_enc_set_overlap(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   mn_enc_set_overlap(enc->enc, lua_toboolean(lua, 2));
+   return 0;
+}
+
+static int mn_lua_enc_set_native(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   mn_enc_set_native(enc->enc, lua_toboolean(lua, 2));
+   return 0;
+}
+
 static int mn_lua_enc_clear(lua_State *lua)
 {
-   struct mini_enc **enc = luaL_checkudata(lua, 1, MN_ENC_MT);
-   mn_enc_clear(*enc);
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   mn_enc_clear(enc->enc);
+   mn_lua_enc_close_stream(enc);
    return 0;
 }
 
+static int mn_lua_enc_peak_memory(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   lua_pushnumber(lua, mn_enc_peak_memory(enc->enc));
+   return 1;
+}
+
+static int mn_lua_enc_stats(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   struct mn_enc_stats stats;
+   mn_enc_stats(enc->enc, &stats);
+
+   lua_createtable(lua, 0, 8);
+#define SET_STAT(name) (lua_pushnumber(lua, stats.name), lua_setfield(lua, -2, #name))
+   SET_STAT(states_created);
+   SET_STAT(states_merged);
+   SET_STAT(probes);
+   SET_STAT(max_probes);
+   SET_STAT(buckets);
+   SET_STAT(load_factor);
+   SET_STAT(minimize_time);
+   SET_STAT(peak_memory);
+   SET_STAT(overlap_saved);
+#undef SET_STAT
+   return 1;
+}
+
 static int mn_lua_enc_free(lua_State *lua)
 {
-   struct mini_enc **enc = luaL_checkudata(lua, 1, MN_ENC_MT);
-   mn_enc_free(*enc);
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   mn_enc_free(enc->enc);
+   mn_lua_enc_close_stream(enc);
+   mn_lua_enc_free_queries(lua, enc);
    return 0;
 }
 
@@ -125,6 +387,8 @@ struct mini_lua {
 static int mn_lua_load(lua_State *lua)
 {
    const char *path = luaL_checkstring(lua, 1);
+   const int map = lua_toboolean(lua, 2);
+   unsigned threads = luaL_optnumber(lua, 3, 1);
    struct mini_lua *fsa = lua_newuserdata(lua, sizeof *fsa);
 
    FILE *fp = fopen(path, "rb");
@@ -134,7 +398,7 @@ static int mn_lua_load(lua_State *lua)
       return 2;
    }
 
-   int ret = mn_load_file(&fsa->fsa, fp);
+   int ret = map ? mn_load_mmap(&fsa->fsa, fp) : mn_load_parallel(&fsa->fsa, fp, threads);
    fclose(fp);
    if (ret) {
       lua_pushnil(lua);
@@ -149,6 +413,37 @@ static int mn_lua_load(lua_State *lua)
    return 1;
 }
 
+static int mn_lua_attach(lua_State *lua)
+{
+   const char *name = luaL_checkstring(lua, 1);
+   struct mini_lua *fsa = lua_newuserdata(lua, sizeof *fsa);
+
+   int ret = mn_attach(&fsa->fsa, name);
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, ret == MN_EIO ? strerror(errno) : mn_strerror(ret));
+      return 2;
+   }
+
+   fsa->lua_ref = LUA_NOREF;
+   fsa->ref_cnt = 0;
+   luaL_getmetatable(lua, MN_MT);
+   lua_setmetatable(lua, -2);
+   return 1;
+}
+
+static int mn_lua_unpublish(lua_State *lua)
+{
+   const char *name = luaL_checkstring(lua, 1);
+   if (mn_unpublish(name)) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, strerror(errno));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
 static int mn_lua_free(lua_State *lua)
 {
    struct mini_lua *fsa = luaL_checkudata(lua, 1, MN_MT);
@@ -163,6 +458,21 @@ static const struct mini *check_fsa(lua_State *lua)
    return fsa->fsa;
 }
 
+static int mn_lua_enc_merge(lua_State *lua)
+{
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 1, MN_ENC_MT);
+   const struct mini_lua *fsa1 = luaL_checkudata(lua, 2, MN_MT);
+   const struct mini_lua *fsa2 = luaL_checkudata(lua, 3, MN_MT);
+
+   int ret = mn_merge(enc->enc, fsa1->fsa, fsa2->fsa);
+   if (ret) {
+      /* Programming error. */
+      lua_pushstring(lua, mn_strerror(ret));
+      return lua_error(lua);
+   }
+   return 0;
+}
+
 static int mn_lua_contains(lua_State *lua)
 {
    const struct mini *fsa = check_fsa(lua);
@@ -211,6 +521,111 @@ static int mn_lua_locate(lua_State *lua)
    return 1;
 }
 
+static int mn_lua_format(lua_State *lua)
+{
+   const struct mini *fsa = check_fsa(lua);
+   lua_pushstring(lua, formats[mn_format(fsa)]);
+   return 1;
+}
+
+static int mn_lua_counts(lua_State *lua)
+{
+   const struct mini *fsa = check_fsa(lua);
+   lua_pushstring(lua, count_formats[mn_counts(fsa)]);
+   return 1;
+}
+
+static int mn_lua_file_write(void *fp, const void *data, size_t size)
+{
+   return fwrite(data, 1, size, fp) != size;
+}
+
+static int mn_lua_save(lua_State *lua)
+{
+   const struct mini *fsa = check_fsa(lua);
+   const char *path = luaL_checkstring(lua, 2);
+
+   FILE *fp = fopen(path, "wb");
+   if (!fp) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, strerror(errno));
+      return 2;
+   }
+   int ret = mn_save_native(fsa, mn_lua_file_write, fp);
+   if (fclose(fp) && !ret)
+      ret = MN_EIO;
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, ret == MN_EIO ? strerror(errno) : mn_strerror(ret));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
+static int mn_lua_verify(lua_State *lua)
+{
+   int ret = mn_verify(check_fsa(lua));
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, mn_strerror(ret));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
+static int mn_lua_publish(lua_State *lua)
+{
+   const struct mini *fsa = check_fsa(lua);
+   const char *name = luaL_checkstring(lua, 2);
+
+   int ret = mn_publish(fsa, name);
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, ret == MN_EIO ? strerror(errno) : mn_strerror(ret));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
+static int mn_lua_advise(lua_State *lua)
+{
+   static const char *const hints[] = {"huge_pages", "prefault", "lock", NULL};
+   struct mini_lua *fsa = luaL_checkudata(lua, 1, MN_MT);
+
+   int flags = 0;
+   for (int i = 2; i <= lua_gettop(lua); i++)
+      flags |= 1 << luaL_checkoption(lua, i, NULL, hints);
+   int ret = mn_advise(fsa->fsa, flags);
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, ret == MN_EIO ? strerror(errno) : mn_strerror(ret));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
+static int mn_lua_accelerate(lua_State *lua)
+{
+   struct mini_lua *fsa = luaL_checkudata(lua, 1, MN_MT);
+   const lua_Integer min_fanout = luaL_optinteger(lua, 2, 8);
+   const lua_Integer max_memory = luaL_optinteger(lua, 3, 1 << 20);
+   luaL_argcheck(lua, min_fanout >= 0 && min_fanout <= UINT_MAX, 2, "invalid fanout");
+   luaL_argcheck(lua, max_memory >= 0, 3, "invalid size");
+
+   int ret = mn_accelerate(fsa->fsa, (unsigned)min_fanout, (size_t)max_memory);
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, mn_strerror(ret));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
 static int mn_lua_type(lua_State *lua)
 {
    const struct mini *fsa = check_fsa(lua);
@@ -328,13 +743,179 @@ static int mn_lua_iter_fini(lua_State *lua)
    return 0;
 }
 
+struct mini_lua_overlay {
+   struct mini_overlay *ov;
+   int base_ref;        /* Reference to the base automaton userdata. */
+};
+
+static int mn_lua_overlay_new(lua_State *lua)
+{
+   struct mini_lua *fsa = luaL_checkudata(lua, 1, MN_MT);
+   struct mini_lua_overlay *ov = lua_newuserdata(lua, sizeof *ov);
+   ov->ov = mn_overlay_new(fsa->fsa);
+   if (!ov->ov)
+      return luaL_error(lua, "out of memory");
+
+   lua_pushvalue(lua, 1);
+   ov->base_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+   luaL_getmetatable(lua, MN_OV_MT);
+   lua_setmetatable(lua, -2);
+   return 1;
+}
+
+static int mn_lua_overlay_free(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   mn_overlay_free(ov->ov);
+   luaL_unref(lua, LUA_REGISTRYINDEX, ov->base_ref);
+   return 0;
+}
+
+static int mn_lua_overlay_update(lua_State *lua,
+                                 int (*update)(struct mini_overlay *, const void *, size_t))
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+
+   int ret = update(ov->ov, word, len);
+   if (ret) {
+      /* Programming error. */
+      lua_pushstring(lua, mn_strerror(ret));
+      return lua_error(lua);
+   }
+   return 0;
+}
+
+static int mn_lua_overlay_insert(lua_State *lua)
+{
+   return mn_lua_overlay_update(lua, mn_overlay_insert);
+}
+
+static int mn_lua_overlay_remove(lua_State *lua)
+{
+   return mn_lua_overlay_update(lua, mn_overlay_remove);
+}
+
+static int mn_lua_overlay_contains(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+
+   lua_pushboolean(lua, mn_overlay_contains(ov->ov, word, len));
+   return 1;
+}
+
+static int mn_lua_overlay_locate(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+
+   uint32_t pos = mn_overlay_locate(ov->ov, word, len);
+   if (pos)
+      lua_pushnumber(lua, pos);
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
+static int mn_lua_overlay_size(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   lua_pushnumber(lua, mn_overlay_size(ov->ov));
+   return 1;
+}
+
+static int mn_lua_overlay_changes(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   lua_pushnumber(lua, mn_overlay_changes(ov->ov));
+   return 1;
+}
+
+static int mn_lua_overlay_iter_next(lua_State *lua)
+{
+   struct mini_overlay_iter *it = lua_touserdata(lua, lua_upvalueindex(1));
+   size_t len;
+   const char *word = mn_overlay_iter_next(it, &len);
+   if (word) {
+      lua_pushlstring(lua, word, len);
+      return 1;
+   }
+   return 0;
+}
+
+static int mn_lua_overlay_iter(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   struct mini_overlay_iter *it = lua_newuserdata(lua, sizeof *it);
+   mn_overlay_iter_init(it, ov->ov);
+
+   /* The overlay is anchored as an upvalue meanwhile. */
+   lua_pushvalue(lua, 1);
+   lua_pushcclosure(lua, mn_lua_overlay_iter_next, 2);
+   return 1;
+}
+
+static int mn_lua_overlay_snapshot(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+
+   int ret = mn_overlay_snapshot(ov->ov);
+   if (ret) {
+      lua_pushstring(lua, mn_strerror(ret));
+      return lua_error(lua);
+   }
+   return 0;
+}
+
+static int mn_lua_overlay_compact(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   struct mini_lua_enc *enc = luaL_checkudata(lua, 2, MN_ENC_MT);
+
+   int ret = mn_overlay_compact(ov->ov, enc->enc);
+   if (ret) {
+      /* Programming error. */
+      lua_pushstring(lua, mn_strerror(ret));
+      return lua_error(lua);
+   }
+   return 0;
+}
+
+static int mn_lua_overlay_rebase(lua_State *lua)
+{
+   struct mini_lua_overlay *ov = luaL_checkudata(lua, 1, MN_OV_MT);
+   struct mini_lua *fsa = luaL_checkudata(lua, 2, MN_MT);
+
+   mn_overlay_rebase(ov->ov, fsa->fsa);
+   luaL_unref(lua, LUA_REGISTRYINDEX, ov->base_ref);
+   lua_pushvalue(lua, 2);
+   ov->base_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+   return 0;
+}
+
 int luaopen_mini(lua_State *lua)
 {
    const luaL_Reg enc_fns[] = {
       {"__gc", mn_lua_enc_free},
       {"add", mn_lua_enc_add},
+      {"add_batch", mn_lua_enc_add_batch},
+      {"add_buffer", mn_lua_enc_add_buffer},
       {"clear", mn_lua_enc_clear},
       {"dump", mn_lua_enc_dump},
+      {"merge", mn_lua_enc_merge},
+      {"peak_memory", mn_lua_enc_peak_memory},
+      {"set_format", mn_lua_enc_set_format},
+      {"set_overlap", mn_lua_enc_set_overlap},
+      {"set_counts", mn_lua_enc_set_counts},
+      {"set_native", mn_lua_enc_set_native},
+      {"set_layout", mn_lua_enc_set_layout},
+      {"set_stream", mn_lua_enc_set_stream},
+      {"set_unsorted", mn_lua_enc_set_unsorted},
+      {"stats", mn_lua_enc_stats},
       {NULL, NULL},
    };
    luaL_newmetatable(lua, MN_ENC_MT);
@@ -349,6 +930,13 @@ int luaopen_mini(lua_State *lua)
       {"extract", mn_lua_extract},
       {"contains", mn_lua_contains},
       {"type", mn_lua_type},
+      {"format", mn_lua_format},
+      {"counts", mn_lua_counts},
+      {"save", mn_lua_save},
+      {"verify", mn_lua_verify},
+      {"publish", mn_lua_publish},
+      {"advise", mn_lua_advise},
+      {"accelerate", mn_lua_accelerate},
       {"size", mn_lua_size},
       {"iter", mn_lua_iter_init},
       {NULL, NULL},
@@ -358,6 +946,26 @@ int luaopen_mini(lua_State *lua)
    lua_setfield(lua, -2, "__index");
    luaL_setfuncs(lua, fns, 0);
 
+   const luaL_Reg ov_fns[] = {
+      {"__gc", mn_lua_overlay_free},
+      {"__len", mn_lua_overlay_size},
+      {"insert", mn_lua_overlay_insert},
+      {"remove", mn_lua_overlay_remove},
+      {"contains", mn_lua_overlay_contains},
+      {"locate", mn_lua_overlay_locate},
+      {"size", mn_lua_overlay_size},
+      {"changes", mn_lua_overlay_changes},
+      {"iter", mn_lua_overlay_iter},
+      {"snapshot", mn_lua_overlay_snapshot},
+      {"compact", mn_lua_overlay_compact},
+      {"rebase", mn_lua_overlay_rebase},
+      {NULL, NULL},
+   };
+   luaL_newmetatable(lua, MN_OV_MT);
+   lua_pushvalue(lua, -1);
+   lua_setfield(lua, -2, "__index");
+   luaL_setfuncs(lua, ov_fns, 0);
+
    luaL_newmetatable(lua, MN_ITER_MT);
    lua_pushliteral(lua, "__gc");
    lua_pushcfunction(lua, mn_lua_iter_fini);
@@ -366,6 +974,9 @@ int luaopen_mini(lua_State *lua)
    const luaL_Reg lib[] = {
       {"encoder", mn_lua_enc_new},
       {"load", mn_lua_load},
+      {"attach", mn_lua_attach},
+      {"unpublish", mn_lua_unpublish},
+      {"overlay", mn_lua_overlay_new},
       {NULL, NULL},
    };
    luaL_newlib(lua, lib);
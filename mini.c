@@ -1,17 +1,44 @@
 #line 1 "api.c"
+#define _POSIX_C_SOURCE 200809L   /* fileno(), fseeko(), ftruncate(), mmap() */
+#define _DEFAULT_SOURCE           /* MAP_ANONYMOUS, madvise() */
+
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <inttypes.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>     /* atomic_thread_fence() */
+#include <fcntl.h>         /* O_CREAT */
 #include <arpa/inet.h>     /* htonl(), ntohl() */
+#include <unistd.h>        /* ftruncate(), pread() */
+#include <sys/mman.h>      /* mmap() */
+#include <sys/stat.h>      /* fstat() */
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#  include <nmmintrin.h>   /* _mm_crc32_u64() */
+#  define MN_HW_CRC32C
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#  include <arm_acle.h>    /* __crc32cd() */
+#  define MN_HW_CRC32C
+#endif
+
+#if defined(__AVX2__)
+#  include <immintrin.h>   /* _mm256_shuffle_epi8() */
+#elif defined(__SSSE3__)
+#  include <tmmintrin.h>   /* _mm_shuffle_epi8() */
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>    /* vrev32q_u8() */
+#endif
 
 #line 1 "api.h"
 #ifndef MINI_H
 #define MINI_H
 
-#define MN_VERSION "0.2"
+#define MN_VERSION "0.3"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -34,6 +61,7 @@ enum {
    MN_EFREEZED,   /* Attempt to add a word to a freezed automaton. */
    MN_E2BIG,      /* Automaton has grown too large. */
    MN_EIO,        /* IO error. */
+   MN_ENATIVE,    /* Automaton not in the native layout of the host. */
 };
 
 /* Returns a string describing an error code. */
@@ -69,6 +97,62 @@ void mn_enc_free(struct mini_enc *);
  */
 int mn_enc_add(struct mini_enc *, const void *word, size_t len);
 
+/* Encodes the words of a buffer, which are separated with a delimiter byte,
+ * e.g. '\n'. Empty words are skipped, and the last word needn't be followed by
+ * a delimiter. This is equivalent to calling mn_enc_add() on each word, but
+ * avoids splitting the buffer beforehand.
+ * On error, the offset of the faulty word in the buffer is stored in "offset",
+ * if it is not NULL. The words preceding it have been added.
+ */
+int mn_enc_add_buffer(struct mini_enc *, const void *data, size_t size,
+                      int delim, size_t *offset);
+
+/* Encodes an array of words, using up to "threads" threads.
+ * Words must satisfy the same constraints as with mn_enc_add(), and must sort
+ * after the words already added. The batch is split into ranges of words that
+ * start with distinct bytes, which are minimized concurrently, and then merged
+ * into the encoder. The resulting automaton is identical to the one that would
+ * be obtained by adding the same words with mn_enc_add().
+ * As with mn_enc_add(), the encoder should be cleared if an error occurs.
+ */
+int mn_enc_add_batch(struct mini_enc *,
+                     const void *const words[], const size_t lens[], size_t nr,
+                     unsigned threads);
+
+/* Switches an encoder to unsorted mode, or back to the default mode if
+ * "max_memory" is zero. This must be done before adding any word, otherwise
+ * MN_EORDER is returned, or MN_EFREEZED if the automaton was dumped.
+ * In unsorted mode, words can be added in any order, and duplicates are
+ * allowed. Words are buffered, and encoded when the automaton is dumped. The
+ * resulting automaton is the same as if the distinct words had been added in
+ * order.
+ * The buffer grows up to "max_memory" bytes. When it is full, its contents are
+ * sorted and written to a temporary file, so memory usage stays bounded. Each
+ * word takes its length plus about 10 bytes in the buffer. Errors related to
+ * temporary files are reported with MN_EIO.
+ */
+int mn_enc_set_unsorted(struct mini_enc *, size_t max_memory);
+
+/* Switches an encoder to streaming mode, or back to the default mode if "fp"
+ * is NULL. This must be done before adding any word, otherwise MN_EORDER is
+ * returned, or MN_EFREEZED if the automaton was dumped.
+ * In streaming mode, the automaton is written to the provided file while it is
+ * being built, as soon as its states are minimized, instead of being kept in
+ * memory until it is dumped. Registered states are read back from the file
+ * through a memory mapping when they must be compared to new ones, so that the
+ * encoder only allocates memory for its states hash table and for the states
+ * along the path of the last word added. The file must be seekable, and opened
+ * in binary mode for both reading and writing (e.g. with mode "w+b"). Its
+ * previous contents are overwritten. Numbered automata additionally need a
+ * temporary file.
+ * The automaton is completed by calling mn_enc_dump_file() with the same file,
+ * which then contains the same bytes as in the default mode. Calling
+ * mn_enc_dump() or mn_enc_dump_file() with another destination copies the
+ * file. mn_enc_clear() switches the encoder back to the default mode. Errors
+ * related to files are reported with MN_EIO.
+ */
+int mn_enc_set_stream(struct mini_enc *, FILE *fp);
+
 /* Dumps an encoded automaton.
  * The provided callback will be called several times for writing the automaton
  * to some file or memory location. It must return zero on success, non-zero on
@@ -93,9 +177,165 @@ int mn_enc_dump_file(struct mini_enc *, FILE *);
 
 /* Clears the internal structures. After this is called, the encoder object can
  * be used again to encode a new set of words.
+ * Memory allocated so far is kept for reuse.
  */
 void mn_enc_clear(struct mini_enc *);
 
+/* Returns the maximum amount of memory, in bytes, used by an encoder since its
+ * creation.
+ * The encoder allocates memory on demand, so that this is proportional to the
+ * size of the automaton being built. This includes the memory used by the
+ * threads of mn_enc_add_batch(), but not the pages of the files mapped in
+ * streaming mode.
+ */
+size_t mn_enc_peak_memory(const struct mini_enc *);
+
+/* Encoder statistics. */
+struct mn_enc_stats {
+   uint64_t states_created;   /* Number of states added to the register. */
+   uint64_t states_merged;    /* Number of states found to be equivalent to a
+                               * state already in the register. */
+   uint64_t probes;           /* Total number of buckets examined while
+                               * looking up states in the register. */
+   uint64_t max_probes;       /* Largest number of buckets examined in a
+                               * single lookup. */
+   size_t buckets;            /* Number of buckets of the register. */
+   double load_factor;        /* Fraction of these buckets that are in use. */
+   double minimize_time;      /* Time spent minimizing, in seconds. */
+   size_t peak_memory;        /* See mn_enc_peak_memory(). */
+   uint64_t overlap_saved;    /* Number of transitions saved by storing
+                               * states inside others, see
+                               * mn_enc_set_overlap(). */
+};
+
+/* Fills a structure with statistics about the construction of the current
+ * automaton. These are reset by mn_enc_clear().
+ * The average probe length is given by:
+ *
+ *    probes / (states_created + states_merged)
+ */
+void mn_enc_stats(const struct mini_enc *, struct mn_enc_stats *);
+
+/* Enables or disables the measurement of the time spent minimizing.
+ * This is disabled by default, because it requires reading the clock each time
+ * a word is added, which noticeably slows down encoding.
+ */
+void mn_enc_set_timing(struct mini_enc *, int enable);
+
+/* Orders of states in an automaton. */
+enum mn_layout {
+   MN_LAYOUT_DEFAULT,   /* Order in which states are minimized, roughly
+                         * reverse post-order. */
+   MN_LAYOUT_BFS,       /* Breadth-first from the start state. */
+   MN_LAYOUT_DFS,       /* Depth-first from the start state. */
+   MN_LAYOUT_PROFILE,   /* Most visited states first, when looking up a
+                         * sample of queries, then depth-first. */
+};
+
+/* Chooses the order in which states are laid out when the automaton is
+ * dumped. The resulting automaton has the same words and ordinals, but states
+ * used together are closer in memory, so that lookups incur fewer cache
+ * misses. The breadth-first order groups the states near the start state, the
+ * depth-first one the states along each path. When lookups are spread evenly
+ * over the lexicon, the default order, which is close to depth-first, is
+ * already good; the profile-guided order pays off when some words are looked
+ * up much more often than others. The profile-guided order needs
+ * a sample of queries, typically taken from a query log, which must stay valid
+ * until the automaton is dumped; it is ignored for other layouts.
+ * Reordering needs about three times as much memory as the automaton itself,
+ * and is not done in streaming mode. The layout is kept by mn_enc_clear().
+ */
+void mn_enc_set_layout(struct mini_enc *, enum mn_layout,
+                       const void *const queries[], const size_t lens[], size_t nr);
+
+/* Encodings of transitions in a dumped automaton. */
+enum mn_format {
+   MN_FORMAT_FIXED,     /* 32 or 64 bits per transition. */
+   MN_FORMAT_COMPACT,   /* Variable-length transitions. */
+   MN_FORMAT_PACKED,    /* As few bits per transition as possible. */
+};
+
+/* Chooses how transitions are encoded when the automaton is dumped.
+ * The fixed format, which is the default, stores each transition as a 32 or
+ * 64 bits integer, plus a 32 bits count for numbered automata. The compact
+ * format stores the label and flags of a transition in two bytes, followed by
+ * its destination and count in as few bytes as needed. States are laid out
+ * depth-first, so that the last transition of a state can often lead to the
+ * state that immediately follows, and need no destination at all. Numbered
+ * automata, and automata of more than 2^22 transitions, are typically 40 to
+ * 60% smaller; smaller standard automata only shrink by about 10%. Lookups are
+ * slower, by up to a factor of two when the automaton fits in the CPU caches,
+ * much less otherwise.
+ * The packed format is the fixed one, with destinations of just as many bits
+ * as needed to address all transitions, and counts of just as many bits as
+ * needed to store the number of words, so that a lexicon of 100,000
+ * transitions takes 27 bits per transition instead of 32. This pays off most
+ * for numbered automata, and for automata of more than 2^22 transitions, which
+ * the fixed format stores on 64 bits. Transitions are still accessed in
+ * constant time, but decoding them makes lookups up to 30% slower, unless
+ * packing lets the automaton fit in a faster level of the CPU caches.
+ * Automata whose transitions would need more than 57 bits are written in the
+ * fixed format.
+ * The state layout is ignored for compact automata, and the format is ignored
+ * in streaming mode. The format is kept by mn_enc_clear().
+ */
+void mn_enc_set_format(struct mini_enc *, enum mn_format);
+
+/* Enables or disables the storage of states inside others.
+ * When the transitions of a state are the last ones of another state, they
+ * are not stored a second time: transitions leading to the first state lead
+ * to the middle of the second one instead. The resulting automaton has the
+ * same words and ordinals, and lookups are as fast, but it is smaller: by 4%
+ * for a lexicon of English words, by less for random strings. This is done
+ * when the automaton is dumped, after the states are reordered, and needs
+ * about three times as much memory as the automaton itself. It is not done
+ * for compact automata, nor in streaming mode. This is disabled by default,
+ * and the setting is kept by mn_enc_clear().
+ */
+void mn_enc_set_overlap(struct mini_enc *, int enable);
+
+/* Encodings of per-transition counts in a numbered automaton. */
+enum mn_counts {
+   MN_COUNTS_FULL,         /* 32 bits per count. */
+   MN_COUNTS_NARROW,       /* 8 bits per count, larger ones stored apart. */
+   MN_COUNTS_INTERLEAVED,  /* 32 bits per count, next to its transition. */
+};
+
+/* Chooses how the counts of numbered automata are stored, when transitions are
+ * in the fixed format. By default, each count takes 32 bits, as much as a
+ * transition of a small automaton. Yet most counts are tiny, as most
+ * transitions lead to a handful of words: narrow counts are stored on a
+ * single byte, and the few counts of 255 or more in a separate table, which
+ * is indexed with a bitmap of 64 transitions plus a 32 bits rank per block.
+ * This takes 9.5 bits per transition instead of 32, so that automata of
+ * 32 bits transitions are about 35% smaller, and others about 23% smaller.
+ * mn_locate(), mn_extract() and the numbered iterators are as fast when the
+ * automaton doesn't fit in the CPU caches, but up to 25% slower otherwise, as
+ * the counts of the transitions near the start state are all stored apart.
+ * Interleaved counts are stored right after their transition, instead of in
+ * an array of their own, so that the automaton is as large as with full
+ * counts, but a transition and its count are in the same cache line. On
+ * automata larger than the CPU caches, this makes mn_extract(), which reads
+ * the count of every transition it visits, 10 to 25% faster, but mn_locate(),
+ * which only reads the counts of the transitions it skips, about 5% slower,
+ * as states then span more cache lines.
+ * This is ignored for other formats, which already store counts in fewer bits,
+ * and in streaming mode. The setting is kept by mn_enc_clear().
+ */
+void mn_enc_set_counts(struct mini_enc *, enum mn_counts);
+
+/* Enables or disables the native layout. Native automata are written exactly
+ * as they are laid out in memory once loaded, with the transitions and counts
+ * of the fixed format in the byte order of the host, so that mn_load_mem()
+ * and mn_load_mmap() can use them in place, in constant time, instead of
+ * reading and converting them. They are a few bytes larger, because of
+ * padding, and can be loaded on any host, and with any loading function, but
+ * hosts of the other byte order have to convert them as usual. This is
+ * ignored in streaming mode. This is disabled by default, and the setting is
+ * kept by mn_enc_clear().
+ */
+void mn_enc_set_native(struct mini_enc *, int enable);
+
 
 /*******************************************************************************
  * Reader
@@ -104,6 +344,7 @@ void mn_enc_clear(struct mini_enc *);
 struct mini;
 
 /* Loads an automaton.
+ * Automata created with previous versions of this library can be loaded, too.
  * The provided callback will be called several times for reading the automaton.
  * It should return zero on success, non-zero on failure. A short read must be
  * considered as an error.
@@ -119,15 +360,159 @@ int mn_load(struct mini **,
  */
 int mn_load_file(struct mini **, FILE *);
 
+/* Same as mn_load_file(), but reads and converts large automata with up to
+ * "threads" threads. The file is split into pieces of a few megabytes, each of
+ * which is read with pread() and converted to host order by the thread that
+ * read it. This is only done if the file is a regular one.
+ */
+int mn_load_parallel(struct mini **, FILE *, unsigned threads);
+
+/* Loads an automaton from a buffer of "size" bytes, which must stay valid and
+ * unmodified until the automaton is freed. Native automata written on a host
+ * of the same byte order, see mn_enc_set_native(), are used in place, if the
+ * buffer is aligned on eight bytes: this takes constant time, and only a few
+ * bytes of memory. Their contents are then trusted, apart from the header,
+ * which is checked as usual. Other automata are copied, as with mn_load().
+ * Data following the automaton in the buffer is ignored.
+ */
+int mn_load_mem(struct mini **, const void *data, size_t size);
+
+/* Loads an automaton from a file, by mapping it in memory. The automaton
+ * starts at the current position of the file, which is left unchanged. Native
+ * automata are used in place, as with mn_load_mem(): the pages of the file are
+ * then shared with other processes that map it, and read from disk when they
+ * are first accessed. The file can be closed afterwards, but must not be
+ * modified while the automaton is in use. Other automata are copied from the
+ * mapping. Files that can't be mapped, such as pipes, are read as with
+ * mn_load_file(), which moves their position past the automaton.
+ */
+int mn_load_mmap(struct mini **, FILE *);
+
+/* Same as mn_load_mem(), but never copies the automaton: fails with
+ * MN_ENATIVE if it can't be used in place. This is meant for automata compiled
+ * into a program, as generated by "mini embed", which then take no time and
+ * no memory to load, apart from a small allocation.
+ */
+int mn_wrap(struct mini **, const void *data, size_t size);
+
+/* Checks the structure of a loaded automaton. Loading functions only check the
+ * header, which is protected by a checksum, so that they stay fast, and take
+ * constant time for automata used in place. This checks, in time linear in
+ * the size of the automaton, that the transitions of every state reachable
+ * from the start state lead to states within the automaton, that they end
+ * with a last transition and are sorted by label, that words are at most
+ * MN_MAX_WORD_LEN bytes long, so that the automaton is acyclic, and that
+ * counts match the number of words recognized from the transitions they
+ * belong to, and the number of words in the header. Once this succeeds, no
+ * function reads out of the bounds of the automaton, whatever its contents.
+ * Memory used is about 18 bytes per transition, or per byte of transitions if
+ * compact. Returns MN_ECORRUPT if a check fails.
+ */
+int mn_verify(const struct mini *);
+
+/* Writes an automaton as a native one, see mn_enc_set_native(), whatever the
+ * way it was created. Its words, format and counts encoding are unchanged.
+ * The provided callback is called as with mn_enc_dump().
+ */
+int mn_save_native(const struct mini *,
+                   int (*write)(void *arg, const void *data, size_t size),
+                   void *arg);
+
+/* Copies an automaton to a POSIX shared memory segment named "name", such as
+ * "/words", as a native one, see mn_save_native(), so that other processes can
+ * use it with mn_attach() without loading it. A segment of the same name is
+ * replaced, but processes attached to it keep using it. The segment lasts
+ * until it is removed with mn_unpublish(), or the host reboots. Returns
+ * MN_EIO if it can't be created.
+ */
+int mn_publish(const struct mini *, const char *name);
+
+/* Uses an automaton published with mn_publish() in place, read-only, as with
+ * mn_wrap(): all the processes attached to a segment share its pages, so that
+ * it takes memory once per host, and not once per process. Returns MN_EIO if
+ * there is no such segment, MN_EMAGIC if it is still being published, and
+ * MN_ENATIVE if it was published on a host of another byte order.
+ */
+int mn_attach(struct mini **, const char *name);
+
+/* Removes a segment created with mn_publish(). Processes attached to it keep
+ * using it until they free their automaton. Returns MN_EIO if there is no such
+ * segment.
+ */
+int mn_unpublish(const char *name);
+
+/* Memory hints, for mn_advise(). */
+enum {
+   MN_ADVISE_HUGE_PAGES = 1 << 0,
+   MN_ADVISE_PREFAULT = 1 << 1,
+   MN_ADVISE_LOCK = 1 << 2,
+};
+
+/* Changes the way the arrays of a loaded automaton are kept in memory, to
+ * make lookups in large automata faster. "flags" is a combination of:
+ * - MN_ADVISE_HUGE_PAGES: back the automaton with huge pages, so that random
+ *   lookups miss the TLB less often. Copied automata of at least 2 MB are
+ *   moved to memory that is allocated with MAP_HUGETLB if huge pages are
+ *   reserved, or aligned on 2 MB and marked with MADV_HUGEPAGE otherwise.
+ *   Automata used in place by mn_load_mmap() are marked with MADV_HUGEPAGE,
+ *   which only has an effect on file systems that support it. This is a hint,
+ *   and never fails.
+ * - MN_ADVISE_PREFAULT: touch every page of the automaton, so that the first
+ *   lookups don't have to read them from disk or allocate them.
+ * - MN_ADVISE_LOCK: lock the pages of the automaton in memory, with mlock(),
+ *   so that they are never paged out. Fails with MN_EIO if the limit on locked
+ *   memory of the process is too low. Pages are unlocked by mn_free().
+ * Automata used in place by mn_wrap() or mn_load_mem() are prefaulted and
+ * locked, but never moved. This should be called before the automaton is
+ * shared between threads.
+ */
+int mn_advise(struct mini *, int flags);
+
+/* Builds jump tables for the states of a loaded automaton that have at least
+ * "min_fanout" transitions, so that lookups find the transition to follow in
+ * these states in constant time, instead of scanning their transitions. This
+ * pays off for the states near the start state, which have dozens of
+ * transitions in natural language lexicons. Tables are built level by level
+ * from the start state, as long as the states that have at least
+ * "min_fanout" transitions hold at least half of the transitions of their
+ * level, and are only looked for at these levels, so that deeper lookups
+ * don't pay for them. 8 is a good value for "min_fanout". The table of a
+ * state takes about 100 bytes, plus 4 bytes per transition if the automaton is
+ * numbered, and 2 more if it is compact. States are chosen by decreasing
+ * number of transitions, as long as the tables take at most "max_memory"
+ * bytes in total. Tables are kept apart from the automaton, which is
+ * unchanged: they are not saved along with it, and each process that uses a
+ * shared automaton builds its own. Calling this again replaces the tables,
+ * and a "max_memory" of zero frees them. All the lookup functions use the
+ * tables. This should be called before the automaton is shared between
+ * threads. Returns MN_E2BIG if there isn't enough memory, in which case the
+ * automaton has no tables.
+ */
+int mn_accelerate(struct mini *, unsigned min_fanout, size_t max_memory);
+
 /* Destructor. */
 void mn_free(struct mini *);
 
 /* Returns the type of an automaton. */
 enum mn_type mn_type(const struct mini *);
 
+/* Returns the encoding of the transitions of an automaton. */
+enum mn_format mn_format(const struct mini *);
+
+/* Returns the encoding of the counts of an automaton. This is MN_COUNTS_FULL
+ * unless the automaton is numbered, in the fixed format, and was created with
+ * narrow counts.
+ */
+enum mn_counts mn_counts(const struct mini *);
+
+/* Returns whether an automaton was written in the native layout, see
+ * mn_enc_set_native().
+ */
+int mn_native(const struct mini *);
+
 /* Returns the number of words in an automaton.
- * If the automaton is numbered, this is a constant time operation. Otherwise,
- * this requires traversing the entire automaton.
+ * This is a constant time operation. The returned value is capped at
+ * UINT32_MAX.
  */
 uint32_t mn_size(const struct mini *);
 
@@ -161,7 +546,7 @@ struct mini_iter {
    const struct mini *fsa;                    /* Attached automaton. */
    size_t root;                               /* Root depth. */
    size_t depth;                              /* Current stack depth. */
-   uint32_t positions[MN_MAX_WORD_LEN + 1];   /* Offsets stack. */
+   uint64_t positions[MN_MAX_WORD_LEN + 1];   /* Offsets stack. */
    char word[MN_MAX_WORD_LEN + 1];            /* Current word. */
 };
 
@@ -211,6 +596,143 @@ uint32_t mn_iter_initn(struct mini_iter *, const struct mini *, uint32_t pos);
 const char *mn_iter_next(struct mini_iter *, size_t *len);
 
 
+/*******************************************************************************
+ * Merging
+ ******************************************************************************/
+
+/* Adds the union of the words of two automata to an encoder.
+ * The automata can be of any type, and the type of the result is the one of the
+ * encoder. Words common to both automata are added once. In sorted mode, the
+ * words of both automata must sort after the ones already added to the
+ * encoder. The cost is proportional to the size of the union.
+ * On error, returns the error code of the failed call to mn_enc_add().
+ */
+int mn_merge(struct mini_enc *, const struct mini *, const struct mini *);
+
+
+/*******************************************************************************
+ * Overlay
+ ******************************************************************************/
+
+/* An overlay makes an automaton updatable. It holds a set of words inserted
+ * into the automaton, and a set of words removed from it, both of which are
+ * consulted when looking up words. These sets are meant to stay small: they
+ * should be folded periodically into a new automaton with mn_overlay_compact(),
+ * which then replaces the old one with mn_overlay_rebase().
+ *
+ * Functions that take a const overlay only read it, and can be called
+ * concurrently from several threads, provided no other function is called
+ * at the same time. With a reader-writer lock, lookups take the read lock,
+ * and changes the write lock. Compaction blocks neither: the changes made so
+ * far are first set apart with mn_overlay_snapshot(), under the write lock.
+ * mn_overlay_compact() only reads these changes and the base automaton, which
+ * are not modified until mn_overlay_rebase(), so it can run without the lock
+ * while lookups and changes go on. mn_overlay_rebase() then replaces the base
+ * automaton, under the write lock, and discards the changes set apart, but
+ * keeps the changes made since the snapshot.
+ */
+struct mini_overlay;
+
+/* Allocates a new overlay on top of an automaton. The automaton is not owned
+ * by the overlay, and must outlive it, or at least be replaced beforehand
+ * with mn_overlay_rebase().
+ * Returns NULL if there is not enough memory.
+ */
+struct mini_overlay *mn_overlay_new(const struct mini *base);
+
+/* Destructor. */
+void mn_overlay_free(struct mini_overlay *);
+
+/* Adds a word to an overlay. Adding a word that is already present is not an
+ * error. The length of the word must be greater than zero and not exceed
+ * MN_MAX_WORD_LEN.
+ * Returns MN_EWORD if the word is empty or too long, MN_E2BIG if there is not
+ * enough memory.
+ */
+int mn_overlay_insert(struct mini_overlay *, const void *word, size_t len);
+
+/* Removes a word from an overlay. Removing a word that is not present is not
+ * an error. Constraints are the same as with mn_overlay_insert().
+ * Returns MN_EWORD if the word is empty or too long, MN_E2BIG if there is not
+ * enough memory.
+ */
+int mn_overlay_remove(struct mini_overlay *, const void *word, size_t len);
+
+/* Checks if an overlay contains a word.
+ * Returns 1 if so, 0 otherwise. If the overlay holds no changes, this is
+ * almost as fast as mn_contains().
+ */
+int mn_overlay_contains(const struct mini_overlay *, const void *word, size_t len);
+
+/* Returns the number of words of an overlay, capped at UINT32_MAX. */
+uint32_t mn_overlay_size(const struct mini_overlay *);
+
+/* Returns the number of changes held by an overlay, that is, the number of
+ * words that were inserted or removed and that haven't been folded into the
+ * base automaton yet, including the changes set apart by
+ * mn_overlay_snapshot().
+ */
+size_t mn_overlay_changes(const struct mini_overlay *);
+
+/* Returns the ordinal of a word, taking changes into account.
+ * This only works if the base automaton is numbered, otherwise 0 is returned.
+ * Ordinals of words that follow changed words shift accordingly, so they are
+ * not stable across changes. Locating an inserted word requires an additional
+ * traversal of the base automaton.
+ */
+uint32_t mn_overlay_locate(const struct mini_overlay *, const void *word, size_t len);
+
+/* Overlay iterator. */
+struct mini_overlay_iter {
+   const struct mini_overlay *ov;   /* Attached overlay. */
+   struct mini_iter base;           /* Iterator over the base automaton. */
+   const char *base_word;           /* Current word of the base automaton. */
+   size_t base_len;                 /* Length of this word. */
+   size_t ins[2];                   /* Index of the next inserted word, and */
+   size_t tomb[2];                  /* of the next removed word, for the
+                                     * changes set apart and the others. */
+   size_t gens;                     /* Number of these sets iterated on. */
+   int advance;                     /* Whether "base" must be advanced. */
+};
+
+/* Returns an iterator over the words of an overlay, in lexicographical order.
+ * The overlay must not be modified while it is being iterated on.
+ */
+void mn_overlay_iter_init(struct mini_overlay_iter *, const struct mini_overlay *);
+
+/* Fetches the next word from an overlay iterator.
+ * Works as mn_iter_next().
+ */
+const char *mn_overlay_iter_next(struct mini_overlay_iter *, size_t *len);
+
+/* Sets apart the changes made to an overlay so far, so that they can be
+ * compacted while new changes are made. Changes set apart by a previous call
+ * and not yet discarded by mn_overlay_rebase() are kept, so that this can be
+ * called again after a failed compaction, but not while one is running.
+ * Returns MN_E2BIG if there is not enough memory, in which case some changes
+ * may not have been set apart, but the words of the overlay are unchanged.
+ */
+int mn_overlay_snapshot(struct mini_overlay *);
+
+/* Adds the words of an overlay to an encoder, so that a new automaton that
+ * includes the changes set apart by mn_overlay_snapshot() can be created.
+ * Changes made since then are not included. The overlay itself is not
+ * modified.
+ * In sorted mode, the words must sort after the ones already added to the
+ * encoder.
+ * On error, returns the error code of the failed call to mn_enc_add().
+ */
+int mn_overlay_compact(const struct mini_overlay *, struct mini_enc *);
+
+/* Replaces the base automaton of an overlay, and discards the changes set
+ * apart by mn_overlay_snapshot(). This is meant to be called with the
+ * automaton created from mn_overlay_compact(), whose words include these
+ * changes; the changes made since the snapshot are kept, and apply to the new
+ * automaton. The previous base automaton is not freed.
+ */
+void mn_overlay_rebase(struct mini_overlay *, const struct mini *base);
+
+
 /*******************************************************************************
  * Debugging.
  ******************************************************************************/
@@ -227,19 +749,48 @@ enum mn_dump_format {
 int mn_dump(const struct mini *, FILE *, enum mn_dump_format);
 
 #endif
-#line 10 "api.c"
+#line 37 "api.c"
+
+/* Initial number of buckets of the states hash table. Must be a power of two. */
+#define MN_HT_SIZE (1 << 8)
+
+/* Initial size of the encoder automaton array. */
+#define MN_INIT_SIZE (1 << 10)
+
+/* Initial size of the stack of temporary transitions. */
+#define MN_STACK_SIZE (1 << 6)
+
+/* Initial and minimum size of the buffer of unsorted words. */
+#define MN_SORT_INIT_SIZE (1 << 16)
+
+/* Maximum number of sorted runs kept on disk at the same time. When there are
+ * that many, they are merged into a single one.
+ */
+#define MN_MAX_RUNS 64
+
+/* Number of records buffered in memory before being written to a file, in
+ * streaming mode. Must be at least the maximum number of transitions of a
+ * state.
+ */
+#define MN_SPOOL_SIZE (1 << 14)
 
-/* Size of the states hash table. */
-#define MN_HT_SIZE (1 << 18)
+/* Maximum number of passes over the automaton to compute the offsets of states
+ * in the compact format, before settling for slightly larger destinations.
+ */
+#define MN_COMPACT_PASSES 3
 
-/* Maximum number of transitions in a single automaton. */
-#define MN_MAX_SIZE (1 << 22)
+/* Maximum number of transitions in a single automaton. Transitions are
+ * encoded as 64-bits integers in the general case, but as 32-bits integers if
+ * the automaton is smaller than MN_MAX_NARROW_SIZE.
+ */
+#define MN_MAX_SIZE ((uint64_t)1 << 54)
+#define MN_MAX_NARROW_SIZE ((uint64_t)1 << 22)
 
 /* We don't use bitfields for portability. */
 #define IS_LAST(trans) ((trans) & 0x1)
 #define IS_TERMINAL(state) ((state) & 0x2)
 #define GET_CHAR(trans) (uint8_t)(((trans) >> 2) & 0xff)
-#define GET_DEST(trans) (uint32_t)(((trans) >> 10) & ((1 << 22) - 1))
+#define GET_DEST(trans) (uint64_t)(((trans) >> 10) & (MN_MAX_SIZE - 1))
 
 #define SET_FLAG_BIT(num, flag, mask) do {                                     \
    if (flag)                                                                   \
@@ -251,14 +802,172 @@ int mn_dump(const struct mini *, FILE *, enum mn_dump_format);
 #define SET_LAST(trans, flag) SET_FLAG_BIT(trans, flag, 0x1)
 #define SET_TERMINAL(state, flag) SET_FLAG_BIT(state, flag, 0x2)
 #define SET_CHAR(trans, chr) do {                                              \
-   trans |= (uint32_t)(chr) << 2;                                              \
+   trans |= (uint64_t)(chr) << 2;                                              \
 } while (0)
 #define SET_DEST(trans, pos) do {                                              \
-   trans |= (uint32_t)(pos) << 10;                                             \
+   trans |= (uint64_t)(pos) << 10;                                             \
+} while (0)
+#define CLEAR_DEST(trans) do {                                                 \
+   trans &= (1 << 10) - 1;                                                     \
 } while (0)
 
+/* In the compact format, a transition is made of its label, a flags byte,
+ * then its destination and its count (numbered automata only), stored as
+ * big-endian integers of the lengths given in the flags. The LAST and TERMINAL
+ * flags are at the same place as above. The last transition of a state can
+ * have the NEXT flag instead of a destination field, in which case it leads
+ * to the state that immediately follows.
+ */
+#define MN_COMPACT_NEXT 0x4
+#define COMPACT_DEST_LEN(flags) (((flags) >> 3) & 0x7)
+#define COMPACT_COUNT_LEN(flags) (((flags) >> 6) + 1)
+
+/* Maximum size of a compact automaton, in bytes, such that destinations fit
+ * in six bytes, and can be read along with the label and flags with a single
+ * eight bytes load.
+ */
+#define MN_MAX_COMPACT_SIZE ((uint64_t)1 << 48)
+
+/* Maximum size of a transition in the packed format, in bits, such that any
+ * transition can be read with a single eight bytes load, whatever its offset
+ * in the first byte.
+ */
+#define MN_MAX_PACKED_BITS 57
+
 static const uint32_t mn_magic = 1835626089;
-static const uint32_t mn_version = 1;
+static const uint32_t mn_version = 2;
+
+/* Size of the header of version 1 automata, which is also the size of the
+ * part common to all versions.
+ */
+#define MN_V1_HEADER_SIZE 12
+
+/* Size of the header of current automata, which ends with a checksum of the
+ * header. Headers can be longer, if written by a later release.
+ */
+#define MN_HEADER_SIZE 48
+
+/* Position of the checksum in the header, in 32-bits integers. */
+#define MN_CHECKSUM_FIELD 10
+
+/* Flags stored along with the encoding of counts in the header. Native
+ * automata are laid out in the file exactly as in memory once loaded: arrays
+ * start on an eight bytes boundary and are followed by their padding, and
+ * transitions and counts of the fixed format are in the byte order of the host
+ * that wrote them, little-endian if MN_FLAG_LITTLE is set.
+ */
+#define MN_FLAG_NATIVE 0x80
+#define MN_FLAG_LITTLE 0x40
+#define MN_COUNTS_MASK 0x3f
+
+/* Narrow count meaning that the actual count is stored apart. */
+#define MN_LARGE_COUNT UINT8_MAX
+
+/* Automaton header, in host order. */
+struct mini_header {
+   uint32_t version;          /* Data format version. */
+   uint32_t type;             /* Automaton type. */
+   uint32_t format;           /* Encoding of transitions. */
+   uint32_t counts;           /* Encoding of counts. */
+   uint32_t width;            /* Size of a transition, in bytes. */
+   uint64_t nr;               /* Number of transitions. */
+   bool has_words;            /* Whether the number of words is known. */
+   uint64_t words;            /* Number of words. */
+   uint64_t large;            /* Number of counts stored apart. */
+   bool native;               /* Whether laid out as in memory. */
+   bool little;               /* Whether integers are little-endian. */
+};
+
+/* Converts a 64-bits integer from host to network order, and conversely. */
+static uint64_t hton64(uint64_t n)
+{
+   if (htonl(1) == 1)
+      return n;
+   return (uint64_t)htonl((uint32_t)n) << 32 | htonl((uint32_t)(n >> 32));
+}
+
+#define ntoh64 hton64
+
+static inline bool host_little(void)
+{
+   return htonl(1) != 1;
+}
+
+/* Reverses the byte order of an integer. */
+static inline uint32_t swap32(uint32_t n)
+{
+   return n >> 24 | (n >> 8 & 0xff00) | (n << 8 & 0xff0000) | n << 24;
+}
+
+static inline uint64_t swap64(uint64_t n)
+{
+   return (uint64_t)swap32((uint32_t)n) << 32 | swap32((uint32_t)(n >> 32));
+}
+
+/* Reverses the byte order of the integers of "width" bytes of an array of
+ * "size" bytes, with vector instructions where available. Records of 12 bytes
+ * are made of a 64-bits integer followed by a 32-bits one.
+ */
+static void swap_ints(void *data, uint64_t size, unsigned width)
+{
+   uint8_t *bytes = data;
+   uint64_t i = 0;
+
+   if (width == 12) {
+      for ( ; i + 12 <= size; i += 12) {
+         uint64_t wide;
+         uint32_t narrow;
+         memcpy(&wide, &bytes[i], sizeof wide);
+         memcpy(&narrow, &bytes[i + sizeof wide], sizeof narrow);
+         wide = swap64(wide);
+         narrow = swap32(narrow);
+         memcpy(&bytes[i], &wide, sizeof wide);
+         memcpy(&bytes[i + sizeof wide], &narrow, sizeof narrow);
+      }
+      return;
+   }
+   if (!width)
+      return;
+
+#if defined(__AVX2__)
+   const __m256i mask = width == sizeof(uint32_t) ?
+      _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                       3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12) :
+      _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                       7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+   for ( ; i + 32 <= size; i += 32) {
+      const __m256i vec = _mm256_loadu_si256((const __m256i *)&bytes[i]);
+      _mm256_storeu_si256((__m256i *)&bytes[i], _mm256_shuffle_epi8(vec, mask));
+   }
+#elif defined(__SSSE3__)
+   const __m128i mask = width == sizeof(uint32_t) ?
+      _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12) :
+      _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+   for ( ; i + 16 <= size; i += 16) {
+      const __m128i vec = _mm_loadu_si128((const __m128i *)&bytes[i]);
+      _mm_storeu_si128((__m128i *)&bytes[i], _mm_shuffle_epi8(vec, mask));
+   }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+   for ( ; i + 16 <= size; i += 16) {
+      const uint8x16_t vec = vld1q_u8(&bytes[i]);
+      vst1q_u8(&bytes[i], width == sizeof(uint32_t) ? vrev32q_u8(vec) : vrev64q_u8(vec));
+   }
+#endif
+
+   for ( ; i + width <= size; i += width) {
+      if (width == sizeof(uint32_t)) {
+         uint32_t n;
+         memcpy(&n, &bytes[i], sizeof n);
+         n = swap32(n);
+         memcpy(&bytes[i], &n, sizeof n);
+      } else {
+         uint64_t n;
+         memcpy(&n, &bytes[i], sizeof n);
+         n = swap64(n);
+         memcpy(&bytes[i], &n, sizeof n);
+      }
+   }
+}
 
 static int lmemcmp(const void *restrict str1, size_t len1,
                    const void *restrict str2, size_t len2)
@@ -281,6 +990,7 @@ const char *mn_strerror(int err)
       [MN_EFREEZED] = "attempt to add a word to a freezed automaton",
       [MN_E2BIG] = "automaton has grown too large",
       [MN_EIO] = "IO error",
+      [MN_ENATIVE] = "automaton is not in the native layout of this host",
    };
 
    if (err >= 0 && (size_t)err < sizeof tbl / sizeof *tbl)
@@ -293,12 +1003,61 @@ const char *mn_strerror(int err)
  * Encoder
  ******************************************************************************/
 
-/* Record type for the states hash table. */
+/* Record type for the states hash table. The table uses open addressing with
+ * linear probing, and its buckets point into the automaton array, where the
+ * transitions of registered states are stored contiguously.
+ */
 struct mini_enc_bkt {
-   unsigned nr;                  /* Number of outgoing transitions. */
+   uint64_t addr;                /* Position in the automaton array. */
    uint32_t hash;                /* Hash value. */
-   uint32_t addr;                /* Position in the automaton array. */
-   struct mini_enc_bkt *next;    /* Next record pointer. */
+   uint32_t nr;                  /* Number of outgoing transitions (zero if
+                                  * the bucket is empty). */
+};
+
+/* Buffer of words added in unsorted mode. Words are stored as records
+ * (length as a 16-bits integer, followed by the word itself) from the start
+ * of the buffer, and record offsets are stored from the end of the buffer
+ * backwards. When the buffer is full, records are sorted and written to a
+ * temporary file, called a run.
+ */
+struct mini_sorter {
+   size_t max_memory;            /* Maximum size of the buffer. */
+   uint8_t *data;                /* The buffer. */
+   size_t alloc;                 /* Its allocated size. */
+   size_t size;                  /* Size of all records. */
+   size_t nr;                    /* Number of records. */
+   FILE *runs[MN_MAX_RUNS];      /* Sorted runs. */
+   size_t nr_runs;
+};
+
+/* File written sequentially, and read back through a memory mapping, in
+ * streaming mode. The last records written are buffered in memory. The buffer
+ * is only written out when it can't hold the next batch of records, so that a
+ * batch always lies either entirely in the buffer or entirely in the file.
+ */
+struct mini_spool {
+   FILE *fp;
+   uint64_t base;                /* Offset of the first record in the file. */
+   size_t rec_size;              /* Size of a record, in bytes. */
+   uint64_t nr;                  /* Number of records written to the file. */
+   uint8_t *buf;                 /* Records not yet written. */
+   size_t buf_nr;                /* Number of such records. */
+   uint8_t *map;                 /* Mapping of the start of the file. */
+   size_t map_size;              /* Size of the mapping. */
+};
+
+/* Output of an encoder in streaming mode. Transitions are written to the
+ * output file as 64-bits integers in network order as soon as their state is
+ * registered. For numbered automata, cumulated counts are written to a
+ * temporary file at the same time: the count of a transition is the number of
+ * words reachable through it or one of its following siblings, as in
+ * number_states().
+ */
+struct mini_stream {
+   struct mini_spool trans;      /* Transitions. */
+   struct mini_spool counts;     /* Cumulated counts (numbered automata). */
+   uint64_t size;                /* Size of the finished automaton, in bytes. */
+   int err;                      /* Error code of the last write failure. */
 };
 
 /* Automaton encoder. */
@@ -306,420 +1065,4279 @@ struct mini_enc {
    uint8_t prev[MN_MAX_WORD_LEN + 1];    /* Previous word added. */
    size_t prev_len;                          /* Length of this word. */
 
-   /* Temporary states. */
+   /* Temporary states, along the path of the previous word. Outgoing
+    * transitions are only ever added to the deepest state, so the transitions
+    * of all these states are stored contiguously in a single stack, in order
+    * of depth.
+    */
    struct mini_state {
-      uint32_t transitions[1 << 8];    /* Outgoing transitions. */
+      size_t start;                    /* Position of the first outgoing
+                                        * transition in the stack. */
       unsigned nr;                     /* Number of outgoing transitions. */
       bool terminal;                   /* Whether terminal. */
    } states[MN_MAX_WORD_LEN + 1];
+   uint64_t *stack;              /* Transitions of temporary states. */
+   size_t stack_size;            /* Number of transitions in the stack. */
+   size_t stack_alloc;           /* Allocated size of the stack. */
 
-   struct mini_enc_bkt *table[MN_HT_SIZE];  /* States hash table. */
+   struct mini_enc_bkt *table;   /* States hash table. */
+   size_t table_size;            /* Number of buckets (a power of two). */
+   size_t table_used;            /* Number of non-empty buckets. */
 
    /* Whether the automaton has been dumped at least one time, in which case
     * adding new words is not allowed anymore.
     */
    bool finished;
 
-   uint32_t *counts;          /* Array of word counts (may be NULL). */
-   uint32_t aut_size;         /* Size of the automaton array (= size of the
+   enum mn_type type;         /* Type of the automaton. */
+   uint32_t *counts;          /* Array of word counts (NULL until the
+                               * automaton is finished, or if it isn't
+                               * numbered). */
+   uint64_t words;            /* Number of words added. */
+   uint64_t aut_size;         /* Size of the automaton array (= size of the
                                * counts array). */
-   uint32_t automaton[];      /* The automaton proper. */
+   uint64_t aut_alloc;        /* Allocated size of the automaton array. */
+   uint64_t *automaton;       /* The automaton proper. */
+
+   struct mini_sorter *sorter;   /* NULL unless in unsorted mode. */
+   struct mini_stream *stream;   /* NULL unless in streaming mode. */
+
+   enum mn_layout layout;              /* Order of states in the output. */
+   const void *const *profile;         /* Sample queries, for
+                                        * MN_LAYOUT_PROFILE. */
+   const size_t *profile_lens;         /* Lengths of these queries. */
+   size_t profile_nr;                  /* Number of queries. */
+   enum mn_format format;              /* Encoding of transitions. */
+   bool overlap;                       /* Whether states can be stored
+                                        * inside others. */
+   enum mn_counts count_format;        /* Encoding of counts. */
+   bool native;                        /* Whether to write the automaton
+                                        * as laid out in memory. */
+
+   size_t mem_used;           /* Memory currently allocated, in bytes. */
+   size_t mem_peak;           /* Maximum value of the above. */
+
+   /* Statistics. See the description of struct mn_enc_stats. */
+   uint64_t states_created;
+   uint64_t states_merged;
+   uint64_t probes;
+   uint64_t max_probes;
+   bool timing;               /* Whether we should measure minimization time. */
+   double minimize_time;
+   uint64_t overlap_saved;
 };
 
+/* Allocation wrappers that keep track of the memory used by an encoder. When
+ * growing an array, these should be called before freeing the old one, so
+ * that the peak memory usage accounts for both.
+ */
+static void *enc_alloc(struct mini_enc *enc, size_t nmemb, size_t size)
+{
+   if (size && nmemb > SIZE_MAX / size)
+      return NULL;
+   void *mem = calloc(nmemb, size);
+   if (mem) {
+      enc->mem_used += nmemb * size;
+      if (enc->mem_used > enc->mem_peak)
+         enc->mem_peak = enc->mem_used;
+   }
+   return mem;
+}
+
+static void *enc_realloc(struct mini_enc *enc, void *mem,
+                         size_t old_nmemb, size_t nmemb, size_t size)
+{
+   if (size && nmemb > SIZE_MAX / size)
+      return NULL;
+   mem = realloc(mem, nmemb * size);
+   if (mem) {
+      enc->mem_used += (nmemb - old_nmemb) * size;
+      if (enc->mem_used > enc->mem_peak)
+         enc->mem_peak = enc->mem_used;
+   }
+   return mem;
+}
+
+static void enc_free(struct mini_enc *enc, void *mem, size_t nmemb, size_t size)
+{
+   if (mem) {
+      free(mem);
+      enc->mem_used -= nmemb * size;
+   }
+}
+
 struct mini_enc *mn_enc_new(enum mn_type type)
 {
    assert(type == MN_STANDARD || type == MN_NUMBERED);
 
-   struct mini_enc *enc;
-   const size_t size = offsetof(struct mini_enc, automaton);
-   if (type == MN_NUMBERED) {
-      enc = calloc(1, size + 2 * MN_MAX_SIZE * sizeof *enc->automaton);
-      enc->counts = &enc->automaton[MN_MAX_SIZE];
-   } else {
-      enc = calloc(1, size + MN_MAX_SIZE * sizeof *enc->automaton);
+   struct mini_enc *enc = calloc(1, sizeof *enc);
+   if (!enc)
+      return NULL;
+   enc->mem_used = enc->mem_peak = sizeof *enc;
+   enc->type = type;
+   enc->stack_alloc = MN_STACK_SIZE;
+   enc->stack = enc_alloc(enc, MN_STACK_SIZE, sizeof *enc->stack);
+   enc->aut_alloc = MN_INIT_SIZE;
+   enc->automaton = enc_alloc(enc, MN_INIT_SIZE, sizeof *enc->automaton);
+   enc->table_size = MN_HT_SIZE;
+   enc->table = enc_alloc(enc, MN_HT_SIZE, sizeof *enc->table);
+   if (!enc->stack || !enc->automaton || !enc->table) {
+      mn_enc_free(enc);
+      return NULL;
    }
    return enc;
 }
 
-static void mn_clear_table(struct mini_enc *enc)
+static void clear_sorter(struct mini_sorter *sorter)
 {
-   for (size_t i = 0; i < sizeof enc->table / sizeof *enc->table; i++) {
-      struct mini_enc_bkt *r = enc->table[i];
-      while (r) {
-         struct mini_enc_bkt *next = r->next;
-         free(r);
-         r = next;
-      }
+   for (size_t i = 0; i < sorter->nr_runs; i++)
+      fclose(sorter->runs[i]);
+   sorter->nr_runs = 0;
+   sorter->size = sorter->nr = 0;
+}
+
+static void spool_fini(struct mini_enc *enc, struct mini_spool *spool)
+{
+   if (spool->map)
+      munmap(spool->map, spool->map_size);
+   enc_free(enc, spool->buf, MN_SPOOL_SIZE, spool->rec_size);
+}
+
+/* Leaves streaming mode. The output file is left as is. */
+static void free_stream(struct mini_enc *enc)
+{
+   struct mini_stream *stream = enc->stream;
+   if (!stream)
+      return;
+   spool_fini(enc, &stream->trans);
+   if (stream->counts.fp) {
+      spool_fini(enc, &stream->counts);
+      fclose(stream->counts.fp);
    }
-   memset(enc->table, 0, sizeof enc->table);
+   enc_free(enc, stream, 1, sizeof *stream);
+   enc->stream = NULL;
 }
 
 void mn_enc_free(struct mini_enc *enc)
 {
-   mn_clear_table(enc);
+   free_stream(enc);
+   if (enc->sorter) {
+      clear_sorter(enc->sorter);
+      free(enc->sorter->data);
+      free(enc->sorter);
+   }
+   free(enc->stack);
+   free(enc->table);
+   free(enc->counts);
+   free(enc->automaton);
    free(enc);
 }
 
 void mn_enc_clear(struct mini_enc *enc)
 {
+   enc_free(enc, enc->counts, enc->aut_size, sizeof *enc->counts);
+   enc->counts = NULL;
+   if (enc->sorter)
+      clear_sorter(enc->sorter);
+   free_stream(enc);
    enc->prev_len = 0;
+   enc->words = 0;
    enc->aut_size = 0;
-   memset(enc->states, 0, sizeof enc->states);
+   enc->states[0] = (struct mini_state){0};
+   enc->stack_size = 0;
    enc->finished = false;
-   mn_clear_table(enc);
+   memset(enc->table, 0, enc->table_size * sizeof *enc->table);
+   enc->table_used = 0;
+   enc->states_created = enc->states_merged = 0;
+   enc->probes = enc->max_probes = 0;
+   enc->minimize_time = 0;
+   enc->overlap_saved = 0;
 }
 
-static uint32_t hash_state(const struct mini_state *const state)
+size_t mn_enc_peak_memory(const struct mini_enc *enc)
 {
-   uint32_t hash = 0;
-   for (unsigned i = 0; i < state->nr; i++)
-      hash += state->transitions[i];
-   return (hash * 324027) >> 13;
+   return enc->mem_peak;
 }
 
-static uint32_t mkstate(struct mini_enc *enc, struct mini_state *state)
+void mn_enc_set_timing(struct mini_enc *enc, int enable)
 {
-   if (!state->nr)
-      state->transitions[state->nr++] = 0;
-   SET_LAST(state->transitions[state->nr - 1], true);
-
-   const uint32_t hash = hash_state(state);
-   const uint32_t pos = hash & (MN_HT_SIZE - 1);
-
-   struct mini_enc_bkt *bkt;
-   for (bkt = enc->table[pos]; bkt; bkt = bkt->next) {
-      if (bkt->hash == hash && bkt->nr == state->nr &&
-         !memcmp(&enc->automaton[bkt->addr], state->transitions, state->nr * sizeof *state->transitions))
-         return bkt->addr;
-   }
+   enc->timing = enable;
+}
 
-   if (enc->aut_size + state->nr >= MN_MAX_SIZE)
-      return UINT32_MAX;
+void mn_enc_set_layout(struct mini_enc *enc, enum mn_layout layout,
+                       const void *const queries[], const size_t lens[], size_t nr)
+{
+   assert(layout >= MN_LAYOUT_DEFAULT && layout <= MN_LAYOUT_PROFILE);
 
-   bkt = malloc(sizeof *bkt);
-   *bkt = (struct mini_enc_bkt){
-      .hash = hash,
-      .addr = enc->aut_size,
-      .nr = state->nr,
-      .next = enc->table[pos],
-   };
-   enc->table[pos] = bkt;
+   enc->layout = layout;
+   enc->profile = layout == MN_LAYOUT_PROFILE ? queries : NULL;
+   enc->profile_lens = layout == MN_LAYOUT_PROFILE ? lens : NULL;
+   enc->profile_nr = layout == MN_LAYOUT_PROFILE ? nr : 0;
+}
 
-   memcpy(&enc->automaton[enc->aut_size], state->transitions, state->nr * sizeof *state->transitions);
-   enc->aut_size += state->nr;
+void mn_enc_set_format(struct mini_enc *enc, enum mn_format format)
+{
+   assert(format >= MN_FORMAT_FIXED && format <= MN_FORMAT_PACKED);
 
-   return bkt->addr;
+   enc->format = format;
 }
 
-static int minimize(struct mini_enc *enc, size_t lim)
+void mn_enc_set_overlap(struct mini_enc *enc, int enable)
 {
-   while (enc->prev_len > lim) {
-      const uint32_t dest = mkstate(enc, &enc->states[enc->prev_len]);
-      if (dest == UINT32_MAX)
-         return MN_E2BIG;
-
-      uint32_t state = 0;
-      SET_DEST(state, dest);
-      SET_TERMINAL(state, enc->states[enc->prev_len].terminal);
-      SET_CHAR(state, enc->prev[--enc->prev_len]);
-      enc->states[enc->prev_len].transitions[enc->states[enc->prev_len].nr++] = state;
-   }
-   return MN_OK;
+   enc->overlap = enable;
 }
 
-static int add_word(struct mini_enc *enc, const uint8_t *word, size_t len)
+void mn_enc_set_counts(struct mini_enc *enc, enum mn_counts counts)
 {
-   size_t pref_len = 0;
-   size_t min_len = len < enc->prev_len ? len : enc->prev_len;
-   while (pref_len < min_len && word[pref_len] == enc->prev[pref_len])
-      pref_len++;
+   assert(counts >= MN_COUNTS_FULL && counts <= MN_COUNTS_INTERLEAVED);
 
-   int ret = minimize(enc, pref_len);
-   if (ret)
-      return ret;
+   enc->count_format = counts;
+}
 
-   while (enc->prev_len < len) {
-      enc->prev[enc->prev_len] = word[enc->prev_len];
-      enc->states[++enc->prev_len].terminal = false;
-      enc->states[enc->prev_len].nr = 0;
-   }
-   enc->prev[enc->prev_len] = '\0';
-   enc->states[enc->prev_len].terminal = true;
+void mn_enc_set_native(struct mini_enc *enc, int enable)
+{
+   enc->native = enable;
+}
 
-   return MN_OK;
+void mn_enc_stats(const struct mini_enc *enc, struct mn_enc_stats *stats)
+{
+   *stats = (struct mn_enc_stats){
+      .states_created = enc->states_created,
+      .states_merged = enc->states_merged,
+      .probes = enc->probes,
+      .max_probes = enc->max_probes,
+      .buckets = enc->table_size,
+      .load_factor = (double)enc->table_used / enc->table_size,
+      .minimize_time = enc->minimize_time,
+      .peak_memory = enc->mem_peak,
+      .overlap_saved = enc->overlap_saved,
+   };
 }
 
-int mn_enc_add(struct mini_enc *enc, const void *word, size_t len)
+/* Returns the current time, in seconds. */
+static double now(void)
 {
-   if (enc->finished)
-      return MN_EFREEZED;
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-   if (len == 0 || len > MN_MAX_WORD_LEN)
-      return MN_EWORD;
+/* Computes the CRC32C of "size" bytes, continuing from a previous value, or
+ * zero.
+ */
+static uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+   const uint8_t *bytes = data;
+   crc = ~crc;
+#if defined(MN_HW_CRC32C) && defined(__x86_64__)
+   for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, bytes, sizeof word);
+      crc = _mm_crc32_u64(crc, word);
+   }
+   for (; size; size--)
+      crc = _mm_crc32_u8(crc, *bytes++);
+#elif defined(MN_HW_CRC32C) && !defined(__ARM_BIG_ENDIAN)
+   for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, bytes, sizeof word);
+      crc = __crc32cd(crc, word);
+   }
+   for (; size; size--)
+      crc = __crc32cb(crc, *bytes++);
+#else
+   for (; size; size--) {
+      crc ^= *bytes++;
+      for (int i = 0; i < 8; i++)
+         crc = crc >> 1 ^ (UINT32_C(0x82f63b78) & -(crc & 1));
+   }
+#endif
+   return ~crc;
+}
 
-   if (lmemcmp(word, len, enc->prev, enc->prev_len) <= 0)
-      return MN_EORDER;
+/* Hashes the transitions of a state. The hash must depend on the order of the
+ * transitions, and all its bits must be usable as a bucket index. We use
+ * CRC32C if the hardware supports it, a multiplicative hash otherwise.
+ */
+static uint32_t hash_state(const uint64_t *transitions, unsigned nr)
+{
+#if defined(MN_HW_CRC32C) && defined(__x86_64__)
+   uint64_t hash = nr;
+   for (unsigned i = 0; i < nr; i++)
+      hash = _mm_crc32_u64(hash, transitions[i]);
+   return hash;
+#elif defined(MN_HW_CRC32C)
+   uint32_t hash = nr;
+   for (unsigned i = 0; i < nr; i++)
+      hash = __crc32cd(hash, transitions[i]);
+   return hash;
+#else
+   uint64_t hash = nr;
+   for (unsigned i = 0; i < nr; i++) {
+      hash = (hash << 23 | hash >> 41) ^ transitions[i];
+      hash *= UINT64_C(0x9e3779b97f4a7c15);
+   }
+   return hash ^ hash >> 32;
+#endif
+}
 
-   return add_word(enc, word, len);
+/* Pushes a transition onto the stack of temporary transitions. */
+static bool push_transition(struct mini_enc *enc, uint64_t trans)
+{
+   if (enc->stack_size == enc->stack_alloc) {
+      uint64_t *stack = enc_realloc(enc, enc->stack, enc->stack_alloc, enc->stack_alloc * 2, sizeof *stack);
+      if (!stack)
+         return false;
+      enc->stack = stack;
+      enc->stack_alloc *= 2;
+   }
+   enc->stack[enc->stack_size++] = trans;
+   return true;
 }
 
-static uint32_t number_states(struct mini_enc *enc, uint32_t pos)
+/* Makes room for at least "nr" more transitions in the automaton array. */
+static bool grow_automaton(struct mini_enc *enc, unsigned nr)
 {
-   uint32_t count = 0;
+   if (enc->aut_size + nr <= enc->aut_alloc)
+      return true;
+
+   uint64_t alloc = enc->aut_alloc * 2;
+   if (alloc > MN_MAX_SIZE)
+      alloc = MN_MAX_SIZE;
+
+   uint64_t *automaton = enc_realloc(enc, enc->automaton, enc->aut_alloc, alloc, sizeof *automaton);
+   if (!automaton)
+      return false;
+   enc->automaton = automaton;
+   enc->aut_alloc = alloc;
+   return true;
+}
 
-   if (!pos)
-      return count;
-   do {
-      uint32_t new_count = number_states(enc, GET_DEST(enc->automaton[pos]));
-      if (IS_TERMINAL(enc->automaton[pos]))
-         new_count++;
-      enc->counts[pos] = new_count;
-      count += new_count;
-   } while (!IS_LAST(enc->automaton[pos++]));
+/* Doubles the size of the states hash table if it is half full. */
+static bool grow_table(struct mini_enc *enc)
+{
+   if (enc->table_used < enc->table_size / 2)
+      return true;
+
+   const size_t size = enc->table_size * 2;
+   struct mini_enc_bkt *table = enc_alloc(enc, size, sizeof *table);
+   if (!table)
+      return false;
+
+   for (size_t i = 0; i < enc->table_size; i++) {
+      const struct mini_enc_bkt *bkt = &enc->table[i];
+      if (!bkt->nr)
+         continue;
+      size_t pos = bkt->hash & (size - 1);
+      while (table[pos].nr)
+         pos = (pos + 1) & (size - 1);
+      table[pos] = *bkt;
+   }
 
-   return count;
+   enc_free(enc, enc->table, enc->table_size, sizeof *enc->table);
+   enc->table = table;
+   enc->table_size = size;
+   return true;
 }
 
-static int finish(struct mini_enc *enc)
+static bool spool_init(struct mini_enc *enc, struct mini_spool *spool,
+                       FILE *fp, uint64_t base, size_t rec_size)
 {
-   int ret = minimize(enc, 0);
-   if (ret)
-      return ret;
-
-   uint32_t start_state = mkstate(enc, &enc->states[0]);
-   if (start_state == UINT32_MAX)
-      return MN_E2BIG;
+   *spool = (struct mini_spool){
+      .fp = fp,
+      .base = base,
+      .rec_size = rec_size,
+   };
+   spool->buf = enc_alloc(enc, MN_SPOOL_SIZE, rec_size);
+   return spool->buf;
+}
 
-   SET_DEST(enc->automaton[0], start_state);
-   if (enc->counts)
-      enc->counts[0] = number_states(enc, start_state);
+/* Writes buffered records to the file. */
+static bool spool_flush(struct mini_spool *spool)
+{
+   if (!spool->buf_nr)
+      return true;
+   if (fseeko(spool->fp, spool->base + spool->nr * spool->rec_size, SEEK_SET) ||
+       fwrite(spool->buf, spool->rec_size, spool->buf_nr, spool->fp) != spool->buf_nr ||
+       fflush(spool->fp))
+      return false;
+   spool->nr += spool->buf_nr;
+   spool->buf_nr = 0;
+   return true;
+}
 
-   return MN_OK;
+static bool spool_put(struct mini_spool *spool, const void *recs, size_t nr)
+{
+   if (spool->buf_nr + nr > MN_SPOOL_SIZE && !spool_flush(spool))
+      return false;
+   memcpy(&spool->buf[spool->buf_nr * spool->rec_size], recs, nr * spool->rec_size);
+   spool->buf_nr += nr;
+   return true;
 }
 
-static void swap_aut(struct mini_enc *enc)
+/* Maps at least the first "size" bytes of the file. The mapping is doubled
+ * when it must grow, like other arrays.
+ */
+static bool spool_map(struct mini_spool *spool, uint64_t size)
 {
-   for (uint32_t i = 0; i < enc->aut_size; i++)
-      enc->automaton[i] = htonl(enc->automaton[i]);
+   if (size <= spool->map_size)
+      return true;
+   if (size > SIZE_MAX / 2)
+      return false;
+
+   size_t len = spool->map_size ? spool->map_size : MN_SPOOL_SIZE * spool->rec_size;
+   while (len < size)
+      len *= 2;
+   if (spool->map) {
+      munmap(spool->map, spool->map_size);
+      spool->map = NULL;
+      spool->map_size = 0;
+   }
+   void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(spool->fp), 0);
+   if (map == MAP_FAILED)
+      return false;
+   spool->map = map;
+   spool->map_size = len;
+   return true;
+}
 
-   if (enc->counts)
-      for (uint32_t i = 0; i < enc->aut_size; i++)
-         enc->counts[i] = htonl(enc->counts[i]);
+/* Returns a pointer to a record, or NULL if the file can't be mapped. */
+static const void *spool_get(struct mini_spool *spool, uint64_t idx)
+{
+   if (idx >= spool->nr)
+      return &spool->buf[(idx - spool->nr) * spool->rec_size];
+   if (!spool_map(spool, spool->base + spool->nr * spool->rec_size))
+      return NULL;
+   return &spool->map[spool->base + idx * spool->rec_size];
 }
 
-int mn_enc_dump(struct mini_enc *enc,
-                int (*write)(void *arg, const void *data, size_t size),
-                void *arg)
+int mn_enc_set_stream(struct mini_enc *enc, FILE *fp)
 {
-   if (!enc->finished) {
-      int ret = finish(enc);
+   if (enc->finished)
+      return MN_EFREEZED;
+   if (enc->words || enc->prev_len)
+      return MN_EORDER;
+
+   free_stream(enc);
+   if (!fp)
+      return MN_OK;
+
+   struct mini_stream *stream = enc_alloc(enc, 1, sizeof *stream);
+   if (!stream)
+      return MN_E2BIG;
+   enc->stream = stream;
+   if (!spool_init(enc, &stream->trans, fp, MN_HEADER_SIZE, sizeof(uint64_t))) {
+      free_stream(enc);
+      return MN_E2BIG;
+   }
+   if (enc->type == MN_NUMBERED) {
+      FILE *tmp = tmpfile();
+      if (!tmp) {
+         free_stream(enc);
+         return MN_EIO;
+      }
+      if (!spool_init(enc, &stream->counts, tmp, 0, sizeof(uint32_t))) {
+         free_stream(enc);
+         return MN_E2BIG;
+      }
+   }
+
+   /* The header is written last, when we know what it contains. */
+   const uint8_t header[MN_HEADER_SIZE] = {0};
+   if (fseeko(fp, 0, SEEK_SET) || fwrite(header, 1, sizeof header, fp) != sizeof header || fflush(fp)) {
+      free_stream(enc);
+      return MN_EIO;
+   }
+   return MN_OK;
+}
+
+/* Returns the transitions of a registered state, or NULL on error. In
+ * streaming mode, they are in network order.
+ */
+static const void *registered_state(struct mini_enc *enc, uint64_t addr)
+{
+   if (!enc->stream)
+      return &enc->automaton[addr];
+
+   const void *transitions = spool_get(&enc->stream->trans, addr);
+   if (!transitions)
+      enc->stream->err = MN_EIO;
+   return transitions;
+}
+
+/* Writes the transitions of a new state in streaming mode, along with their
+ * cumulated counts if the automaton is numbered. The states they lead to have
+ * all been written already.
+ */
+static bool write_state(struct mini_enc *enc, const uint64_t *transitions,
+                        const uint64_t *net, unsigned nr)
+{
+   struct mini_stream *stream = enc->stream;
+
+   if (enc->type == MN_NUMBERED) {
+      uint32_t counts[UINT8_MAX + 1];
+      uint64_t count = 0;
+      for (unsigned i = nr; i-- > 0; ) {
+         const uint64_t dest = GET_DEST(transitions[i]);
+         if (dest) {
+            const uint32_t *cnt = spool_get(&stream->counts, dest);
+            if (!cnt) {
+               stream->err = MN_EIO;
+               return false;
+            }
+            count += *cnt;
+         }
+         count += !!IS_TERMINAL(transitions[i]);
+         if (count > UINT32_MAX)
+            return false;
+         counts[i] = count;
+      }
+      if (!spool_put(&stream->counts, counts, nr)) {
+         stream->err = MN_EIO;
+         return false;
+      }
+   }
+   if (!spool_put(&stream->trans, net, nr)) {
+      stream->err = MN_EIO;
+      return false;
+   }
+   return true;
+}
+
+/* Returns the error code corresponding to a failure of mkstate(). */
+static int mkstate_error(const struct mini_enc *enc)
+{
+   return enc->stream && enc->stream->err ? enc->stream->err : MN_E2BIG;
+}
+
+static uint64_t mkstate(struct mini_enc *enc, struct mini_state *state)
+{
+   if (!state->nr) {
+      if (!push_transition(enc, 0))
+         return UINT64_MAX;
+      state->nr++;
+   }
+   uint64_t *transitions = &enc->stack[state->start];
+   SET_LAST(transitions[state->nr - 1], true);
+
+   if (!grow_table(enc))
+      return UINT64_MAX;
+
+   const uint32_t hash = hash_state(transitions, state->nr);
+   const size_t mask = enc->table_size - 1;
+
+   /* In streaming mode, registered states are stored in network order. */
+   uint64_t net[UINT8_MAX + 1];
+   const uint64_t *key = transitions;
+   if (enc->stream) {
+      for (unsigned i = 0; i < state->nr; i++)
+         net[i] = hton64(transitions[i]);
+      key = net;
+   }
+
+   size_t pos;
+   uint64_t probes = 1;
+   for (pos = hash & mask; enc->table[pos].nr; pos = (pos + 1) & mask, probes++) {
+      const struct mini_enc_bkt *bkt = &enc->table[pos];
+      if (bkt->hash != hash || bkt->nr != state->nr)
+         continue;
+      const void *registered = registered_state(enc, bkt->addr);
+      if (!registered)
+         return UINT64_MAX;
+      if (!memcmp(registered, key, state->nr * sizeof *key))
+         break;
+   }
+   enc->probes += probes;
+   if (probes > enc->max_probes)
+      enc->max_probes = probes;
+   if (enc->table[pos].nr) {
+      enc->states_merged++;
+      return enc->table[pos].addr;
+   }
+
+   if (enc->aut_size + state->nr >= MN_MAX_SIZE)
+      return UINT64_MAX;
+   if (enc->stream ? !write_state(enc, transitions, net, state->nr) : !grow_automaton(enc, state->nr))
+      return UINT64_MAX;
+
+   enc->table[pos] = (struct mini_enc_bkt){
+      .hash = hash,
+      .addr = enc->aut_size,
+      .nr = state->nr,
+   };
+   enc->table_used++;
+   enc->states_created++;
+
+   if (!enc->stream)
+      memcpy(&enc->automaton[enc->aut_size], transitions, state->nr * sizeof *transitions);
+   enc->aut_size += state->nr;
+
+   return enc->table[pos].addr;
+}
+
+static int minimize(struct mini_enc *enc, size_t lim)
+{
+   const double start = enc->timing ? now() : 0;
+   int ret = MN_OK;
+
+   while (enc->prev_len > lim) {
+      struct mini_state *state = &enc->states[enc->prev_len];
+      const uint64_t dest = mkstate(enc, state);
+      if (dest == UINT64_MAX) {
+         ret = mkstate_error(enc);
+         break;
+      }
+
+      /* Pop the transitions of the state we just registered. This leaves
+       * room for the new transition of its parent.
+       */
+      enc->stack_size = state->start;
+
+      uint64_t trans = 0;
+      SET_DEST(trans, dest);
+      SET_TERMINAL(trans, state->terminal);
+      SET_CHAR(trans, enc->prev[--enc->prev_len]);
+      enc->stack[enc->stack_size++] = trans;
+      enc->states[enc->prev_len].nr++;
+   }
+
+   if (enc->timing)
+      enc->minimize_time += now() - start;
+   return ret;
+}
+
+/* Returns the length of the common prefix of two strings of at least "len"
+ * bytes. Strings are compared 8 bytes at a time.
+ */
+static size_t common_prefix(const uint8_t *str1, const uint8_t *str2, size_t len)
+{
+   size_t i = 0;
+   for ( ; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+      uint64_t chunk1, chunk2;
+      memcpy(&chunk1, &str1[i], sizeof chunk1);
+      memcpy(&chunk2, &str2[i], sizeof chunk2);
+      if (chunk1 != chunk2)
+         break;
+   }
+   while (i < len && str1[i] == str2[i])
+      i++;
+   return i;
+}
+
+/* Adds a word to the automaton, after checking that it sorts after the
+ * previous one. Both are done with a single comparison of the two words.
+ */
+static int add_word(struct mini_enc *enc, const uint8_t *word, size_t len)
+{
+   const size_t min_len = len < enc->prev_len ? len : enc->prev_len;
+   const size_t pref_len = common_prefix(word, enc->prev, min_len);
+   if (pref_len == min_len ? len <= enc->prev_len : word[pref_len] < enc->prev[pref_len])
+      return MN_EORDER;
+
+   int ret = minimize(enc, pref_len);
+   if (ret)
+      return ret;
+
+   while (enc->prev_len < len) {
+      enc->prev[enc->prev_len] = word[enc->prev_len];
+      enc->states[++enc->prev_len] = (struct mini_state){
+         .start = enc->stack_size,
+      };
+   }
+   enc->prev[enc->prev_len] = '\0';
+   enc->states[enc->prev_len].terminal = true;
+
+   return MN_OK;
+}
+
+/*******************************************************************************
+ * Unsorted input
+ ******************************************************************************/
+
+int mn_enc_set_unsorted(struct mini_enc *enc, size_t max_memory)
+{
+   if (enc->finished)
+      return MN_EFREEZED;
+   if (enc->words || enc->prev_len || (enc->sorter && (enc->sorter->nr || enc->sorter->nr_runs)))
+      return MN_EORDER;
+
+   if (enc->sorter) {
+      enc_free(enc, enc->sorter->data, enc->sorter->alloc, 1);
+      enc_free(enc, enc->sorter, 1, sizeof *enc->sorter);
+      enc->sorter = NULL;
+   }
+   if (!max_memory)
+      return MN_OK;
+
+   enc->sorter = enc_alloc(enc, 1, sizeof *enc->sorter);
+   if (!enc->sorter)
+      return MN_E2BIG;
+   if (max_memory < MN_SORT_INIT_SIZE)
+      max_memory = MN_SORT_INIT_SIZE;
+   enc->sorter->max_memory = max_memory / sizeof(size_t) * sizeof(size_t);
+   return MN_OK;
+}
+
+#define REC_LEN(rec) ((size_t)(rec)[0] << 8 | (rec)[1])
+#define REC_WORD(rec) ((rec) + 2)
+
+/* Returns the character of a record at a given depth, or -1 if the record is
+ * shorter than that.
+ */
+static int rec_char(const uint8_t *rec, size_t depth)
+{
+   return depth < REC_LEN(rec) ? REC_WORD(rec)[depth] : -1;
+}
+
+static int rec_cmp(const uint8_t *rec1, const uint8_t *rec2)
+{
+   return lmemcmp(REC_WORD(rec1), REC_LEN(rec1), REC_WORD(rec2), REC_LEN(rec2));
+}
+
+/* Sorts records, which are known to share their first "depth" bytes. This is
+ * a multikey quicksort, which only compares each byte position once per
+ * partitioning step.
+ */
+static void sort_records(const uint8_t *data, size_t *recs, size_t nr,
+                         size_t depth)
+{
+   while (nr > 1) {
+      if (nr < 16) {
+         for (size_t i = 1; i < nr; i++) {
+            const size_t rec = recs[i];
+            size_t j = i;
+            for ( ; j && rec_cmp(&data[recs[j - 1]], &data[rec]) > 0; j--)
+               recs[j] = recs[j - 1];
+            recs[j] = rec;
+         }
+         return;
+      }
+
+      const int pivot = rec_char(&data[recs[nr / 2]], depth);
+      size_t lt = 0, i = 0, gt = nr;
+      while (i < gt) {
+         const int c = rec_char(&data[recs[i]], depth);
+         size_t tmp = recs[i];
+         if (c < pivot) {
+            recs[i++] = recs[lt];
+            recs[lt++] = tmp;
+         } else if (c > pivot) {
+            recs[i] = recs[--gt];
+            recs[gt] = tmp;
+         } else {
+            i++;
+         }
+      }
+      sort_records(data, recs, lt, depth);
+      sort_records(data, &recs[gt], nr - gt, depth);
+      if (pivot < 0)
+         return;
+      recs += lt;
+      nr = gt - lt;
+      depth++;
+   }
+}
+
+/* Returns the array of record offsets of the buffer. */
+static size_t *sorter_recs(const struct mini_sorter *sorter)
+{
+   return (size_t *)(sorter->data + sorter->alloc) - sorter->nr;
+}
+
+/* Sorts the buffer, and calls a function on each distinct word, in order. */
+static int drain_buffer(struct mini_sorter *sorter,
+                        int (*emit)(void *arg, const uint8_t *word, size_t len),
+                        void *arg)
+{
+   size_t *recs = sorter_recs(sorter);
+   sort_records(sorter->data, recs, sorter->nr, 0);
+
+   for (size_t i = 0; i < sorter->nr; i++) {
+      const uint8_t *rec = &sorter->data[recs[i]];
+      if (i && !rec_cmp(&sorter->data[recs[i - 1]], rec))
+         continue;
+      int ret = emit(arg, REC_WORD(rec), REC_LEN(rec));
       if (ret)
          return ret;
-      swap_aut(enc);
-      enc->finished = true;
    }
+   sorter->size = sorter->nr = 0;
+   return MN_OK;
+}
+
+static int write_record(void *fp, const uint8_t *word, size_t len)
+{
+   const uint8_t hdr[2] = {len >> 8, len & 0xff};
+   if (fwrite(hdr, 1, 2, fp) != 2 || fwrite(word, 1, len, fp) != len)
+      return MN_EIO;
+   return MN_OK;
+}
+
+/* Reads the next record of a run. Returns 1 on success, 0 at the end of the
+ * run, -1 on error.
+ */
+static int read_record(FILE *fp, uint8_t rec[static 2 + MN_MAX_WORD_LEN])
+{
+   if (fread(rec, 1, 2, fp) != 2)
+      return ferror(fp) ? -1 : 0;
+   const size_t len = REC_LEN(rec);
+   if (len > MN_MAX_WORD_LEN || fread(REC_WORD(rec), 1, len, fp) != len)
+      return -1;
+   return 1;
+}
+
+/* Merges runs, and calls a function on each distinct word, in order. Runs are
+ * closed afterwards.
+ */
+static int merge_runs(struct mini_enc *enc, FILE **runs, size_t nr_runs,
+                      int (*emit)(void *arg, const uint8_t *word, size_t len),
+                      void *arg)
+{
+   /* Heads of the runs, and a heap of run indexes ordered by head. */
+   const size_t rec_size = 2 + MN_MAX_WORD_LEN;
+   uint8_t *heads = enc_alloc(enc, nr_runs + 1, rec_size);
+   size_t *heap = enc_alloc(enc, nr_runs, sizeof *heap);
+   uint8_t *prev = heads + nr_runs * rec_size;
+   int ret = heads && heap ? MN_OK : MN_E2BIG;
+
+   #define HEAD(i) (&heads[heap[i] * rec_size])
+   size_t heap_size = 0;
+   for (size_t i = 0; i < nr_runs && !ret; i++) {
+      rewind(runs[i]);
+      int got = read_record(runs[i], &heads[i * rec_size]);
+      if (got < 0)
+         ret = MN_EIO;
+      else if (got)
+         heap[heap_size++] = i;
+   }
+   for (size_t i = heap_size / 2; i-- > 0 && !ret; ) {
+      for (size_t pos = i, child; (child = 2 * pos + 1) < heap_size; pos = child) {
+         if (child + 1 < heap_size && rec_cmp(HEAD(child + 1), HEAD(child)) < 0)
+            child++;
+         if (rec_cmp(HEAD(pos), HEAD(child)) <= 0)
+            break;
+         size_t tmp = heap[pos];
+         heap[pos] = heap[child];
+         heap[child] = tmp;
+      }
+   }
+
+   bool first = true;
+   while (heap_size && !ret) {
+      const uint8_t *rec = HEAD(0);
+      if (first || rec_cmp(prev, rec)) {
+         memcpy(prev, rec, 2 + REC_LEN(rec));
+         ret = emit(arg, REC_WORD(prev), REC_LEN(prev));
+         first = false;
+      }
+      int got = read_record(runs[heap[0]], HEAD(0));
+      if (got < 0)
+         ret = MN_EIO;
+      else if (!got)
+         heap[0] = heap[--heap_size];
+      for (size_t pos = 0, child; (child = 2 * pos + 1) < heap_size; pos = child) {
+         if (child + 1 < heap_size && rec_cmp(HEAD(child + 1), HEAD(child)) < 0)
+            child++;
+         if (rec_cmp(HEAD(pos), HEAD(child)) <= 0)
+            break;
+         size_t tmp = heap[pos];
+         heap[pos] = heap[child];
+         heap[child] = tmp;
+      }
+   }
+   #undef HEAD
+
+   for (size_t i = 0; i < nr_runs; i++)
+      fclose(runs[i]);
+   enc_free(enc, heads, nr_runs + 1, rec_size);
+   enc_free(enc, heap, nr_runs, sizeof *heap);
+   return ret;
+}
+
+/* Sorts the buffer and writes it to a new run. If there are too many runs,
+ * merges them first.
+ */
+static int spill_buffer(struct mini_enc *enc)
+{
+   struct mini_sorter *sorter = enc->sorter;
+
+   if (sorter->nr_runs == MN_MAX_RUNS) {
+      FILE *fp = tmpfile();
+      if (!fp)
+         return MN_EIO;
+      int ret = merge_runs(enc, sorter->runs, sorter->nr_runs, write_record, fp);
+      sorter->runs[0] = fp;
+      sorter->nr_runs = 1;
+      if (!ret && fflush(fp))
+         ret = MN_EIO;
+      if (ret)
+         return ret;
+   }
+
+   FILE *fp = tmpfile();
+   if (!fp)
+      return MN_EIO;
+   sorter->runs[sorter->nr_runs++] = fp;
+   int ret = drain_buffer(sorter, write_record, fp);
+   if (!ret && fflush(fp))
+      ret = MN_EIO;
+   return ret;
+}
+
+/* Makes room for a record of the given length in the buffer. */
+static int grow_buffer(struct mini_enc *enc, size_t len)
+{
+   struct mini_sorter *sorter = enc->sorter;
+   const size_t needed = 2 + len + sizeof(size_t);
+
+   while (sorter->alloc - sorter->size - sorter->nr * sizeof(size_t) < needed) {
+      if (sorter->alloc == sorter->max_memory)
+         return spill_buffer(enc);
+
+      size_t alloc = sorter->alloc ? sorter->alloc * 2 : MN_SORT_INIT_SIZE;
+      if (alloc > sorter->max_memory)
+         alloc = sorter->max_memory;
+      uint8_t *data = enc_alloc(enc, alloc, 1);
+      if (!data)
+         return MN_E2BIG;
+      if (sorter->data) {
+         memcpy(data, sorter->data, sorter->size);
+         memcpy(data + alloc - sorter->nr * sizeof(size_t), sorter_recs(sorter), sorter->nr * sizeof(size_t));
+         enc_free(enc, sorter->data, sorter->alloc, 1);
+      }
+      sorter->data = data;
+      sorter->alloc = alloc;
+   }
+   return MN_OK;
+}
+
+static int buffer_word(struct mini_enc *enc, const uint8_t *word, size_t len)
+{
+   int ret = grow_buffer(enc, len);
+   if (ret)
+      return ret;
+
+   struct mini_sorter *sorter = enc->sorter;
+   uint8_t *rec = &sorter->data[sorter->size];
+   rec[0] = len >> 8;
+   rec[1] = len & 0xff;
+   memcpy(REC_WORD(rec), word, len);
+   sorter->nr++;
+   sorter_recs(sorter)[0] = sorter->size;
+   sorter->size += 2 + len;
+   return MN_OK;
+}
+
+static int emit_word(void *arg, const uint8_t *word, size_t len)
+{
+   struct mini_enc *enc = arg;
+
+   int ret = add_word(enc, word, len);
+   if (!ret)
+      enc->words++;
+   return ret;
+}
+
+/* Encodes all the words added so far in unsorted mode. The buffer is
+ * deallocated beforehand if words were spilled to disk, so that it doesn't
+ * add up to the memory used by the automaton.
+ */
+static int flush_sorter(struct mini_enc *enc)
+{
+   struct mini_sorter *sorter = enc->sorter;
+
+   if (!sorter->nr_runs)
+      return drain_buffer(sorter, emit_word, enc);
+
+   if (sorter->nr) {
+      int ret = spill_buffer(enc);
+      if (ret)
+         return ret;
+   }
+   enc_free(enc, sorter->data, sorter->alloc, 1);
+   sorter->data = NULL;
+   sorter->alloc = 0;
+
+   const size_t nr_runs = sorter->nr_runs;
+   sorter->nr_runs = 0;
+   return merge_runs(enc, sorter->runs, nr_runs, emit_word, enc);
+}
+
+int mn_enc_add(struct mini_enc *enc, const void *word, size_t len)
+{
+   if (enc->finished)
+      return MN_EFREEZED;
+
+   if (len == 0 || len > MN_MAX_WORD_LEN)
+      return MN_EWORD;
+
+   if (enc->sorter)
+      return buffer_word(enc, word, len);
+
+   int ret = add_word(enc, word, len);
+   if (!ret)
+      enc->words++;
+   return ret;
+}
+
+int mn_enc_add_buffer(struct mini_enc *enc, const void *data, size_t size,
+                      int delim, size_t *offset)
+{
+   const uint8_t *const start = data, *const end = start + size;
+
+   for (const uint8_t *word = start; word < end; ) {
+      const uint8_t *word_end = memchr(word, delim, end - word);
+      if (!word_end)
+         word_end = end;
+      if (word_end > word) {
+         int ret = mn_enc_add(enc, word, word_end - word);
+         if (ret) {
+            if (offset)
+               *offset = word - start;
+            return ret;
+         }
+      }
+      word = word_end + 1;
+   }
+   return MN_OK;
+}
+
+/* Minimum number of words per thread in mn_enc_add_batch(). Below that,
+ * starting threads costs more than what we gain.
+ */
+#define MN_MIN_BATCH_SIZE 4096
+
+/* A range of words encoded separately, on its own thread. Words of distinct
+ * parts never start with the same byte.
+ */
+struct mini_part {
+   const void *const *words;
+   const size_t *lens;
+   size_t nr;                 /* Number of words in the range. */
+   struct mini_enc *enc;      /* Private encoder. */
+   int ret;                   /* Error code. */
+   bool started;              /* Whether a thread was started for this part. */
+   pthread_t thread;
+};
+
+static void *encode_part(void *arg)
+{
+   struct mini_part *part = arg;
+
+   for (size_t i = 0; i < part->nr && !part->ret; i++)
+      part->ret = mn_enc_add(part->enc, part->words[i], part->lens[i]);
+   return NULL;
+}
+
+/* Registers the states of a part into the main encoder, in order of creation,
+ * then grafts the open path of the part onto the (empty) open path of the main
+ * encoder. States are thus registered in the same order as if the words of the
+ * part had been added with mn_enc_add(), which produces the same automaton.
+ */
+static int merge_part(struct mini_enc *enc, const struct mini_enc *part)
+{
+   assert(enc->prev_len == 0 && enc->stack_size == enc->states[0].nr);
+
+   /* New address of each state of the part. */
+   const size_t map_nr = part->aut_size + 1;
+   uint64_t *map = enc_alloc(enc, map_nr, sizeof *map);
+   if (!map)
+      return MN_E2BIG;
+
+   for (uint64_t pos = 0; pos < part->aut_size; ) {
+      const uint64_t addr = pos;
+      struct mini_state state = {.start = enc->stack_size};
+      do {
+         uint64_t trans = part->automaton[pos];
+         const uint64_t dest = map[GET_DEST(trans)];
+         CLEAR_DEST(trans);
+         SET_DEST(trans, dest);
+         if (!push_transition(enc, trans)) {
+            enc_free(enc, map, map_nr, sizeof *map);
+            return MN_E2BIG;
+         }
+         state.nr++;
+      } while (!IS_LAST(part->automaton[pos++]));
+
+      const uint64_t dest = mkstate(enc, &state);
+      enc->stack_size = state.start;
+      if (dest == UINT64_MAX) {
+         enc_free(enc, map, map_nr, sizeof *map);
+         return mkstate_error(enc);
+      }
+      map[addr] = dest;
+   }
+
+   for (size_t depth = 0; depth <= part->prev_len; depth++) {
+      const struct mini_state *src = &part->states[depth];
+      if (depth)
+         enc->states[depth] = (struct mini_state){
+            .start = enc->stack_size,
+            .terminal = src->terminal,
+         };
+      for (unsigned i = 0; i < src->nr; i++) {
+         uint64_t trans = part->stack[src->start + i];
+         const uint64_t dest = map[GET_DEST(trans)];
+         CLEAR_DEST(trans);
+         SET_DEST(trans, dest);
+         if (!push_transition(enc, trans)) {
+            enc_free(enc, map, map_nr, sizeof *map);
+            return MN_E2BIG;
+         }
+      }
+      enc->states[depth].nr += src->nr;
+   }
+   memcpy(enc->prev, part->prev, part->prev_len + 1);
+   enc->prev_len = part->prev_len;
+   enc->words += part->words;
+
+   enc_free(enc, map, map_nr, sizeof *map);
+   return MN_OK;
+}
+
+/* Splits a batch of words into at most "max" parts of about the same size. */
+static size_t split_batch(struct mini_part *parts, size_t max,
+                          const void *const words[], const size_t lens[],
+                          size_t nr)
+{
+   const size_t target = nr / max;
+   size_t num = 0, start = 0;
+
+   for (size_t i = 1; i <= nr; i++) {
+      if (i < nr && (num == max - 1 || i - start < target))
+         continue;
+      if (i < nr && ((const uint8_t *)words[i])[0] == ((const uint8_t *)words[i - 1])[0])
+         continue;
+      parts[num++] = (struct mini_part){
+         .words = &words[start],
+         .lens = &lens[start],
+         .nr = i - start,
+      };
+      start = i;
+   }
+   return num;
+}
+
+int mn_enc_add_batch(struct mini_enc *enc,
+                     const void *const words[], const size_t lens[], size_t nr,
+                     unsigned threads)
+{
+   if (enc->finished)
+      return MN_EFREEZED;
+
+   if (enc->sorter) {
+      for (size_t i = 0; i < nr; i++) {
+         int ret = mn_enc_add(enc, words[i], lens[i]);
+         if (ret)
+            return ret;
+      }
+      return MN_OK;
+   }
+
+   /* Words that start with the same byte as the previous one go on the open
+    * path of the encoder.
+    */
+   size_t i = 0;
+   for ( ; i < nr && enc->prev_len && lens[i] && ((const uint8_t *)words[i])[0] == enc->prev[0]; i++) {
+      int ret = mn_enc_add(enc, words[i], lens[i]);
+      if (ret)
+         return ret;
+   }
+   for (size_t j = i; j < nr; j++) {
+      if (lens[j] == 0 || lens[j] > MN_MAX_WORD_LEN)
+         return MN_EWORD;
+   }
+
+   size_t max = (nr - i) / MN_MIN_BATCH_SIZE;
+   if (max > threads)
+      max = threads;
+   if (max <= 1) {
+      for ( ; i < nr; i++) {
+         int ret = mn_enc_add(enc, words[i], lens[i]);
+         if (ret)
+            return ret;
+      }
+      return MN_OK;
+   }
+
+   struct mini_part *parts = enc_alloc(enc, max, sizeof *parts);
+   if (!parts)
+      return MN_E2BIG;
+   const size_t num = split_batch(parts, max, &words[i], &lens[i], nr - i);
+
+   /* Check the order of words at the boundaries of parts. Inside parts, this
+    * is done by private encoders.
+    */
+   int ret = MN_OK;
+   if (lmemcmp(parts[0].words[0], parts[0].lens[0], enc->prev, enc->prev_len) <= 0)
+      ret = MN_EORDER;
+   for (size_t k = 1; k < num && !ret; k++) {
+      const struct mini_part *prev = &parts[k - 1];
+      if (lmemcmp(parts[k].words[0], parts[k].lens[0], prev->words[prev->nr - 1], prev->lens[prev->nr - 1]) <= 0)
+         ret = MN_EORDER;
+   }
+
+   /* The first part is encoded on the calling thread, as well as parts for
+    * which we couldn't start a thread.
+    */
+   for (size_t k = 0; k < num && !ret; k++) {
+      parts[k].enc = mn_enc_new(MN_STANDARD);
+      if (!parts[k].enc)
+         ret = MN_E2BIG;
+      else if (k)
+         parts[k].started = !pthread_create(&parts[k].thread, NULL, encode_part, &parts[k]);
+   }
+   for (size_t k = 0; k < num; k++) {
+      if (parts[k].started)
+         pthread_join(parts[k].thread, NULL);
+      else if (!ret)
+         encode_part(&parts[k]);
+   }
+
+   /* Private encoders all run at the same time, and are kept until they are
+    * merged, so their memory counts as used by the main encoder until then.
+    */
+   for (size_t k = 0; k < num; k++)
+      enc->mem_used += parts[k].enc ? parts[k].enc->mem_peak : 0;
+   if (enc->mem_used > enc->mem_peak)
+      enc->mem_peak = enc->mem_used;
+   for (size_t k = 0; k < num; k++) {
+      const size_t part_mem = parts[k].enc ? parts[k].enc->mem_peak : 0;
+      if (!ret)
+         ret = parts[k].ret;
+      if (!ret)
+         ret = minimize(enc, 0);
+      if (!ret)
+         ret = merge_part(enc, parts[k].enc);
+      if (parts[k].enc)
+         mn_enc_free(parts[k].enc);
+      enc->mem_used -= part_mem;
+   }
+
+   enc_free(enc, parts, max, sizeof *parts);
+   return ret;
+}
+
+/* Fills the counts array.
+ * States are always stored after the states they lead to, except for the empty
+ * state at position zero, so a single forward pass over the automaton array is
+ * enough to number them. We first compute for each transition the number of
+ * words reachable through it or one of its following siblings, such that the
+ * value of the first transition of a state is the number of words recognized
+ * from that state. These cumulated counts are then turned into per-transition
+ * counts in a second pass.
+ */
+static int number_states(struct mini_enc *enc, uint64_t start_state)
+{
+   const uint64_t *automaton = enc->automaton;
+   uint32_t *counts = enc->counts;
+
+   counts[0] = 0;
+   for (uint64_t state = 1, pos = 1; pos < enc->aut_size; pos++) {
+      if (!IS_LAST(automaton[pos]))
+         continue;
+      uint64_t count = 0;
+      for (uint64_t i = pos + 1; i-- > state; ) {
+         count += counts[GET_DEST(automaton[i])] + !!IS_TERMINAL(automaton[i]);
+         /* All counts are bounded by the number of words in the automaton,
+          * which must fit in 32 bits.
+          */
+         if (count > UINT32_MAX)
+            return MN_E2BIG;
+         counts[i] = count;
+      }
+      state = pos + 1;
+   }
+
+   const uint32_t total = counts[start_state];
+   for (uint64_t pos = 1; pos < enc->aut_size; pos++) {
+      if (!IS_LAST(automaton[pos]))
+         counts[pos] -= counts[pos + 1];
+   }
+   counts[0] = total;
+   return MN_OK;
+}
+
+/* Writes a header, in network order, along with its checksum. */
+static void encode_header(const struct mini_header *hdr,
+                          uint32_t header[static MN_HEADER_SIZE / sizeof(uint32_t)])
+{
+   const uint32_t counts = hdr->counts | (hdr->native ? MN_FLAG_NATIVE : 0) |
+                           (hdr->little ? MN_FLAG_LITTLE : 0);
+   const uint32_t fields[MN_HEADER_SIZE / sizeof(uint32_t)] = {
+      htonl(mn_magic),
+      htonl(hdr->version),
+      htonl(hdr->type | hdr->width << 8 | hdr->format << 16 | counts << 24),
+      htonl(MN_HEADER_SIZE),
+      htonl((uint32_t)(hdr->nr >> 32)),
+      htonl((uint32_t)hdr->nr),
+      htonl((uint32_t)(hdr->words >> 32)),
+      htonl((uint32_t)hdr->words),
+      htonl((uint32_t)(hdr->large >> 32)),
+      htonl((uint32_t)hdr->large),
+   };
+   memcpy(header, fields, sizeof fields);
+   header[MN_CHECKSUM_FIELD] = htonl(crc32c(0, fields, sizeof fields));
+}
+
+/* Fills the header of an automaton of the given format, made of "nr"
+ * transitions of the given width. For compact automata, the width is one, and
+ * "nr" is the size of the transitions in bytes. "large" is the number of
+ * counts stored apart, with narrow counts.
+ */
+static void fill_header(const struct mini_enc *enc, enum mn_format format,
+                        enum mn_counts counts, unsigned width, uint64_t nr, uint64_t large,
+                        uint32_t header[static MN_HEADER_SIZE / sizeof(uint32_t)])
+{
+   struct mini_header hdr = {
+      .version = mn_version,
+      .type = enc->type,
+      .format = format,
+      .counts = counts,
+      .width = width,
+      .nr = nr,
+      .has_words = true,
+      .words = enc->words,
+      .large = large,
+   };
+   if (enc->native && !enc->stream) {
+      hdr.native = true;
+      hdr.little = format == MN_FORMAT_FIXED && host_little();
+   }
+   encode_header(&hdr, header);
+}
+
+/* Completes the output file in streaming mode. Transitions are rewritten as
+ * 32-bits integers if destinations fit in them, the root transition and the
+ * per-transition counts are filled in, and the header is written last, so that
+ * the file is the same as in the default mode.
+ */
+static int finish_stream(struct mini_enc *enc, uint64_t start_state)
+{
+   struct mini_stream *stream = enc->stream;
+   struct mini_spool *trans = &stream->trans;
+   FILE *fp = trans->fp;
+   const uint64_t nr = enc->aut_size;
+   const unsigned width = nr < MN_MAX_NARROW_SIZE ? sizeof(uint32_t) : sizeof(uint64_t);
+
+   if (!spool_flush(trans) || !spool_map(trans, trans->base + nr * sizeof(uint64_t)))
+      return MN_EIO;
+   const uint64_t *wide = (const uint64_t *)&trans->map[trans->base];
+   const uint32_t *narrow = (const uint32_t *)wide;
+
+   union {
+      uint32_t narrow[1024];
+      uint64_t wide[1024];
+   } buf;
+   const size_t chunk = sizeof buf.wide / sizeof *buf.wide;
+
+   /* Narrowed transitions are written before the ones we still have to read,
+    * so they can be rewritten in place. Wide ones are left as they are, except
+    * for the root transition.
+    */
+   const uint64_t rewrite = width == sizeof(uint32_t) ? nr : 1;
+   for (uint64_t i = 0; i < rewrite; i += chunk) {
+      size_t len = rewrite - i < chunk ? rewrite - i : chunk;
+      for (size_t j = 0; j < len; j++) {
+         uint64_t t = ntoh64(wide[i + j]);
+         if (i + j == 0)
+            SET_DEST(t, start_state);
+         if (width == sizeof(uint32_t))
+            buf.narrow[j] = htonl((uint32_t)t);
+         else
+            buf.wide[j] = hton64(t);
+      }
+      if (fseeko(fp, trans->base + i * width, SEEK_SET) || fwrite(&buf, width, len, fp) != len)
+         return MN_EIO;
+   }
+   if (fflush(fp))
+      return MN_EIO;
+
+   if (enc->type == MN_NUMBERED) {
+      struct mini_spool *counts = &stream->counts;
+      if (!spool_flush(counts) || !spool_map(counts, nr * sizeof(uint32_t)))
+         return MN_EIO;
+      const uint32_t *cumulated = (const uint32_t *)counts->map;
+
+      for (uint64_t i = 0; i < nr; i += chunk) {
+         size_t len = nr - i < chunk ? nr - i : chunk;
+         for (size_t j = 0; j < len; j++) {
+            const uint64_t pos = i + j;
+            if (!pos) {
+               buf.narrow[j] = htonl(cumulated[start_state]);
+               continue;
+            }
+            const uint64_t t = width == sizeof(uint32_t) ? ntohl(narrow[pos]) : ntoh64(wide[pos]);
+            uint32_t count = cumulated[pos];
+            if (!IS_LAST(t))
+               count -= cumulated[pos + 1];
+            buf.narrow[j] = htonl(count);
+         }
+         if (fseeko(fp, trans->base + nr * width + i * sizeof(uint32_t), SEEK_SET) ||
+             fwrite(&buf, sizeof(uint32_t), len, fp) != len)
+            return MN_EIO;
+      }
+   }
+
+   uint32_t header[MN_HEADER_SIZE / sizeof(uint32_t)];
+   fill_header(enc, MN_FORMAT_FIXED, MN_COUNTS_FULL, width, nr, 0, header);
+   stream->size = trans->base + nr * (width + (enc->type == MN_NUMBERED ? sizeof(uint32_t) : 0));
+   if (fseeko(fp, 0, SEEK_SET) || fwrite(header, 1, sizeof header, fp) != sizeof header ||
+       fflush(fp) || ftruncate(fileno(fp), stream->size) || fseeko(fp, stream->size, SEEK_SET))
+      return MN_EIO;
+   return MN_OK;
+}
+
+/* Lists the states reachable from the start state in breadth-first order.
+ * Visited states are marked with a non-zero value in "map".
+ * Returns the number of states.
+ */
+static uint64_t order_bfs(const uint64_t *automaton, uint64_t start,
+                          uint64_t *order, uint64_t *map)
+{
+   uint64_t nr = 0;
+   map[start] = 1;
+   order[nr++] = start;
+   for (uint64_t i = 0; i < nr; i++) {
+      for (uint64_t pos = order[i]; ; pos++) {
+         const uint64_t dest = GET_DEST(automaton[pos]);
+         if (dest && !map[dest]) {
+            map[dest] = 1;
+            order[nr++] = dest;
+         }
+         if (IS_LAST(automaton[pos]))
+            break;
+      }
+   }
+   return nr;
+}
+
+/* Same as above, in depth-first pre-order. The stack only holds the states
+ * along the current path, so it is bounded by the maximum word length.
+ */
+static uint64_t order_dfs(const uint64_t *automaton, uint64_t start,
+                          uint64_t *order, uint64_t *map)
+{
+   uint64_t stack[MN_MAX_WORD_LEN + 1];
+   size_t depth = 0;
+   uint64_t nr = 0;
+
+   map[start] = 1;
+   order[nr++] = start;
+   stack[depth++] = start;
+   while (depth) {
+      const uint64_t trans = automaton[stack[depth - 1]];
+      if (IS_LAST(trans))
+         depth--;
+      else
+         stack[depth - 1]++;
+      const uint64_t dest = GET_DEST(trans);
+      if (dest && !map[dest]) {
+         map[dest] = 1;
+         order[nr++] = dest;
+         stack[depth++] = dest;
+      }
+   }
+   return nr;
+}
+
+/* Lists states in the order of the compact format: depth-first, except that
+ * the destination of the last transition of each state, if not listed yet,
+ * comes right after it, so that this transition can omit its destination.
+ * Other destinations are pushed on "stack", which must have room for one entry
+ * per transition. Visited states are marked with a non-zero value in "map".
+ * Returns the number of states.
+ */
+static uint64_t order_compact(const uint64_t *automaton, uint64_t start,
+                              uint64_t *order, uint64_t *map, uint64_t *stack)
+{
+   uint64_t depth = 0;
+   uint64_t nr = 0;
+
+   stack[depth++] = start;
+   while (depth) {
+      uint64_t state = stack[--depth];
+      while (state && !map[state]) {
+         map[state] = 1;
+         order[nr++] = state;
+         uint64_t pos = state;
+         for (; !IS_LAST(automaton[pos]); pos++) {
+            const uint64_t dest = GET_DEST(automaton[pos]);
+            if (dest && !map[dest])
+               stack[depth++] = dest;
+         }
+         state = GET_DEST(automaton[pos]);
+      }
+   }
+   return nr;
+}
+
+struct mini_hot_state {
+   uint64_t visits;     /* Number of sample queries that went through it. */
+   uint64_t rank;       /* Position in depth-first order. */
+};
+
+static int cmp_hot_states(const void *a, const void *b)
+{
+   const struct mini_hot_state *s1 = a, *s2 = b;
+   if (s1->visits != s2->visits)
+      return s1->visits < s2->visits ? 1 : -1;
+   return (s1->rank > s2->rank) - (s1->rank < s2->rank);
+}
+
+/* Reorders states by decreasing number of visits while looking up the sample
+ * queries, so that the states most often used are packed together at the
+ * beginning of the automaton. Ties, and states never visited, are kept in
+ * depth-first order.
+ */
+static int order_profile(struct mini_enc *enc, uint64_t start,
+                         uint64_t *order, uint64_t *map, uint64_t nr)
+{
+   const uint64_t *automaton = enc->automaton;
+
+   for (uint64_t i = 0; i < nr; i++)
+      map[order[i]] = 0;
+   for (size_t q = 0; q < enc->profile_nr; q++) {
+      const uint8_t *query = enc->profile[q];
+      const size_t len = enc->profile_lens[q];
+      uint64_t state = start;
+      for (size_t i = 0; state; i++) {
+         map[state]++;
+         if (i == len)
+            break;
+         uint64_t pos = state;
+         while (GET_CHAR(automaton[pos]) != query[i] && !IS_LAST(automaton[pos]))
+            pos++;
+         if (GET_CHAR(automaton[pos]) != query[i])
+            break;
+         state = GET_DEST(automaton[pos]);
+      }
+   }
+
+   struct mini_hot_state *hot = enc_alloc(enc, nr, sizeof *hot);
+   if (!hot)
+      return MN_E2BIG;
+   for (uint64_t i = 0; i < nr; i++)
+      hot[i] = (struct mini_hot_state){.visits = map[order[i]], .rank = i};
+   qsort(hot, nr, sizeof *hot, cmp_hot_states);
+   for (uint64_t i = 0; i < nr; i++)
+      hot[i].visits = order[hot[i].rank];
+   for (uint64_t i = 0; i < nr; i++)
+      order[i] = hot[i].visits;
+   enc_free(enc, hot, nr, sizeof *hot);
+   return MN_OK;
+}
+
+/* Renumbers the states of a finished automaton according to the chosen
+ * layout. The transitions of each state are kept together and in order, and
+ * per-transition counts move along with them, so the automaton recognizes the
+ * same words with the same ordinals. Only the positions of states change.
+ */
+static int relayout(struct mini_enc *enc)
+{
+   const uint64_t start = GET_DEST(enc->automaton[0]);
+   const uint64_t size = enc->aut_size;
+   if (!start)
+      return MN_OK;
+
+   uint64_t *map = enc_alloc(enc, size, sizeof *map);
+   uint64_t *order = enc_alloc(enc, size, sizeof *order);
+   uint64_t *automaton = enc_alloc(enc, size, sizeof *automaton);
+   uint32_t *counts = enc->counts ? enc_alloc(enc, size, sizeof *counts) : NULL;
+   int ret = map && order && automaton && (counts || !enc->counts) ? MN_OK : MN_E2BIG;
+   if (ret)
+      goto fini;
+
+   uint64_t nr;
+   if (enc->layout == MN_LAYOUT_BFS) {
+      nr = order_bfs(enc->automaton, start, order, map);
+   } else {
+      nr = order_dfs(enc->automaton, start, order, map);
+      if (enc->layout == MN_LAYOUT_PROFILE)
+         ret = order_profile(enc, start, order, map, nr);
+      if (ret)
+         goto fini;
+   }
+
+   /* Assign new positions, the root transition staying first. */
+   uint64_t pos = 1;
+   for (uint64_t i = 0; i < nr; i++) {
+      map[order[i]] = pos;
+      for (uint64_t t = order[i]; !IS_LAST(enc->automaton[t]); t++)
+         pos++;
+      pos++;
+   }
+   assert(pos == size);
+
+   for (uint64_t i = 0; i <= nr; i++) {
+      const uint64_t from = i ? order[i - 1] : 0;
+      uint64_t to = i ? map[from] : 0;
+      for (uint64_t t = from; ; t++, to++) {
+         uint64_t trans = enc->automaton[t];
+         const uint64_t dest = GET_DEST(trans);
+         if (dest) {
+            CLEAR_DEST(trans);
+            SET_DEST(trans, map[dest]);
+         }
+         automaton[to] = trans;
+         if (counts)
+            counts[to] = enc->counts[t];
+         if (IS_LAST(trans))
+            break;
+      }
+   }
+
+   enc_free(enc, enc->automaton, enc->aut_alloc, sizeof *enc->automaton);
+   enc->automaton = automaton;
+   enc->aut_alloc = size;
+   automaton = NULL;
+   if (counts) {
+      enc_free(enc, enc->counts, size, sizeof *enc->counts);
+      enc->counts = counts;
+      counts = NULL;
+   }
+
+fini:
+   enc_free(enc, counts, size, sizeof *counts);
+   enc_free(enc, automaton, size, sizeof *automaton);
+   enc_free(enc, order, size, sizeof *order);
+   enc_free(enc, map, size, sizeof *map);
+   return ret;
+}
+
+/* Marks the entries of the map of overlap_states() that still hold the
+ * position of a suffix rather than the new position of a state.
+ */
+#define MN_OVERLAPPED (UINT64_C(1) << 63)
+
+/* Hashes a transition list, from its last transition to its first one, so
+ * that the hashes of all the suffixes of a state are obtained in one pass.
+ */
+static uint64_t hash_suffix(uint64_t hash, uint64_t trans)
+{
+   hash = (hash << 23 | hash >> 41) ^ trans;
+   return hash * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+/* Returns whether the transitions starting at "a" and "b" are the same, up to
+ * and including the last transition of their state.
+ */
+static bool same_suffix(const uint64_t *automaton, uint64_t a, uint64_t b)
+{
+   for (;; a++, b++) {
+      if (automaton[a] != automaton[b])
+         return false;
+      if (IS_LAST(automaton[a]))
+         return true;
+   }
+}
+
+/* Returns the new position of the state at "state", which is either kept, or
+ * stored at the end of a longer state, possibly itself stored in another one.
+ * The latter is found by walking back to the last transition of the previous
+ * state. As a host is always longer than the states it stores, this recurses
+ * at most 256 times.
+ */
+static uint64_t overlap_pos(const uint64_t *automaton, uint64_t *map, uint64_t state)
+{
+   if (!(map[state] & MN_OVERLAPPED))
+      return map[state];
+
+   const uint64_t pos = map[state] & ~MN_OVERLAPPED;
+   uint64_t host = pos;
+   while (!IS_LAST(automaton[host - 1]))
+      host--;
+   map[state] = overlap_pos(automaton, map, host) + pos - host;
+   return map[state];
+}
+
+/* Stores each state whose transitions are the last ones of another state
+ * inside the latter. Transitions don't say where their state starts, and
+ * reading a state stops at its last transition, so that such a state can be
+ * entered in the middle of its host. The suffixes of all states are first
+ * registered in a hash table, then each state is looked up in it. Kept states
+ * stay in the same order, and per-transition counts move along with them.
+ */
+static int overlap_states(struct mini_enc *enc)
+{
+   const uint64_t *automaton = enc->automaton;
+   const uint64_t size = enc->aut_size;
+
+   uint64_t suffixes = 0;
+   for (uint64_t pos = 1; pos < size; pos++)
+      suffixes += !IS_LAST(automaton[pos]);
+   if (!suffixes)
+      return MN_OK;
+
+   size_t table_size = 16;
+   while (table_size < 2 * suffixes)
+      table_size *= 2;
+   const size_t mask = table_size - 1;
+
+   /* Suffixes are stored by position. Position zero is the root transition,
+    * so it can't be one, and marks empty buckets.
+    */
+   uint64_t *table = enc_alloc(enc, table_size, sizeof *table);
+   uint64_t *map = enc_alloc(enc, size, sizeof *map);
+   uint64_t *new_aut = NULL;
+   uint32_t *new_counts = NULL;
+   uint64_t new_size = 1;
+   int ret = table && map ? MN_OK : MN_E2BIG;
+   if (ret)
+      goto fini;
+
+   for (uint64_t state = 1, pos = 1; pos < size; pos++) {
+      if (!IS_LAST(automaton[pos]))
+         continue;
+      uint64_t hash = 0;
+      for (uint64_t i = pos; i > state; i--) {
+         hash = hash_suffix(hash, automaton[i]);
+         size_t bkt = (hash ^ hash >> 32) & mask;
+         while (table[bkt])
+            bkt = (bkt + 1) & mask;
+         table[bkt] = i;
+      }
+      state = pos + 1;
+   }
+
+   /* Assign new positions to the states that are kept, the root transition
+    * staying first, and the position of their host suffix to the others.
+    */
+   uint64_t saved = 0;
+   for (uint64_t state = 1, pos = 1; pos < size; pos++) {
+      if (!IS_LAST(automaton[pos]))
+         continue;
+      uint64_t hash = 0;
+      for (uint64_t i = pos + 1; i-- > state; )
+         hash = hash_suffix(hash, automaton[i]);
+      uint64_t host = 0;
+      for (size_t bkt = (hash ^ hash >> 32) & mask; table[bkt]; bkt = (bkt + 1) & mask) {
+         if (same_suffix(automaton, table[bkt], state)) {
+            host = table[bkt];
+            break;
+         }
+      }
+      if (host) {
+         map[state] = host | MN_OVERLAPPED;
+         saved += pos + 1 - state;
+      } else {
+         map[state] = new_size;
+         new_size += pos + 1 - state;
+      }
+      state = pos + 1;
+   }
+   enc_free(enc, table, table_size, sizeof *table);
+   table = NULL;
+   if (!saved)
+      goto fini;
+
+   for (uint64_t state = 1, pos = 1; pos < size; pos++) {
+      if (!IS_LAST(automaton[pos]))
+         continue;
+      overlap_pos(automaton, map, state);
+      state = pos + 1;
+   }
+
+   new_aut = enc_alloc(enc, new_size, sizeof *new_aut);
+   new_counts = enc->counts ? enc_alloc(enc, new_size, sizeof *new_counts) : NULL;
+   if (!new_aut || (enc->counts && !new_counts)) {
+      ret = MN_E2BIG;
+      goto fini;
+   }
+
+   /* Copy kept states. A stored state is strictly inside its host, so its
+    * new position can't be the one the next kept state is copied to.
+    */
+   uint64_t to = 0;
+   for (uint64_t state = 0, pos = 0; pos < size; state = ++pos) {
+      const bool kept = !state || map[state] == to;
+      for (;; pos++) {
+         uint64_t trans = automaton[pos];
+         if (kept) {
+            const uint64_t dest = GET_DEST(trans);
+            if (dest) {
+               CLEAR_DEST(trans);
+               SET_DEST(trans, map[dest]);
+            }
+            if (new_counts)
+               new_counts[to] = enc->counts[pos];
+            new_aut[to++] = trans;
+         }
+         if (IS_LAST(trans))
+            break;
+      }
+   }
+   assert(to == new_size);
+
+   enc_free(enc, enc->automaton, enc->aut_alloc, sizeof *enc->automaton);
+   enc->automaton = new_aut;
+   enc->aut_alloc = enc->aut_size = new_size;
+   new_aut = NULL;
+   if (new_counts) {
+      enc_free(enc, enc->counts, size, sizeof *enc->counts);
+      enc->counts = new_counts;
+      new_counts = NULL;
+   }
+   enc->overlap_saved = saved;
+
+fini:
+   enc_free(enc, new_counts, new_size, sizeof *new_counts);
+   enc_free(enc, new_aut, new_size, sizeof *new_aut);
+   enc_free(enc, table, table_size, sizeof *table);
+   enc_free(enc, map, size, sizeof *map);
+   return ret;
+}
+
+static int finish(struct mini_enc *enc)
+{
+   int ret = enc->sorter ? flush_sorter(enc) : MN_OK;
+   if (!ret)
+      ret = minimize(enc, 0);
+   if (ret)
+      return ret;
+
+   uint64_t start_state = mkstate(enc, &enc->states[0]);
+   if (start_state == UINT64_MAX)
+      return mkstate_error(enc);
+
+   if (enc->stream)
+      return finish_stream(enc, start_state);
+
+   SET_DEST(enc->automaton[0], start_state);
+   if (enc->type == MN_NUMBERED) {
+      enc->counts = enc_alloc(enc, enc->aut_size, sizeof *enc->counts);
+      if (!enc->counts)
+         return MN_E2BIG;
+      int ret = number_states(enc, start_state);
+      if (ret)
+         return ret;
+   }
+
+   /* States must be numbered first, as this relies on the default order, and
+    * be stored inside others last, as then they aren't contiguous anymore.
+    * Compact automata have a layout of their own.
+    */
+   if (enc->layout != MN_LAYOUT_DEFAULT && enc->format != MN_FORMAT_COMPACT) {
+      ret = relayout(enc);
+      if (ret)
+         return ret;
+   }
+   if (enc->overlap && enc->format != MN_FORMAT_COMPACT)
+      return overlap_states(enc);
+   return MN_OK;
+}
+
+/* Finishes the automaton, unless this was done already. */
+static int freeze(struct mini_enc *enc)
+{
+   if (!enc->finished) {
+      int ret = finish(enc);
+      if (ret)
+         return ret;
+      enc->finished = true;
+   }
+   return MN_OK;
+}
+
+/* Converts an integer to the byte order of the output file. */
+static inline uint32_t enc32(const struct mini_enc *enc, uint32_t n)
+{
+   return enc->native ? n : htonl(n);
+}
+
+static inline uint64_t enc64(const struct mini_enc *enc, uint64_t n)
+{
+   return enc->native ? n : hton64(n);
+}
+
+/* Whether integers have to be byte swapped when written. */
+static inline bool enc_swaps(const struct mini_enc *enc)
+{
+   return !enc->native && host_little();
+}
+
+/* Writes the padding that follows an array of "size" bytes in a native
+ * automaton, up to the next eight bytes boundary, plus "extra" bytes.
+ */
+static int write_padding(const struct mini_enc *enc, uint64_t size, size_t extra,
+                         int (*write)(void *arg, const void *data, size_t size),
+                         void *arg)
+{
+   static const uint8_t zeros[16];
+   const size_t len = (8 - size % 8) % 8 + extra;
+   assert(len <= sizeof zeros);
+
+   if (enc->native && len && write(arg, zeros, len))
+      return MN_EIO;
+   return MN_OK;
+}
+
+/* Returns the number of counts of a numbered automaton that don't fit in a
+ * narrow count.
+ */
+static uint64_t count_large(const struct mini_enc *enc)
+{
+   uint64_t large = 0;
+   for (uint64_t i = 0; i < enc->aut_size; i++)
+      large += enc->counts[i] >= MN_LARGE_COUNT;
+   return large;
+}
+
+/* Writes the counts of a numbered automaton as narrow counts: one byte per
+ * transition, padded to a multiple of eight bytes, then for each block of 64
+ * transitions, a 64 bits bitmap of the transitions whose count doesn't fit in
+ * a byte, then for each block the number of such transitions in the previous
+ * ones, and finally their counts. Integers are in network order.
+ */
+static int write_narrow_counts(const struct mini_enc *enc,
+                               int (*write)(void *arg, const void *data, size_t size),
+                               void *arg)
+{
+   union {
+      uint8_t bytes[8192];
+      uint32_t narrow[1024];
+      uint64_t wide[1024];
+   } buf;
+   const size_t chunk = sizeof buf.wide / sizeof *buf.wide;
+   const uint32_t *counts = enc->counts;
+   const uint64_t nr = enc->aut_size;
+   const uint64_t blocks = (nr + 63) / 64;
+
+   for (uint64_t i = 0; i < nr; i += sizeof buf.bytes) {
+      size_t len = nr - i < sizeof buf.bytes ? nr - i : sizeof buf.bytes;
+      for (size_t j = 0; j < len; j++)
+         buf.bytes[j] = counts[i + j] < MN_LARGE_COUNT ? counts[i + j] : MN_LARGE_COUNT;
+      if (write(arg, &buf, len))
+         return MN_EIO;
+   }
+   static const uint8_t zeros[8];
+   if (nr % 8 && write(arg, zeros, 8 - nr % 8))
+      return MN_EIO;
+
+   for (uint64_t i = 0; i < blocks; i += chunk) {
+      size_t len = blocks - i < chunk ? blocks - i : chunk;
+      for (size_t j = 0; j < len; j++) {
+         uint64_t bits = 0;
+         for (uint64_t pos = (i + j) * 64; pos < nr && pos < (i + j + 1) * 64; pos++)
+            bits |= (uint64_t)(counts[pos] >= MN_LARGE_COUNT) << pos % 64;
+         buf.wide[j] = enc64(enc, bits);
+      }
+      if (write(arg, &buf, len * sizeof *buf.wide))
+         return MN_EIO;
+   }
+
+   uint32_t rank = 0;
+   for (uint64_t i = 0; i < blocks; i += chunk) {
+      size_t len = blocks - i < chunk ? blocks - i : chunk;
+      for (size_t j = 0; j < len; j++) {
+         buf.narrow[j] = enc32(enc, rank);
+         for (uint64_t pos = (i + j) * 64; pos < nr && pos < (i + j + 1) * 64; pos++)
+            rank += counts[pos] >= MN_LARGE_COUNT;
+      }
+      if (write(arg, &buf, len * sizeof *buf.narrow))
+         return MN_EIO;
+   }
+
+   size_t len = 0;
+   for (uint64_t pos = 0; pos < nr; pos++) {
+      if (counts[pos] < MN_LARGE_COUNT)
+         continue;
+      buf.narrow[len++] = enc32(enc, counts[pos]);
+      if (len == chunk) {
+         if (write(arg, &buf, len * sizeof *buf.narrow))
+            return MN_EIO;
+         len = 0;
+      }
+   }
+   if (len && write(arg, &buf, len * sizeof *buf.narrow))
+      return MN_EIO;
+   return MN_OK;
+}
+
+/* Writes the transitions of a numbered automaton, each one followed by its
+ * count, in network order. 64 bits transitions are thus not aligned.
+ */
+static int write_interleaved(const struct mini_enc *enc, unsigned width,
+                             int (*write)(void *arg, const void *data, size_t size),
+                             void *arg)
+{
+   uint32_t buf[3 * 1024];
+   const size_t words = width / sizeof *buf + 1;
+   const size_t chunk = sizeof buf / sizeof *buf / words;
+
+   for (uint64_t i = 0; i < enc->aut_size; i += chunk) {
+      size_t nr = enc->aut_size - i < chunk ? enc->aut_size - i : chunk;
+      for (size_t j = 0; j < nr; j++) {
+         uint32_t *rec = &buf[j * words];
+         const uint64_t trans = enc->automaton[i + j];
+         if (width == sizeof(uint32_t)) {
+            rec[0] = enc32(enc, (uint32_t)trans);
+         } else {
+            const uint64_t wide = enc64(enc, trans);
+            memcpy(rec, &wide, sizeof wide);
+         }
+         rec[width / sizeof *rec] = enc32(enc, enc->counts[i + j]);
+      }
+      if (write(arg, buf, nr * words * sizeof *buf))
+         return MN_EIO;
+   }
+   return MN_OK;
+}
+
+/* Writes the automaton array, followed by the counts array if the automaton is
+ * numbered, in network order. Transitions are written as integers of the given
+ * width, and counts as narrow counts if "narrow" is set.
+ */
+static int write_aut(const struct mini_enc *enc, unsigned width, bool narrow,
+                     int (*write)(void *arg, const void *data, size_t size),
+                     void *arg)
+{
+   union {
+      uint32_t narrow[1024];
+      uint64_t wide[1024];
+   } buf;
+   const size_t chunk = sizeof buf.wide / sizeof *buf.wide;
+
+   if (enc->counts && enc->count_format == MN_COUNTS_INTERLEAVED) {
+      int ret = write_interleaved(enc, width, write, arg);
+      if (ret)
+         return ret;
+      return write_padding(enc, enc->aut_size * (width + sizeof *enc->counts), 0, write, arg);
+   }
+
+   for (uint64_t i = 0; i < enc->aut_size; i += chunk) {
+      size_t nr = enc->aut_size - i < chunk ? enc->aut_size - i : chunk;
+      if (width == sizeof(uint32_t)) {
+         for (size_t j = 0; j < nr; j++)
+            buf.narrow[j] = (uint32_t)enc->automaton[i + j];
+      } else {
+         memcpy(buf.wide, &enc->automaton[i], nr * width);
+      }
+      if (enc_swaps(enc))
+         swap_ints(&buf, nr * width, width);
+      if (write(arg, &buf, nr * width))
+         return MN_EIO;
+   }
+   int ret = write_padding(enc, enc->aut_size * width, 0, write, arg);
+   if (ret)
+      return ret;
+
+   if (!enc->counts)
+      return MN_OK;
+   if (narrow)
+      return write_narrow_counts(enc, write, arg);
+   for (uint64_t i = 0; i < enc->aut_size; i += chunk) {
+      size_t nr = enc->aut_size - i < chunk ? enc->aut_size - i : chunk;
+      memcpy(buf.narrow, &enc->counts[i], nr * sizeof *enc->counts);
+      if (enc_swaps(enc))
+         swap_ints(&buf, nr * sizeof *enc->counts, sizeof *enc->counts);
+      if (write(arg, &buf, nr * sizeof *enc->counts))
+         return MN_EIO;
+   }
+   return MN_OK;
+}
+
+/* Writes an automaton finished in streaming mode, by copying the output file. */
+static int copy_stream(struct mini_enc *enc,
+                       int (*write)(void *arg, const void *data, size_t size),
+                       void *arg)
+{
+   struct mini_spool *trans = &enc->stream->trans;
+   const uint64_t size = enc->stream->size;
+   const size_t chunk = 1 << 20;
+
+   if (!spool_map(trans, size))
+      return MN_EIO;
+   for (uint64_t off = 0; off < size; off += chunk) {
+      if (write(arg, &trans->map[off], size - off < chunk ? size - off : chunk))
+         return MN_EIO;
+   }
+   return MN_OK;
+}
+
+/* Returns the number of bytes needed to store an integer. */
+static unsigned byte_len(uint64_t val)
+{
+   unsigned len = 0;
+   for (; val; val >>= 8)
+      len++;
+   return len;
+}
+
+/* Encodes a transition in the compact format, given the offset of its
+ * destination and the number of bytes to store it in, and returns its size. If
+ * "buf" is NULL, only computes the size.
+ */
+static unsigned put_compact(uint8_t *buf, uint64_t trans, uint64_t dest,
+                            unsigned dest_len, bool next, const uint32_t *count)
+{
+   const unsigned count_len = !count ? 0 : *count ? byte_len(*count) : 1;
+   if (buf) {
+      unsigned len = 0;
+      buf[len++] = GET_CHAR(trans);
+      buf[len++] = (trans & 0x3) | (next ? MN_COMPACT_NEXT : 0) | dest_len << 3 |
+                   (count ? (count_len - 1) << 6 : 0);
+      for (unsigned i = dest_len; i--; )
+         buf[len++] = (uint8_t)(dest >> 8 * i);
+      for (unsigned i = count_len; i--; )
+         buf[len++] = (uint8_t)(*count >> 8 * i);
+   }
+   return 2 + dest_len + count_len;
+}
+
+/* Goes over the transitions of the states listed in "order", preceded by the
+ * root transition, and assigns offsets to the states in "map", given the
+ * current offsets of their destinations. Destinations are stored in as few
+ * bytes as possible, or in the number of bytes given in "lens", if not NULL.
+ * Sets "changed" if the length of the offset of any state changed, in which
+ * case the sizes of the transitions leading to it may have to change. If
+ * "write" is not NULL, transitions are also written, which only makes sense
+ * once offsets are stable.
+ */
+static int compact_pass(const struct mini_enc *enc, const uint64_t *order,
+                        uint64_t nr, uint64_t *map, const uint8_t *lens,
+                        uint64_t *size, bool *changed,
+                        int (*write)(void *arg, const void *data, size_t size),
+                        void *arg)
+{
+   const uint64_t *automaton = enc->automaton;
+   uint8_t buf[1 << 12];
+   size_t len = 0;
+   uint64_t off = 0;
+
+   *changed = false;
+   for (uint64_t i = 0; i <= nr; i++) {
+      const uint64_t state = i ? order[i - 1] : 0;
+      const uint64_t follow = i < nr ? order[i] : 0;
+      if (i) {
+         *changed |= byte_len(map[state]) != byte_len(off);
+         map[state] = off;
+      }
+      for (uint64_t pos = state; ; pos++) {
+         const uint64_t trans = automaton[pos];
+         const uint64_t dest = GET_DEST(trans);
+         const bool next = IS_LAST(trans) && dest && dest == follow;
+         const unsigned dest_len = next || !dest ? 0 : lens ? lens[dest] : byte_len(map[dest]);
+         const unsigned trans_size = put_compact(write ? &buf[len] : NULL, trans,
+                                                 dest ? map[dest] : 0, dest_len, next,
+                                                 enc->counts ? &enc->counts[pos] : NULL);
+         off += trans_size;
+         if (write && (len += trans_size) > sizeof buf - 16) {
+            if (write(arg, buf, len))
+               return MN_EIO;
+            len = 0;
+         }
+         if (IS_LAST(trans))
+            break;
+      }
+   }
+   if (write && len && write(arg, buf, len))
+      return MN_EIO;
+   *size = off;
+   return MN_OK;
+}
+
+/* Writes an automaton in the compact format. Offsets of states depend on the
+ * lengths of the destinations that precede them, which depend on offsets, so
+ * these are computed starting from an upper bound, and lowered until their
+ * lengths don't change anymore. Offsets can only decrease from one pass to
+ * the next, but states close to a power of 256 can keep crossing it for a
+ * while, so after a few passes, the current lengths are used as they are:
+ * offsets computed with them can only be smaller, and still fit.
+ */
+static int write_compact(struct mini_enc *enc,
+                         int (*write)(void *arg, const void *data, size_t size),
+                         void *arg)
+{
+   const uint64_t start = GET_DEST(enc->automaton[0]);
+   const uint64_t size = enc->aut_size;
+
+   uint64_t *map = enc_alloc(enc, size, sizeof *map);
+   uint64_t *order = enc_alloc(enc, size, sizeof *order);
+   uint64_t *stack = enc_alloc(enc, size, sizeof *stack);
+   uint8_t *lens = NULL;
+   int ret = map && order && stack ? MN_OK : MN_E2BIG;
+   if (ret)
+      goto fini;
+
+   const uint64_t nr = start ? order_compact(enc->automaton, start, order, map, stack) : 0;
+   for (uint64_t i = 0; i < nr; i++)
+      map[order[i]] = MN_MAX_COMPACT_SIZE - 1;
+
+   uint64_t total;
+   bool changed;
+   for (unsigned pass = 0; pass < MN_COMPACT_PASSES; pass++) {
+      ret = compact_pass(enc, order, nr, map, NULL, &total, &changed, NULL, NULL);
+      if (ret || !changed)
+         break;
+   }
+   if (!ret && changed) {
+      lens = enc_alloc(enc, size, sizeof *lens);
+      if (!lens) {
+         ret = MN_E2BIG;
+         goto fini;
+      }
+      for (uint64_t i = 0; i < nr; i++)
+         lens[order[i]] = byte_len(map[order[i]]);
+      ret = compact_pass(enc, order, nr, map, lens, &total, &changed, NULL, NULL);
+   }
+   if (ret)
+      goto fini;
+   if (total >= MN_MAX_COMPACT_SIZE) {
+      ret = MN_E2BIG;
+      goto fini;
+   }
+
+   uint32_t header[MN_HEADER_SIZE / sizeof(uint32_t)];
+   fill_header(enc, MN_FORMAT_COMPACT, MN_COUNTS_FULL, 1, total, 0, header);
+   if (write(arg, header, sizeof header))
+      ret = MN_EIO;
+   else
+      ret = compact_pass(enc, order, nr, map, lens, &total, &changed, write, arg);
+   if (!ret)
+      ret = write_padding(enc, total, sizeof(uint64_t), write, arg);
+   if (!ret)
+      ret = write_padding(enc, 0, sizeof(uint64_t), write, arg);
+
+fini:
+   enc_free(enc, lens, size, sizeof *lens);
+   enc_free(enc, stack, size, sizeof *stack);
+   enc_free(enc, order, size, sizeof *order);
+   enc_free(enc, map, size, sizeof *map);
+   return ret;
+}
+
+/* Returns the number of bits needed to store an integer, at least one. */
+static unsigned bit_len(uint64_t val)
+{
+   unsigned len = 1;
+   while (val >>= 1)
+      len++;
+   return len;
+}
+
+/* Writes a stream of integers of arbitrary bit widths, most significant bits
+ * first.
+ */
+struct mini_bit_writer {
+   int (*write)(void *arg, const void *data, size_t size);
+   void *arg;
+   uint64_t acc;           /* Pending bits, in the "bits" low bits. */
+   unsigned bits;
+   size_t len;             /* Number of bytes in the buffer. */
+   uint8_t buf[1 << 12];
+};
+
+/* Appends "len" bits, at most MN_MAX_PACKED_BITS. */
+static int put_bits(struct mini_bit_writer *bw, uint64_t val, unsigned len)
+{
+   bw->acc = bw->acc << len | val;
+   bw->bits += len;
+   while (bw->bits >= 8) {
+      bw->bits -= 8;
+      bw->buf[bw->len++] = (uint8_t)(bw->acc >> bw->bits);
+   }
+   if (bw->len > sizeof bw->buf - sizeof(uint64_t)) {
+      if (bw->write(bw->arg, bw->buf, bw->len))
+         return MN_EIO;
+      bw->len = 0;
+   }
+   return MN_OK;
+}
+
+/* Pads the stream with zeroes up to a byte boundary, and writes it out. */
+static int flush_bits(struct mini_bit_writer *bw)
+{
+   if (bw->bits)
+      put_bits(bw, 0, 8 - bw->bits);
+   if (bw->len && bw->write(bw->arg, bw->buf, bw->len))
+      return MN_EIO;
+   bw->len = 0;
+   return MN_OK;
+}
+
+/* Writes an automaton in the packed format. Transitions are the same as in the
+ * fixed format, truncated to the bits needed for the largest destination. The
+ * width of counts isn't stored: as the count of the root transition is the
+ * number of words, it is the number of bits needed for the latter.
+ */
+static int write_packed(const struct mini_enc *enc,
+                        int (*write)(void *arg, const void *data, size_t size),
+                        void *arg)
+{
+   const unsigned trans_bits = 10 + bit_len(enc->aut_size - 1);
+   const unsigned count_bits = bit_len(enc->words);
+
+   uint32_t header[MN_HEADER_SIZE / sizeof(uint32_t)];
+   fill_header(enc, MN_FORMAT_PACKED, MN_COUNTS_FULL, trans_bits, enc->aut_size, 0, header);
+   if (write(arg, header, sizeof header))
+      return MN_EIO;
+
+   struct mini_bit_writer bw = {.write = write, .arg = arg};
+   for (uint64_t i = 0; i < enc->aut_size; i++) {
+      if (put_bits(&bw, enc->automaton[i], trans_bits))
+         return MN_EIO;
+   }
+   if (flush_bits(&bw))
+      return MN_EIO;
+   const uint64_t trans_size = (enc->aut_size * trans_bits + 7) / 8;
+   int ret = write_padding(enc, trans_size, sizeof(uint64_t), write, arg);
+   if (ret)
+      return ret;
+   if (enc->counts) {
+      for (uint64_t i = 0; i < enc->aut_size; i++) {
+         if (put_bits(&bw, enc->counts[i], count_bits))
+            return MN_EIO;
+      }
+      if (flush_bits(&bw))
+         return MN_EIO;
+   }
+   return write_padding(enc, 0, sizeof(uint64_t), write, arg);
+}
+
+int mn_enc_dump(struct mini_enc *enc,
+                int (*write)(void *arg, const void *data, size_t size),
+                void *arg)
+{
+   int ret = freeze(enc);
+   if (ret)
+      return ret;
+   if (enc->stream)
+      return copy_stream(enc, write, arg);
+
+   if (enc->format == MN_FORMAT_COMPACT)
+      return write_compact(enc, write, arg);
+   if (enc->format == MN_FORMAT_PACKED && 10 + bit_len(enc->aut_size - 1) <= MN_MAX_PACKED_BITS)
+      return write_packed(enc, write, arg);
+
+   /* Use 32-bits transitions if destinations fit in them. Narrow counts are
+    * indexed with 32 bits ranks, which is always enough in practice.
+    */
+   unsigned width = enc->aut_size < MN_MAX_NARROW_SIZE ? sizeof(uint32_t) : sizeof(uint64_t);
+   const uint64_t large = enc->counts && enc->count_format == MN_COUNTS_NARROW ? count_large(enc) : UINT64_MAX;
+   const bool narrow = large <= UINT32_MAX;
+   const enum mn_counts counts = enc->counts && enc->count_format == MN_COUNTS_INTERLEAVED ?
+                                 MN_COUNTS_INTERLEAVED : narrow ? MN_COUNTS_NARROW : MN_COUNTS_FULL;
+   uint32_t header[MN_HEADER_SIZE / sizeof(uint32_t)];
+   fill_header(enc, MN_FORMAT_FIXED, counts, width, enc->aut_size, narrow ? large : 0, header);
+   if (write(arg, header, sizeof header))
+      return MN_EIO;
+
+   return write_aut(enc, width, narrow, write, arg);
+}
+
+static int mn_write(void *fp, const void *data, size_t size)
+{
+   if (fwrite(data, 1, size, fp) == size)
+      return 0;
+   return -1;
+}
+
+int mn_enc_dump_file(struct mini_enc *enc, FILE *fp)
+{
+   /* In streaming mode, the automaton is already in its output file. */
+   int ret;
+   if (enc->stream && enc->stream->trans.fp == fp)
+      ret = freeze(enc);
+   else
+      ret = mn_enc_dump(enc, mn_write, fp);
+   if (ret)
+      return ret;
+
+   return fflush(fp) ? MN_EIO : MN_OK;
+}
+
+
+/*******************************************************************************
+ * Decoder
+ ******************************************************************************/
+
+struct mini {
+   const uint32_t *counts;    /* NULL unless numbered and fixed-width, with
+                               * full counts. */
+   const uint8_t *narrow_counts; /* NULL unless numbered with narrow counts. */
+   const uint64_t *large_bits;   /* Bitmaps of the transitions whose count is
+                                  * stored apart, per block of 64. */
+   const uint32_t *large_ranks;  /* Number of such transitions before each
+                                  * block. */
+   const uint32_t *large_counts; /* Counts stored apart. */
+   const uint8_t *packed_counts; /* NULL unless numbered and packed. */
+   const void *transitions;
+   uint64_t nr;               /* Number of transitions, or size of the
+                               * transitions in bytes if compact. */
+   uint64_t words;            /* Number of words. */
+   unsigned width;            /* Size of a transition, in bytes, or in bits
+                               * if packed. */
+   unsigned count_bits;       /* Size of a count, in bits, if packed. */
+   uint64_t large;            /* Number of counts stored apart, with narrow
+                               * counts. */
+   enum mn_type type;
+   enum mn_format format;
+   enum mn_counts count_format;
+   bool native;               /* Whether written in the native layout. */
+   size_t size;               /* Size of the arrays, from the start of the
+                               * transitions, in bytes. */
+   void *buf;                 /* Arrays allocated by the loader, if any. */
+   void *map;                 /* Pages mapped by mn_load_mmap() or
+                               * mn_advise(), if any. */
+   size_t map_size;
+   bool locked;               /* Whether the arrays are locked in memory. */
+   struct mini_jumps *jumps;  /* Built by mn_accelerate(), if called. */
+};
+
+/* Reads a big-endian integer of "len" bytes, at most eight. The transitions of
+ * compact automata are followed by eight bytes of padding, so that this can
+ * always be done with a single load.
+ */
+static inline uint64_t get_be(const uint8_t *bytes, unsigned len)
+{
+   /* Compilers turn this into a single load and byte swap. */
+   const uint64_t val = (uint64_t)bytes[0] << 56 | (uint64_t)bytes[1] << 48 |
+                        (uint64_t)bytes[2] << 40 | (uint64_t)bytes[3] << 32 |
+                        (uint64_t)bytes[4] << 24 | (uint64_t)bytes[5] << 16 |
+                        (uint64_t)bytes[6] << 8 | bytes[7];
+   return len ? val >> (64 - 8 * len) : 0;
+}
+
+/* Returns the size of a compact transition, given its flags. */
+static inline unsigned compact_size(const struct mini *fsa, uint8_t flags)
+{
+   return 2 + COMPACT_DEST_LEN(flags) +
+          (fsa->type == MN_NUMBERED ? COMPACT_COUNT_LEN(flags) : 0);
+}
+
+/* Returns the transition at a given position of a fixed-width automaton. */
+static inline uint64_t get_fixed_trans(const struct mini *fsa, uint64_t pos)
+{
+   if (fsa->width == sizeof(uint32_t))
+      return ((const uint32_t *)fsa->transitions)[pos];
+   return ((const uint64_t *)fsa->transitions)[pos];
+}
+
+/* Same as above, for a compact automaton. The transition is converted to the
+ * fixed-width format.
+ */
+static inline uint64_t get_compact_trans(const struct mini *fsa, uint64_t pos)
+{
+   const uint8_t *trans = (const uint8_t *)fsa->transitions + pos;
+   const uint8_t flags = trans[1];
+   const uint64_t dest = flags & MN_COMPACT_NEXT ?
+      pos + compact_size(fsa, flags) : get_be(&trans[2], COMPACT_DEST_LEN(flags));
+   return dest << 10 | (uint64_t)trans[0] << 2 | (flags & 0x3);
+}
+
+/* Returns the integer of "len" bits at a given position of an array of
+ * packed integers. Packed arrays are followed by eight bytes of padding.
+ */
+static inline uint64_t get_bits(const uint8_t *bytes, uint64_t pos, unsigned len)
+{
+   const uint64_t bit = pos * len;
+   return get_be(&bytes[bit >> 3], sizeof(uint64_t)) << (bit & 7) >> (64 - len);
+}
+
+/* Same as get_fixed_trans(), for an automaton with interleaved counts. 64 bits
+ * transitions are followed by a 32 bits count, and are thus not aligned.
+ */
+static inline uint64_t get_interleaved_trans(const struct mini *fsa, uint64_t pos)
+{
+   if (fsa->width == sizeof(uint32_t))
+      return ((const uint32_t *)fsa->transitions)[2 * pos];
+   uint64_t trans;
+   memcpy(&trans, (const uint8_t *)fsa->transitions + 12 * pos, sizeof trans);
+   return trans;
+}
+
+/* Same as get_fixed_trans(), for a packed automaton. */
+static inline uint64_t get_packed_trans(const struct mini *fsa, uint64_t pos)
+{
+   return get_bits(fsa->transitions, pos, fsa->width);
+}
+
+/* Returns the transition at a given position, whatever the format. Lookup
+ * functions have a separate loop for each format instead, so that the fixed
+ * format doesn't pay for the others.
+ */
+static inline uint64_t get_trans(const struct mini *fsa, uint64_t pos)
+{
+   switch (fsa->format) {
+   case MN_FORMAT_COMPACT:
+      return get_compact_trans(fsa, pos);
+   case MN_FORMAT_PACKED:
+      return get_packed_trans(fsa, pos);
+   default:
+      if (fsa->count_format == MN_COUNTS_INTERLEAVED)
+         return get_interleaved_trans(fsa, pos);
+      return get_fixed_trans(fsa, pos);
+   }
+}
+
+/* Returns the position of the transition that follows a given one. */
+static inline uint64_t next_trans(const struct mini *fsa, uint64_t pos)
+{
+   if (fsa->format == MN_FORMAT_COMPACT)
+      return pos + compact_size(fsa, ((const uint8_t *)fsa->transitions)[pos + 1]);
+   return pos + 1;
+}
+
+/* Returns the number of bits set in an integer. */
+static inline unsigned popcount64(uint64_t n)
+{
+#if defined(__GNUC__)
+   return __builtin_popcountll(n);
+#else
+   n -= n >> 1 & UINT64_C(0x5555555555555555);
+   n = (n & UINT64_C(0x3333333333333333)) + (n >> 2 & UINT64_C(0x3333333333333333));
+   n = (n + (n >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+   return (unsigned)(n * UINT64_C(0x0101010101010101) >> 56);
+#endif
+}
+
+/* Returns the index of the least significant bit set, which must exist. */
+static inline unsigned ctz64(uint64_t n)
+{
+#if defined(__GNUC__)
+   return (unsigned)__builtin_ctzll(n);
+#else
+   return popcount64((n & -n) - 1);
+#endif
+}
+
+/* Large counts are found by counting the large counts that precede them in
+ * their block.
+ */
+static inline uint32_t get_narrow_count(const struct mini *fsa, uint64_t pos)
+{
+   const uint8_t count = fsa->narrow_counts[pos];
+   if (count != MN_LARGE_COUNT)
+      return count;
+   const uint64_t before = fsa->large_bits[pos / 64] & ((UINT64_C(1) << pos % 64) - 1);
+   return fsa->large_counts[fsa->large_ranks[pos / 64] + popcount64(before)];
+}
+
+/* Interleaved counts follow their transition. */
+static inline uint32_t get_interleaved_count(const struct mini *fsa, uint64_t pos)
+{
+   const unsigned words = fsa->width / sizeof(uint32_t);
+   return ((const uint32_t *)fsa->transitions)[pos * (words + 1) + words];
+}
+
+static inline uint32_t get_fixed_count(const struct mini *fsa, uint64_t pos)
+{
+   if (fsa->counts)
+      return fsa->counts[pos];
+   if (fsa->narrow_counts)
+      return get_narrow_count(fsa, pos);
+   return get_interleaved_count(fsa, pos);
+}
+
+static inline uint32_t get_packed_count(const struct mini *fsa, uint64_t pos)
+{
+   return (uint32_t)get_bits(fsa->packed_counts, pos, fsa->count_bits);
+}
+
+/* Returns the count of the transition at a given position, in a numbered
+ * automaton.
+ */
+static inline uint32_t get_count(const struct mini *fsa, uint64_t pos)
+{
+   switch (fsa->format) {
+   case MN_FORMAT_COMPACT: {
+      const uint8_t *trans = (const uint8_t *)fsa->transitions + pos;
+      const uint8_t flags = trans[1];
+      return (uint32_t)get_be(&trans[2 + COMPACT_DEST_LEN(flags)], COMPACT_COUNT_LEN(flags));
+   }
+   case MN_FORMAT_PACKED:
+      return get_packed_count(fsa, pos);
+   default:
+      return get_fixed_count(fsa, pos);
+   }
+}
+
+static int read_header(struct mini_header *hdr,
+                       int (*read)(void *arg, void *buf, size_t size),
+                       void *arg)
+{
+   uint32_t header[MN_HEADER_SIZE / sizeof(uint32_t)] = {0};
+   const size_t common = MN_V1_HEADER_SIZE / sizeof *header;
+   const size_t known = MN_HEADER_SIZE / sizeof *header;
+
+   if (read(arg, header, MN_V1_HEADER_SIZE))
+      return MN_EIO;
+   for (size_t i = 0; i < common; i++)
+      header[i] = ntohl(header[i]);
+
+   if (header[0] != mn_magic)
+      return MN_EMAGIC;
+   hdr->version = header[1];
+
+   if (hdr->version == 1) {
+      hdr->type = header[2] & 0xff;
+      hdr->format = MN_FORMAT_FIXED;
+      hdr->counts = MN_COUNTS_FULL;
+      hdr->width = sizeof(uint32_t);
+      hdr->nr = header[2] >> 8;
+      hdr->has_words = false;
+      hdr->words = 0;
+      hdr->large = 0;
+      hdr->native = false;
+      hdr->little = false;
+      return MN_OK;
+   }
+   if (hdr->version != mn_version)
+      return MN_EVERSION;
+
+   if (read(arg, &header[common], MN_HEADER_SIZE - MN_V1_HEADER_SIZE))
+      return MN_EIO;
+   for (size_t i = common; i < known; i++)
+      header[i] = ntohl(header[i]);
+
+   const uint32_t size = header[3];
+   if (size < MN_HEADER_SIZE || size % sizeof *header)
+      return MN_ECORRUPT;
+
+   /* The checksum covers the whole header, including the fields we don't know
+    * about, with the checksum itself set to zero.
+    */
+   uint32_t fields[MN_HEADER_SIZE / sizeof(uint32_t)];
+   for (size_t i = 0; i < known; i++)
+      fields[i] = i == MN_CHECKSUM_FIELD ? 0 : htonl(header[i]);
+   uint32_t crc = crc32c(0, fields, sizeof fields);
+
+   hdr->type = header[2] & 0xff;
+   hdr->width = (header[2] >> 8) & 0xff;
+   hdr->format = (header[2] >> 16) & 0xff;
+   hdr->counts = header[2] >> 24 & MN_COUNTS_MASK;
+   hdr->native = header[2] >> 24 & MN_FLAG_NATIVE;
+   hdr->little = header[2] >> 24 & MN_FLAG_LITTLE;
+   hdr->nr = (uint64_t)header[4] << 32 | header[5];
+   hdr->has_words = true;
+   hdr->words = (uint64_t)header[6] << 32 | header[7];
+   hdr->large = (uint64_t)header[8] << 32 | header[9];
+   if (hdr->counts == MN_COUNTS_NARROW) {
+      if (hdr->format != MN_FORMAT_FIXED || hdr->type != MN_NUMBERED ||
+          hdr->large > hdr->nr || hdr->large > UINT32_MAX)
+         return MN_ECORRUPT;
+   } else if (hdr->counts == MN_COUNTS_INTERLEAVED) {
+      if (hdr->format != MN_FORMAT_FIXED || hdr->type != MN_NUMBERED)
+         return MN_ECORRUPT;
+   } else if (hdr->counts != MN_COUNTS_FULL) {
+      return MN_ECORRUPT;
+   }
+   if (hdr->little && (!hdr->native || hdr->format != MN_FORMAT_FIXED))
+      return MN_ECORRUPT;
+   if (hdr->format == MN_FORMAT_FIXED) {
+      if (hdr->width != sizeof(uint32_t) && hdr->width != sizeof(uint64_t))
+         return MN_ECORRUPT;
+   } else if (hdr->format == MN_FORMAT_COMPACT) {
+      if (hdr->width != 1)
+         return MN_ECORRUPT;
+   } else if (hdr->format == MN_FORMAT_PACKED) {
+      if (hdr->width <= 10 || hdr->width > MN_MAX_PACKED_BITS)
+         return MN_ECORRUPT;
+   } else {
+      return MN_ECORRUPT;
+   }
+
+   /* Skip header fields we don't know about. */
+   for (uint32_t left = size - known * sizeof *header; left; ) {
+      uint8_t buf[64];
+      size_t len = left < sizeof buf ? left : sizeof buf;
+      if (read(arg, buf, len))
+         return MN_EIO;
+      crc = crc32c(crc, buf, len);
+      left -= len;
+   }
+   if (crc != header[MN_CHECKSUM_FIELD])
+      return MN_ECORRUPT;
+   return MN_OK;
+}
+
+/* Counts the words of an automaton whose header doesn't record this
+ * information. The number of words recognized from each state is memoized, so
+ * that this takes time linear in the size of the automaton.
+ */
+static int count_words(const struct mini *fsa, uint64_t *words)
+{
+   struct frame {
+      uint64_t state;         /* Position of the state. */
+      uint64_t pos;           /* Current transition. */
+      uint64_t count;         /* Words counted so far. */
+   } stack[MN_MAX_WORD_LEN + 1];
+   size_t depth = 0;
+
+   const uint64_t root = GET_DEST(get_trans(fsa, 0));
+   *words = 0;
+   if (!root)
+      return MN_OK;
+
+   /* Number of words recognized from a state plus one, or zero if not yet
+    * known.
+    */
+   uint64_t *memo = calloc(fsa->nr, sizeof *memo);
+   if (!memo)
+      return MN_E2BIG;
+
+   int ret = MN_OK;
+   stack[depth++] = (struct frame){.state = root, .pos = root};
+   while (depth) {
+      struct frame *top = &stack[depth - 1];
+      if (top->pos >= fsa->nr || GET_DEST(get_trans(fsa, top->pos)) >= fsa->nr) {
+         ret = MN_ECORRUPT;
+         break;
+      }
+      const uint64_t trans = get_trans(fsa, top->pos);
+      const uint64_t dest = GET_DEST(trans);
+      if (dest && !memo[dest]) {
+         /* Words can't be longer than this, so the automaton must be cyclic. */
+         if (depth == sizeof stack / sizeof *stack) {
+            ret = MN_ECORRUPT;
+            break;
+         }
+         stack[depth++] = (struct frame){.state = dest, .pos = dest};
+         continue;
+      }
+      top->count += !!IS_TERMINAL(trans) + (dest ? memo[dest] - 1 : 0);
+      if (IS_LAST(trans))
+         memo[stack[--depth].state] = top->count + 1;
+      else
+         top->pos = next_trans(fsa, top->pos);
+   }
+
+   *words = memo[root] - 1;
+   free(memo);
+   return ret;
+}
+
+/* Sizes and offsets of the arrays of a loaded automaton, in bytes. The data of
+ * native automata is laid out the same way in the file.
+ */
+struct mini_layout {
+   uint64_t trans_size;       /* Size of the transitions. */
+   uint64_t counts_offset;    /* Offset of the counts, from the transitions. */
+   uint64_t counts_size;      /* Size of the counts. */
+   size_t padding;            /* Size of the padding after each array. */
+   unsigned count_bits;       /* Size of a count, in bits, if packed. */
+   uint64_t blocks;           /* Number of blocks of narrow counts. */
+};
+
+static int get_layout(const struct mini_header *hdr, struct mini_layout *lay)
+{
+   const uint64_t max_size = hdr->format == MN_FORMAT_COMPACT ? MN_MAX_COMPACT_SIZE :
+                             hdr->format == MN_FORMAT_PACKED ? ((uint64_t)1 << (hdr->width - 10)) + 1 :
+                             hdr->width == sizeof(uint32_t) ? MN_MAX_NARROW_SIZE : MN_MAX_SIZE;
+   if (hdr->nr < 1 || hdr->nr >= max_size)
+      return MN_ECORRUPT;
+   if (hdr->type != MN_STANDARD && hdr->type != MN_NUMBERED)
+      return MN_ECORRUPT;
+
+   /* Counts of compact automata are stored along with transitions. Compact
+    * and packed arrays are followed by padding. Counts start on an eight
+    * bytes boundary.
+    */
+   const bool numbered = hdr->type == MN_NUMBERED;
+   lay->count_bits = hdr->format == MN_FORMAT_PACKED ? bit_len(hdr->words) : 0;
+   lay->blocks = (hdr->nr + 63) / 64;
+   lay->padding = sizeof(uint64_t);
+   switch (hdr->format) {
+   case MN_FORMAT_COMPACT:
+      lay->trans_size = hdr->nr;
+      lay->counts_size = 0;
+      break;
+   case MN_FORMAT_PACKED:
+      lay->trans_size = (hdr->nr * hdr->width + 7) / 8;
+      lay->counts_size = numbered ? (hdr->nr * lay->count_bits + 7) / 8 : 0;
+      break;
+   default:
+      lay->trans_size = hdr->nr * hdr->width;
+      if (hdr->counts == MN_COUNTS_INTERLEAVED) {
+         lay->trans_size += hdr->nr * sizeof(uint32_t);
+         lay->counts_size = 0;
+      } else if (hdr->counts == MN_COUNTS_NARROW) {
+         lay->counts_size = (hdr->nr + 7) / 8 * 8 +
+                            lay->blocks * (sizeof(uint64_t) + sizeof(uint32_t)) +
+                            hdr->large * sizeof(uint32_t);
+      } else {
+         lay->counts_size = numbered ? hdr->nr * sizeof(uint32_t) : 0;
+      }
+      lay->padding = 0;
+      break;
+   }
+   lay->counts_offset = (lay->trans_size + lay->padding + 7) / 8 * 8;
+   if (lay->counts_offset + lay->counts_size > SIZE_MAX - sizeof(struct mini) - lay->padding)
+      return MN_E2BIG;
+   return MN_OK;
+}
+
+/* Whether the transitions and counts of an automaton are in another byte order
+ * than the host one. Compact and packed automata are made of bytes.
+ */
+static bool needs_swap(const struct mini_header *hdr)
+{
+   return hdr->format == MN_FORMAT_FIXED && hdr->little != host_little();
+}
+
+/* Sets up an automaton whose transitions are at "transitions", followed by
+ * its counts, as described by "lay".
+ */
+static void init_fsa(struct mini *fsa, const struct mini_header *hdr,
+                     const struct mini_layout *lay, const uint8_t *transitions)
+{
+   const uint8_t *counts = transitions + lay->counts_offset;
+
+   fsa->transitions = transitions;
+   fsa->counts = NULL;
+   fsa->narrow_counts = NULL;
+   fsa->large_bits = NULL;
+   fsa->large_ranks = NULL;
+   fsa->large_counts = NULL;
+   fsa->packed_counts = NULL;
+   fsa->width = hdr->width;
+   fsa->count_bits = lay->count_bits;
+   fsa->nr = hdr->nr;
+   fsa->words = hdr->words;
+   fsa->large = hdr->counts == MN_COUNTS_NARROW ? hdr->large : 0;
+   fsa->type = hdr->type;
+   fsa->format = hdr->format;
+   fsa->count_format = hdr->counts;
+   fsa->native = hdr->native;
+   fsa->size = lay->counts_offset + lay->counts_size + lay->padding;
+   fsa->buf = NULL;
+   fsa->map = NULL;
+   fsa->map_size = 0;
+   fsa->locked = false;
+   fsa->jumps = NULL;
+
+   if (!lay->counts_size)
+      return;
+   if (fsa->format == MN_FORMAT_PACKED) {
+      fsa->packed_counts = counts;
+   } else if (fsa->count_format == MN_COUNTS_NARROW) {
+      fsa->narrow_counts = counts;
+      fsa->large_bits = (const uint64_t *)(counts + (fsa->nr + 7) / 8 * 8);
+      fsa->large_ranks = (const uint32_t *)(fsa->large_bits + lay->blocks);
+      fsa->large_counts = fsa->large_ranks + lay->blocks;
+   } else {
+      fsa->counts = (const uint32_t *)counts;
+   }
+}
+
+/* Allocates an automaton, and its arrays, whose padding is cleared. The
+ * padding of native automata is then read from the file along with the arrays.
+ */
+static struct mini *new_fsa(const struct mini_header *hdr, const struct mini_layout *lay)
+{
+   struct mini *fsa = malloc(sizeof *fsa);
+   uint8_t *buf = malloc(lay->counts_offset + lay->counts_size + lay->padding);
+   if (!fsa || !buf) {
+      free(fsa);
+      free(buf);
+      return NULL;
+   }
+   memset(&buf[lay->trans_size], 0, lay->counts_offset - lay->trans_size);
+   memset(&buf[lay->counts_offset + lay->counts_size], 0, lay->padding);
+   init_fsa(fsa, hdr, lay, buf);
+   fsa->buf = buf;
+   return fsa;
+}
+
+/* Maximum number of arrays an automaton is made of, in the file. */
+#define MN_MAX_SEGMENTS 8
+
+/* An array of an automaton, which is contiguous in the file, and made of
+ * integers of a single size.
+ */
+struct mini_segment {
+   uint8_t *data;             /* Where it is loaded. */
+   uint64_t offset;           /* Offset in the file, from the end of the
+                               * header. */
+   uint64_t size;             /* Size, in bytes. */
+   unsigned width;            /* Size of the integers to convert to host
+                               * order, zero if there is nothing to convert. */
+};
+
+static void add_segment(struct mini_segment *segs, size_t *nr, uint8_t *data,
+                        uint64_t size, unsigned width)
+{
+   const uint64_t offset = *nr ? segs[*nr - 1].offset + segs[*nr - 1].size : 0;
+   if (size)
+      segs[(*nr)++] = (struct mini_segment){data, offset, size, width};
+}
+
+/* Lists the arrays to read for an automaton whose transitions are loaded at
+ * "transitions", in the order of the file. Returns their number.
+ */
+static size_t get_segments(const struct mini_header *hdr, const struct mini_layout *lay,
+                           uint8_t *transitions, struct mini_segment segs[static MN_MAX_SEGMENTS])
+{
+   uint8_t *counts = transitions + lay->counts_offset;
+   const bool swap = needs_swap(hdr);
+   size_t nr = 0;
+
+   unsigned width = hdr->width;
+   if (hdr->counts == MN_COUNTS_INTERLEAVED && width != sizeof(uint32_t))
+      width += sizeof(uint32_t);
+   add_segment(segs, &nr, transitions, lay->trans_size, swap ? width : 0);
+   if (hdr->native)
+      add_segment(segs, &nr, &transitions[lay->trans_size], lay->counts_offset - lay->trans_size, 0);
+
+   if (hdr->counts == MN_COUNTS_NARROW) {
+      const uint64_t bytes = (hdr->nr + 7) / 8 * 8;
+      const uint64_t bits = lay->blocks * sizeof(uint64_t);
+      const uint64_t ranks = lay->blocks * sizeof(uint32_t);
+      add_segment(segs, &nr, counts, bytes, 0);
+      add_segment(segs, &nr, &counts[bytes], bits, swap ? sizeof(uint64_t) : 0);
+      add_segment(segs, &nr, &counts[bytes + bits], ranks, swap ? sizeof(uint32_t) : 0);
+      add_segment(segs, &nr, &counts[bytes + bits + ranks], hdr->large * sizeof(uint32_t),
+                  swap ? sizeof(uint32_t) : 0);
+   } else {
+      add_segment(segs, &nr, counts, lay->counts_size, swap ? sizeof(uint32_t) : 0);
+   }
+   if (hdr->native)
+      add_segment(segs, &nr, &counts[lay->counts_size], lay->padding, 0);
+   return nr;
+}
+
+/* Checks the narrow counts of an automaton. The ranks of blocks must match
+ * their bitmaps, and bitmaps must match the narrow counts, so that large
+ * counts are never looked up out of bounds.
+ */
+static bool check_narrow_counts(const struct mini *fsa, uint64_t blocks, uint64_t large)
+{
+   const uint8_t *narrow = fsa->narrow_counts;
+   const uint64_t *bits = fsa->large_bits;
+
+   uint64_t rank = 0;
+   for (uint64_t i = 0; i < blocks; i++) {
+      if (fsa->large_ranks[i] != rank)
+         return false;
+      rank += popcount64(bits[i]);
+      for (uint64_t pos = i * 64; pos < fsa->nr && pos < (i + 1) * 64; pos++) {
+         if ((narrow[pos] == MN_LARGE_COUNT) != (bits[i] >> pos % 64 & 1))
+            return false;
+      }
+   }
+   return rank == large;
+}
+
+/* Sets the number of words of an automaton whose header doesn't record it. */
+static int init_words(struct mini *fsa, const struct mini_header *hdr)
+{
+   if (hdr->has_words)
+      return MN_OK;
+   if (fsa->type == MN_NUMBERED) {
+      fsa->words = get_count(fsa, 0);
+      return MN_OK;
+   }
+   return count_words(fsa, &fsa->words);
+}
+
+/* Completes the loading of an automaton whose arrays have been read and
+ * converted to host order.
+ */
+static int finish_load(struct mini *fsa, const struct mini_header *hdr,
+                       const struct mini_layout *lay)
+{
+   if (fsa->count_format == MN_COUNTS_NARROW && !check_narrow_counts(fsa, lay->blocks, hdr->large))
+      return MN_ECORRUPT;
+   return init_words(fsa, hdr);
+}
+
+int mn_load(struct mini **fsap,
+            int (*read)(void *arg, void *buf, size_t size),
+            void *arg)
+{
+   *fsap = NULL;
+
+   struct mini_header hdr;
+   int ret = read_header(&hdr, read, arg);
+   if (ret)
+      return ret;
+   struct mini_layout lay;
+   ret = get_layout(&hdr, &lay);
+   if (ret)
+      return ret;
+
+   struct mini *fsa = new_fsa(&hdr, &lay);
+   if (!fsa)
+      return MN_E2BIG;
+   uint8_t *transitions = fsa->buf;
+
+   struct mini_segment segs[MN_MAX_SEGMENTS];
+   const size_t nr = get_segments(&hdr, &lay, transitions, segs);
+   for (size_t i = 0; i < nr; i++) {
+      if (read(arg, segs[i].data, segs[i].size)) {
+         mn_free(fsa);
+         return MN_EIO;
+      }
+      swap_ints(segs[i].data, segs[i].size, segs[i].width);
+   }
+
+   ret = finish_load(fsa, &hdr, &lay);
+   if (ret) {
+      mn_free(fsa);
+      return ret;
+   }
+   *fsap = fsa;
+   return MN_OK;
+}
+
+static int mn_read(void *fp, void *buf, size_t size)
+{
+   if (fread(buf, 1, size, fp) == size)
+      return 0;
+   return -1;
+}
+
+int mn_load_file(struct mini **fsa, FILE *fp)
+{
+   return mn_load(fsa, mn_read, fp);
+}
+
+/* Size of the pieces of an automaton read and converted at once by
+ * mn_load_parallel(). This is a multiple of the size of all integers and
+ * records.
+ */
+#define MN_LOAD_CHUNK (3 << 20)
+
+/* A range of pieces of an automaton loaded on its own thread. */
+struct mini_load_part {
+   const struct mini_segment *chunks;
+   size_t nr;                 /* Number of pieces in the range. */
+   int fd;                    /* File descriptor to read from. */
+   off_t offset;              /* Offset of the end of the header. */
+   int ret;                   /* Error code. */
+   bool started;              /* Whether a thread was started for this part. */
+   pthread_t thread;
+};
+
+static int pread_all(int fd, void *buf, size_t size, off_t offset)
+{
+   uint8_t *bytes = buf;
+   while (size) {
+      ssize_t len = pread(fd, bytes, size, offset);
+      if (len < 0 && errno == EINTR)
+         continue;
+      if (len <= 0)
+         return -1;
+      bytes += len;
+      size -= len;
+      offset += len;
+   }
+   return 0;
+}
+
+static void *load_part(void *arg)
+{
+   struct mini_load_part *part = arg;
+
+   for (size_t i = 0; i < part->nr && !part->ret; i++) {
+      const struct mini_segment *chunk = &part->chunks[i];
+      if (pread_all(part->fd, chunk->data, chunk->size, part->offset + chunk->offset))
+         part->ret = MN_EIO;
+      else
+         swap_ints(chunk->data, chunk->size, chunk->width);
+   }
+   return NULL;
+}
+
+/* Reads the arrays of an automaton with up to "threads" threads. */
+static int load_segments(const struct mini_segment *segs, size_t nr, int fd, off_t offset,
+                         unsigned threads)
+{
+   size_t total = 0;
+   for (size_t i = 0; i < nr; i++)
+      total += (segs[i].size + MN_LOAD_CHUNK - 1) / MN_LOAD_CHUNK;
+   const size_t num = threads < total ? threads : total;
+
+   struct mini_segment *chunks = malloc(total * sizeof *chunks);
+   struct mini_load_part *parts = calloc(num, sizeof *parts);
+   if (!chunks || !parts) {
+      free(chunks);
+      free(parts);
+      return MN_E2BIG;
+   }
+   size_t len = 0;
+   for (size_t i = 0; i < nr; i++) {
+      for (uint64_t pos = 0; pos < segs[i].size; pos += MN_LOAD_CHUNK) {
+         const uint64_t size = segs[i].size - pos < MN_LOAD_CHUNK ? segs[i].size - pos : MN_LOAD_CHUNK;
+         chunks[len++] = (struct mini_segment){&segs[i].data[pos], segs[i].offset + pos, size, segs[i].width};
+      }
+   }
+
+   /* The first part is loaded on the calling thread, as well as parts for
+    * which we couldn't start a thread.
+    */
+   for (size_t k = 0; k < num; k++) {
+      parts[k].chunks = &chunks[k * total / num];
+      parts[k].nr = (k + 1) * total / num - k * total / num;
+      parts[k].fd = fd;
+      parts[k].offset = offset;
+      if (k)
+         parts[k].started = !pthread_create(&parts[k].thread, NULL, load_part, &parts[k]);
+   }
+   int ret = MN_OK;
+   for (size_t k = 0; k < num; k++) {
+      if (parts[k].started)
+         pthread_join(parts[k].thread, NULL);
+      else
+         load_part(&parts[k]);
+      if (!ret)
+         ret = parts[k].ret;
+   }
+
+   free(parts);
+   free(chunks);
+   return ret;
+}
 
-   uint32_t size = enc->counts ? MN_NUMBERED : MN_STANDARD;
-   size |= enc->aut_size << 8;
-   uint32_t header[3] = {
-      htonl(mn_magic),
-      htonl(mn_version),
-      htonl(size),
-   };
-   if (write(arg, header, sizeof header))
-      return MN_EIO;
+int mn_load_parallel(struct mini **fsap, FILE *fp, unsigned threads)
+{
+   struct stat st;
+   if (threads <= 1 || fstat(fileno(fp), &st) || !S_ISREG(st.st_mode))
+      return mn_load_file(fsap, fp);
+   *fsap = NULL;
 
-   size_t to_write = enc->aut_size * sizeof *enc->automaton;
-   if (write(arg, enc->automaton, to_write) || (enc->counts && write(arg, enc->counts, to_write)))
+   struct mini_header hdr;
+   int ret = read_header(&hdr, mn_read, fp);
+   if (ret)
+      return ret;
+   struct mini_layout lay;
+   ret = get_layout(&hdr, &lay);
+   if (ret)
+      return ret;
+   const off_t offset = ftello(fp);
+   if (offset < 0)
       return MN_EIO;
+
+   struct mini *fsa = new_fsa(&hdr, &lay);
+   if (!fsa)
+      return MN_E2BIG;
+   uint8_t *transitions = fsa->buf;
+
+   /* The file is read past the buffer of the stream, which we discard by
+    * seeking to the end of the automaton.
+    */
+   struct mini_segment segs[MN_MAX_SEGMENTS];
+   const size_t nr = get_segments(&hdr, &lay, transitions, segs);
+   const uint64_t size = nr ? segs[nr - 1].offset + segs[nr - 1].size : 0;
+   ret = load_segments(segs, nr, fileno(fp), offset, threads);
+   if (!ret && fseeko(fp, offset + size, SEEK_SET))
+      ret = MN_EIO;
+   if (!ret)
+      ret = finish_load(fsa, &hdr, &lay);
+   if (ret) {
+      mn_free(fsa);
+      return ret;
+   }
+   *fsap = fsa;
    return MN_OK;
 }
 
-static int mn_write(void *fp, const void *data, size_t size)
+struct mini_mem {
+   const uint8_t *data;
+   size_t size;
+   size_t pos;
+};
+
+static int mem_read(void *arg, void *buf, size_t size)
 {
-   if (fwrite(data, 1, size, fp) == size)
-      return 0;
-   return -1;
+   struct mini_mem *mem = arg;
+   if (size > mem->size - mem->pos)
+      return -1;
+   memcpy(buf, &mem->data[mem->pos], size);
+   mem->pos += size;
+   return 0;
 }
 
-int mn_enc_dump_file(struct mini_enc *enc, FILE *fp)
+/* Same as mn_load_mem(), but tells whether the automaton is used in place.
+ * Automata that can't be used in place are copied if "copy" is set.
+ */
+static int load_mem(struct mini **fsap, const void *data, size_t size, bool copy,
+                    bool *in_place)
 {
-   int ret = mn_enc_dump(enc, mn_write, fp);
+   *fsap = NULL;
+   *in_place = false;
+
+   struct mini_mem mem = {.data = data, .size = size};
+   struct mini_header hdr;
+   int ret = read_header(&hdr, mem_read, &mem);
+   if (ret)
+      return ret;
+   struct mini_layout lay;
+   ret = get_layout(&hdr, &lay);
    if (ret)
       return ret;
 
-   return fflush(fp) ? MN_EIO : MN_OK;
+   const uint8_t *transitions = &mem.data[mem.pos];
+   if (!hdr.native || needs_swap(&hdr) || (uintptr_t)transitions % sizeof(uint64_t)) {
+      if (!copy)
+         return MN_ENATIVE;
+      mem.pos = 0;
+      return mn_load(fsap, mem_read, &mem);
+   }
+   if (lay.counts_offset + lay.counts_size + lay.padding > size - mem.pos)
+      return MN_EIO;
+
+   struct mini *fsa = malloc(sizeof *fsa);
+   if (!fsa)
+      return MN_E2BIG;
+   init_fsa(fsa, &hdr, &lay, transitions);
+   ret = init_words(fsa, &hdr);
+   if (ret) {
+      free(fsa);
+      return ret;
+   }
+   *fsap = fsa;
+   *in_place = true;
+   return MN_OK;
 }
 
+int mn_load_mem(struct mini **fsap, const void *data, size_t size)
+{
+   bool in_place;
+   return load_mem(fsap, data, size, true, &in_place);
+}
 
-/*******************************************************************************
- * Decoder
- ******************************************************************************/
+int mn_wrap(struct mini **fsap, const void *data, size_t size)
+{
+   bool in_place;
+   return load_mem(fsap, data, size, false, &in_place);
+}
 
-struct mini {
-   const uint32_t *counts;
-   uint32_t nr;               /* Number of transitions. */
-   uint32_t transitions[];
+int mn_load_mmap(struct mini **fsap, FILE *fp)
+{
+   struct stat st;
+   const off_t pos = ftello(fp);
+   if (pos < 0 || fstat(fileno(fp), &st) || !S_ISREG(st.st_mode) || st.st_size <= pos ||
+       (uintmax_t)st.st_size > SIZE_MAX)
+      return mn_load_file(fsap, fp);
+
+   const size_t size = st.st_size;
+   void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+   if (map == MAP_FAILED)
+      return mn_load_file(fsap, fp);
+
+   bool in_place;
+   int ret = load_mem(fsap, (const uint8_t *)map + pos, size - pos, true, &in_place);
+   if (in_place) {
+      (*fsap)->map = map;
+      (*fsap)->map_size = size;
+   } else {
+      munmap(map, size);
+   }
+   return ret;
+}
+
+int mn_save_native(const struct mini *fsa,
+                   int (*write)(void *arg, const void *data, size_t size),
+                   void *arg)
+{
+   const struct mini_header hdr = {
+      .version = mn_version,
+      .type = fsa->type,
+      .format = fsa->format,
+      .counts = fsa->count_format,
+      .width = fsa->width,
+      .nr = fsa->nr,
+      .has_words = true,
+      .words = fsa->words,
+      .large = fsa->large,
+      .native = true,
+      .little = fsa->format == MN_FORMAT_FIXED && host_little(),
+   };
+   uint32_t header[MN_HEADER_SIZE / sizeof(uint32_t)];
+   encode_header(&hdr, header);
+   if (write(arg, header, sizeof header) || write(arg, fsa->transitions, fsa->size))
+      return MN_EIO;
+   return MN_OK;
+}
+
+/* Tells whether a transition starts at a given position. "starts" is the
+ * bitmap of the positions of the transitions of a compact automaton, and NULL
+ * for other formats.
+ */
+static bool is_trans(const struct mini *fsa, const uint64_t *starts, uint64_t pos)
+{
+   return pos < fsa->nr && (!starts || starts[pos / 64] >> pos % 64 & 1);
+}
+
+/* Marks the transitions mn_verify() is visiting. */
+#define MN_VISITING UINT16_MAX
+
+static uint64_t add_words(uint64_t a, uint64_t b)
+{
+   return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+}
+
+/* Transitions are visited depth-first. For each one, we record the number of
+ * words recognized from it and the transitions that follow it in its state,
+ * and the length of the longest of them, so that states that start in the
+ * middle of others are verified only once, and a cycle is found as soon as a
+ * transition leads back to one that is being visited.
+ */
+int mn_verify(const struct mini *fsa)
+{
+   const uint64_t blocks = (fsa->nr + 63) / 64;
+   if (fsa->count_format == MN_COUNTS_NARROW && !check_narrow_counts(fsa, blocks, fsa->large))
+      return MN_ECORRUPT;
+
+   uint16_t *heights = calloc(fsa->nr, sizeof *heights);
+   uint64_t *words = malloc(fsa->nr * sizeof *words);
+   uint64_t *stack = malloc(fsa->nr * sizeof *stack);
+   uint64_t *starts = fsa->format == MN_FORMAT_COMPACT ? calloc(blocks, sizeof *starts) : NULL;
+   int ret = MN_E2BIG;
+   if (!heights || !words || !stack || (fsa->format == MN_FORMAT_COMPACT && !starts))
+      goto fini;
+
+   /* Compact transitions must follow each other up to the end of the array. */
+   ret = MN_ECORRUPT;
+   const uint8_t *bytes = fsa->transitions;
+   for (uint64_t pos = 0; starts && pos < fsa->nr; pos += compact_size(fsa, bytes[pos + 1])) {
+      if (fsa->nr - pos < 2 || COMPACT_DEST_LEN(bytes[pos + 1]) > 6 ||
+          compact_size(fsa, bytes[pos + 1]) > fsa->nr - pos)
+         goto fini;
+      starts[pos / 64] |= UINT64_C(1) << pos % 64;
+   }
+
+   const bool numbered = fsa->type == MN_NUMBERED;
+   const uint64_t root_trans = get_trans(fsa, 0);
+   const uint64_t root = GET_DEST(root_trans);
+   if (IS_TERMINAL(root_trans))
+      goto fini;
+   size_t depth = 0;
+   if (root) {
+      if (!is_trans(fsa, starts, root))
+         goto fini;
+      heights[root] = MN_VISITING;
+      stack[depth++] = root;
+   }
+   while (depth) {
+      const uint64_t pos = stack[depth - 1];
+      const uint64_t trans = get_trans(fsa, pos);
+      const uint64_t dest = GET_DEST(trans);
+      const uint64_t next = IS_LAST(trans) ? 0 : next_trans(fsa, pos);
+      /* Iterators stop at terminal transitions, so transitions that lead to
+       * no state must be terminal.
+       */
+      if ((dest && !is_trans(fsa, starts, dest)) || (next && !is_trans(fsa, starts, next)) ||
+          (!dest && !IS_TERMINAL(trans)))
+         goto fini;
+      if ((dest && heights[dest] == MN_VISITING) || (next && heights[next] == MN_VISITING))
+         goto fini;
+      if (dest && !heights[dest]) {
+         heights[dest] = MN_VISITING;
+         stack[depth++] = dest;
+         continue;
+      }
+      if (next && !heights[next]) {
+         heights[next] = MN_VISITING;
+         stack[depth++] = next;
+         continue;
+      }
+
+      /* Labels must be sorted, and words not too long. */
+      if (next && GET_CHAR(trans) >= GET_CHAR(get_trans(fsa, next)))
+         goto fini;
+      unsigned height = 1 + (dest ? heights[dest] : 0);
+      if (next && heights[next] > height)
+         height = heights[next];
+      if (height > MN_MAX_WORD_LEN)
+         goto fini;
+      const uint64_t count = add_words(!!IS_TERMINAL(trans), dest ? words[dest] : 0);
+      if (numbered && get_count(fsa, pos) != count)
+         goto fini;
+      words[pos] = next ? add_words(count, words[next]) : count;
+      heights[pos] = height;
+      depth--;
+   }
+
+   const uint64_t total = root ? words[root] : 0;
+   if (fsa->words != total)
+      goto fini;
+   if (numbered && get_count(fsa, 0) != total)
+      goto fini;
+   ret = MN_OK;
+
+fini:
+   free(heights);
+   free(words);
+   free(stack);
+   free(starts);
+   return ret;
+}
+
+/* Buffer an automaton is written to by mn_publish(). */
+struct mini_shm {
+   uint8_t *data;
+   size_t size;
+   size_t pos;
+   uint32_t magic;            /* Magic identifier, written last. */
 };
 
-int mn_load(struct mini **fsap,
-            int (*read)(void *arg, void *buf, size_t size),
-            void *arg)
+/* The magic identifier is kept apart, and left zeroed in the buffer. */
+static int shm_write(void *arg, const void *data, size_t size)
+{
+   struct mini_shm *shm = arg;
+   if (size > shm->size - shm->pos)
+      return -1;
+   size_t skip = 0;
+   if (shm->pos < sizeof shm->magic) {
+      skip = sizeof shm->magic - shm->pos;
+      if (skip > size)
+         skip = size;
+      memcpy((uint8_t *)&shm->magic + shm->pos, data, skip);
+   }
+   memcpy(&shm->data[shm->pos + skip], (const uint8_t *)data + skip, size - skip);
+   shm->pos += size;
+   return 0;
+}
+
+int mn_publish(const struct mini *fsa, const char *name)
+{
+   const size_t size = MN_HEADER_SIZE + fsa->size;
+
+   /* Processes attached to a previous segment keep using it. */
+   shm_unlink(name);
+   int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+   if (fd < 0)
+      return MN_EIO;
+   uint8_t *map = MAP_FAILED;
+   if (!ftruncate(fd, size))
+      map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      shm_unlink(name);
+      return MN_EIO;
+   }
+
+   /* The magic identifier is written last, once the rest of the automaton
+    * is visible, so that processes attaching meanwhile fail with MN_EMAGIC
+    * instead of reading a partial automaton.
+    */
+   struct mini_shm shm = {.data = map, .size = size};
+   int ret = mn_save_native(fsa, shm_write, &shm);
+   if (!ret) {
+      atomic_thread_fence(memory_order_release);
+      *(volatile uint32_t *)map = shm.magic;
+   }
+   munmap(map, size);
+   if (ret)
+      shm_unlink(name);
+   return ret;
+}
+
+int mn_attach(struct mini **fsap, const char *name)
 {
    *fsap = NULL;
 
-   uint32_t header[3];
-   if (read(arg, header, sizeof header))
+   int fd = shm_open(name, O_RDONLY, 0);
+   if (fd < 0)
+      return MN_EIO;
+   struct stat st;
+   void *map = MAP_FAILED;
+   if (!fstat(fd, &st) && st.st_size > 0 && (uintmax_t)st.st_size <= SIZE_MAX)
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
       return MN_EIO;
-   for (size_t i = 0; i < sizeof header / sizeof *header; i++)
-      header[i] = ntohl(header[i]);
 
-   if (header[0] != mn_magic)
-      return MN_EMAGIC;
-   if (header[1] != mn_version)
-      return MN_EVERSION;
+   const size_t size = st.st_size;
+   int ret = MN_EMAGIC;
+   if (*(const volatile uint32_t *)map == htonl(mn_magic)) {
+      atomic_thread_fence(memory_order_acquire);
+      ret = mn_wrap(fsap, map, size);
+   }
+   if (ret) {
+      munmap(map, size);
+      return ret;
+   }
+   (*fsap)->map = map;
+   (*fsap)->map_size = size;
+   return MN_OK;
+}
 
-   uint32_t nr = header[2] >> 8;
-   if (nr < 1 || nr >= MN_MAX_SIZE)
-      return MN_ECORRUPT;
+int mn_unpublish(const char *name)
+{
+   return shm_unlink(name) ? MN_EIO : MN_OK;
+}
 
-   int type = header[2] & 0xff;
-   size_t to_read;
-   if (type == MN_STANDARD)
-      to_read = sizeof(uint32_t[nr]);
-   else if (type == MN_NUMBERED)
-      to_read = sizeof(uint32_t[2][nr]);
-   else
-      return MN_ECORRUPT;
+/* Size of the huge pages mn_advise() aligns automata on. This is the size of
+ * transparent huge pages on x86-64, and on arm64 with 4 KB pages.
+ */
+#define MN_HUGE_PAGE_SIZE ((size_t)2 << 20)
 
-   struct mini *fsa = malloc(offsetof(struct mini, transitions) + to_read);
-   if (read(arg, fsa->transitions, to_read)) {
-      free(fsa);
-      return MN_EIO;
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+/* Allocates "size" bytes backed by huge pages, if possible. Returns NULL on
+ * failure, or the address of the mapping, whose size is stored in "len".
+ */
+static void *alloc_huge(size_t size, size_t *len)
+{
+   *len = (size + MN_HUGE_PAGE_SIZE - 1) & ~(MN_HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+   /* This only succeeds if huge pages are reserved. */
+   void *map = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                    -1, 0);
+   if (map != MAP_FAILED)
+      return map;
+#endif
+   /* Otherwise, the kernel can only use transparent huge pages for aligned
+    * ranges, so we map more than we need and unmap both ends.
+    */
+   uint8_t *area = mmap(NULL, *len + MN_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (area == MAP_FAILED)
+      return NULL;
+   const size_t head = -(uintptr_t)area & (MN_HUGE_PAGE_SIZE - 1);
+   if (head)
+      munmap(area, head);
+   if (MN_HUGE_PAGE_SIZE - head)
+      munmap(&area[head + *len], MN_HUGE_PAGE_SIZE - head);
+   madvise(&area[head], *len, MADV_HUGEPAGE);
+   return &area[head];
+}
+
+/* Moves the arrays of an automaton to "map". */
+static void move_fsa(struct mini *fsa, uint8_t *map)
+{
+   const uint8_t *old = fsa->transitions;
+   memcpy(map, old, fsa->size);
+#define MN_REBASE(p) if (p) p = (const void *)&map[(const uint8_t *)(p) - old]
+   MN_REBASE(fsa->counts);
+   MN_REBASE(fsa->narrow_counts);
+   MN_REBASE(fsa->large_bits);
+   MN_REBASE(fsa->large_ranks);
+   MN_REBASE(fsa->large_counts);
+   MN_REBASE(fsa->packed_counts);
+#undef MN_REBASE
+   fsa->transitions = map;
+}
+#endif
+
+/* Moves a copied automaton to huge pages, or marks its mapping. The pages of
+ * a moved automaton are unlocked.
+ */
+static void advise_huge_pages(struct mini *fsa)
+{
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+   if (fsa->buf && fsa->size >= MN_HUGE_PAGE_SIZE) {
+      size_t len;
+      uint8_t *map = alloc_huge(fsa->size, &len);
+      if (!map)
+         return;
+      if (fsa->locked) {
+         munlock(fsa->transitions, fsa->size);
+         fsa->locked = false;
+      }
+      move_fsa(fsa, map);
+      mprotect(map, len, PROT_READ);
+      free(fsa->buf);
+      fsa->buf = NULL;
+      fsa->map = map;
+      fsa->map_size = len;
+   } else if (fsa->map) {
+      madvise(fsa->map, fsa->map_size, MADV_HUGEPAGE);
    }
+#else
+   (void)fsa;
+#endif
+}
+
+/* Reads a byte of every page of an automaton. */
+static void prefault(const struct mini *fsa)
+{
+   if (fsa->map)
+      posix_madvise(fsa->map, fsa->map_size, POSIX_MADV_WILLNEED);
+
+   const long page = sysconf(_SC_PAGESIZE);
+   const size_t step = page > 0 ? (size_t)page : 4096;
+   const volatile uint8_t *data = fsa->transitions;
+   for (size_t pos = 0; pos < fsa->size; pos += step)
+      (void)data[pos];
+}
 
-   to_read /= sizeof *fsa->transitions;
-   for (size_t i = 0; i < to_read; i++)
-      fsa->transitions[i] = ntohl(fsa->transitions[i]);
+int mn_advise(struct mini *fsa, int flags)
+{
+   const bool locked = fsa->locked;
+   if (flags & MN_ADVISE_HUGE_PAGES)
+      advise_huge_pages(fsa);
+   if (flags & MN_ADVISE_PREFAULT)
+      prefault(fsa);
+   if (((flags & MN_ADVISE_LOCK) || locked) && !fsa->locked && fsa->size) {
+      if (mlock(fsa->transitions, fsa->size))
+         return MN_EIO;
+      fsa->locked = true;
+   }
+   return MN_OK;
+}
 
-   fsa->counts = (type == MN_NUMBERED) ? &fsa->transitions[nr] : NULL;
-   fsa->nr = nr;
-   *fsap = fsa;
+enum mn_type mn_type(const struct mini *fsa)
+{
+   return fsa->type;
+}
+
+enum mn_format mn_format(const struct mini *fsa)
+{
+   return fsa->format;
+}
+
+enum mn_counts mn_counts(const struct mini *fsa)
+{
+   return fsa->count_format;
+}
+
+int mn_native(const struct mini *fsa)
+{
+   return fsa->native;
+}
+
+void mn_free(struct mini *fsa)
+{
+   if (!fsa)
+      return;
+   if (fsa->locked)
+      munlock(fsa->transitions, fsa->size);
+   if (fsa->map)
+      munmap(fsa->map, fsa->map_size);
+   free(fsa->buf);
+   free(fsa->jumps);
+   free(fsa);
+}
+
+/* Jump table of a state: the labels of its transitions, as a bitmap, so that
+ * the rank of a transition in the state is the number of labels before its
+ * own.
+ */
+struct mini_jump {
+   uint64_t labels[4];
+   uint8_t ranks[4];          /* Number of labels in the previous words of
+                               * the bitmap. */
+   uint32_t first;            /* Index of the first entry of the state in
+                               * the arrays below. */
+};
+
+/* Slot of the hash table of the states that have a jump table, keyed by their
+ * position. No state starts at position zero, which marks empty slots.
+ */
+struct mini_jump_slot {
+   uint64_t state;
+   uint32_t jump;
+};
+
+/* Jump tables of an automaton, which are allocated as a single block along
+ * with their arrays.
+ */
+struct mini_jumps {
+   const struct mini_jump_slot *slots;
+   uint64_t mask;             /* Number of slots, minus one. */
+   unsigned shift;            /* 64 minus the base 2 log of the number of
+                               * slots. */
+   const struct mini_jump *jumps;
+   unsigned depth;            /* States with a jump table are all reached
+                               * before this depth. */
+   const uint32_t *before;    /* Sum of the counts of the transitions that
+                               * precede each transition in its state, and of
+                               * all of them at the end of each state. Only
+                               * for numbered automata. */
+   const uint16_t *offsets;   /* Offset of each transition from the start of
+                               * its state, in bytes. Only for compact
+                               * automata; the others have transitions of a
+                               * fixed size. */
+};
+
+/* Fibonacci hashing constant, 2^64 divided by the golden ratio. */
+#define MN_JUMP_HASH UINT64_C(0x9e3779b97f4a7c15)
+
+/* Returns the jump table of the state at a given position, or NULL if it has
+ * none.
+ */
+static inline const struct mini_jump *find_jump(const struct mini_jumps *jt, uint64_t state)
+{
+   for (uint64_t i = state * MN_JUMP_HASH >> jt->shift;; i = (i + 1) & jt->mask) {
+      if (jt->slots[i].state == state)
+         return &jt->jumps[jt->slots[i].jump];
+      if (!jt->slots[i].state)
+         return NULL;
+   }
+}
+
+static inline unsigned jump_fanout(const struct mini_jump *jump)
+{
+   return jump->ranks[3] + popcount64(jump->labels[3]);
+}
+
+/* Returns the position of the transition of a given rank in a state. */
+static inline uint64_t jump_pos(const struct mini_jumps *jt, const struct mini_jump *jump,
+                                uint64_t state, unsigned rank)
+{
+   return state + (jt->offsets ? jt->offsets[jump->first + rank] : rank);
+}
+
+/* Finds the first transition of the state at "state", reached after "depth"
+ * transitions, whose label is not less than "c", with the jump table of the
+ * state. Returns -1 if the state has no jump table, in which case its
+ * transitions must be scanned; tables are only looked for at the depths
+ * where there are some, so that lookups don't pay for them in the deeper,
+ * smaller states. Otherwise, returns the label of the transition, or a value
+ * larger than any label if there is none, stores its position in "pos", and
+ * adds the counts of the transitions before it, or of all of them, to
+ * "index", unless it is NULL.
+ */
+static inline int jump_next(const struct mini *fsa, size_t depth, uint64_t state, uint8_t c,
+                            uint64_t *pos, uint32_t *index)
+{
+   const struct mini_jumps *jt = fsa->jumps;
+   const struct mini_jump *jump;
+   if (!jt || depth >= jt->depth || !(jump = find_jump(jt, state)))
+      return -1;
+
+   unsigned word = c / 64;
+   uint64_t bits = jump->labels[word] & UINT64_MAX << c % 64;
+   while (!bits && ++word < 4)
+      bits = jump->labels[word];
+   if (!bits) {
+      if (index)
+         *index += jt->before[jump->first + jump_fanout(jump)];
+      return UINT8_MAX + 1;
+   }
+   const unsigned label = word * 64 + ctz64(bits);
+   const unsigned rank = jump->ranks[word] +
+                         popcount64(jump->labels[word] & ((UINT64_C(1) << label % 64) - 1));
+   *pos = jump_pos(jt, jump, state, rank);
+   if (index)
+      *index += jt->before[jump->first + rank];
+   return (int)label;
+}
+
+/* Finds the transition of the state at "state", reached after "depth"
+ * transitions, that leads to the word of ordinal "index" among the words
+ * reachable from the state, with the jump table of the state, in a numbered
+ * automaton. Returns false if the state has no jump table. Otherwise, stores
+ * its position in "pos", and subtracts the counts of the transitions before
+ * it from "index".
+ */
+static inline bool jump_count(const struct mini *fsa, size_t depth, uint64_t state,
+                              uint32_t *index, uint64_t *pos)
+{
+   const struct mini_jumps *jt = fsa->jumps;
+   const struct mini_jump *jump;
+   if (!jt || depth >= jt->depth || !(jump = find_jump(jt, state)))
+      return false;
+
+   /* Counts are positive, so the sums are increasing, and the first one is
+    * zero. This is a binary search without branches, which would mostly be
+    * mispredicted.
+    */
+   const uint32_t *before = &jt->before[jump->first];
+   const uint32_t *base = before;
+   for (unsigned nr = jump_fanout(jump); nr > 1; nr -= nr / 2)
+      base = base[nr / 2] < *index ? &base[nr / 2] : base;
+   *index -= *base;
+   *pos = jump_pos(jt, jump, state, (unsigned)(base - before));
+   return true;
+}
+
+/* A state with a jump table, before they are built. */
+struct mini_jump_state {
+   uint64_t state;
+   unsigned fanout;
+   unsigned depth;            /* Smallest depth the state is reached at. */
+};
+
+/* States with more transitions come first, then those nearer to the start
+ * state.
+ */
+static int cmp_jump_states(const void *a, const void *b)
+{
+   const struct mini_jump_state *s1 = a, *s2 = b;
+   if (s1->fanout != s2->fanout)
+      return s1->fanout > s2->fanout ? -1 : 1;
+   if (s1->depth != s2->depth)
+      return s1->depth < s2->depth ? -1 : 1;
+   return (s1->state > s2->state) - (s1->state < s2->state);
+}
+
+/* Returns the size of the jump tables of "nr" states having "entries"
+ * transitions in total, and the number of slots of their hash table.
+ */
+static size_t jumps_size(const struct mini *fsa, uint64_t nr, uint64_t entries,
+                         uint64_t *slots)
+{
+   *slots = 2;
+   while (*slots < 2 * nr)
+      *slots *= 2;
+   /* Each state has one more entry, for the sum of all its counts. */
+   entries += nr;
+   return sizeof(struct mini_jumps) + *slots * sizeof(struct mini_jump_slot) +
+          nr * sizeof(struct mini_jump) +
+          (fsa->type == MN_NUMBERED ? entries * sizeof(uint32_t) : 0) +
+          (fsa->format == MN_FORMAT_COMPACT ? entries * sizeof(uint16_t) : 0);
+}
+
+/* Appends a state to a growing array. Returns false if there isn't enough
+ * memory.
+ */
+static bool push_jump_state(struct mini_jump_state **states, size_t *nr, size_t *alloc,
+                            struct mini_jump_state state)
+{
+   if (*nr == *alloc) {
+      const size_t size = *alloc ? 2 * *alloc : MN_INIT_SIZE;
+      void *tmp = realloc(*states, size * sizeof **states);
+      if (!tmp)
+         return false;
+      *states = tmp;
+      *alloc = size;
+   }
+   (*states)[(*nr)++] = state;
+   return true;
+}
+
+/* Lists the states that have at least "min_fanout" transitions, level by
+ * level from the start state, as long as they hold at least half of the
+ * transitions of their level. Deeper, lookups would spend more time looking
+ * for tables than they would save. States are listed at the smallest depth
+ * they can be reached at. Returns NULL if there isn't enough memory.
+ */
+static struct mini_jump_state *list_jump_states(const struct mini *fsa, unsigned min_fanout,
+                                                size_t *nr)
+{
+   uint64_t *seen = calloc(fsa->nr / 64 + 1, sizeof *seen);
+   struct mini_jump_state *level = NULL, *states = NULL;
+   size_t level_nr = 0, level_alloc = 0, alloc = 0;
+   *nr = 0;
+   if (!seen)
+      return NULL;
+
+   const uint64_t root = GET_DEST(get_trans(fsa, 0));
+   bool ok = !root || push_jump_state(&level, &level_nr, &level_alloc,
+                                      (struct mini_jump_state){root, 0, 0});
+   for (unsigned depth = 0; ok && level_nr && depth < MN_MAX_WORD_LEN; depth++) {
+      /* States of the next level are appended to those of the current one. */
+      const size_t end = level_nr, start = *nr;
+      uint64_t level_trans = 0, kept_trans = 0;
+      for (size_t i = 0; ok && i < end; i++) {
+         uint64_t pos = level[i].state;
+         unsigned fanout = 0;
+         bool last = false;
+         /* There are more transitions than labels in corrupted automata. */
+         while (ok && !last && fanout <= UINT8_MAX && pos < fsa->nr) {
+            const uint64_t trans = get_trans(fsa, pos);
+            const uint64_t dest = GET_DEST(trans);
+            if (dest && dest < fsa->nr && !(seen[dest / 64] >> dest % 64 & 1)) {
+               seen[dest / 64] |= UINT64_C(1) << dest % 64;
+               ok = push_jump_state(&level, &level_nr, &level_alloc,
+                                    (struct mini_jump_state){dest, 0, depth + 1});
+            }
+            fanout++;
+            last = IS_LAST(trans);
+            pos = next_trans(fsa, pos);
+         }
+         level_trans += fanout;
+         if (ok && last && fanout >= min_fanout) {
+            level[i].fanout = fanout;
+            ok = push_jump_state(&states, nr, &alloc, level[i]);
+            kept_trans += fanout;
+         }
+      }
+      if (2 * kept_trans < level_trans) {
+         *nr = start;
+         break;
+      }
+      level_nr -= end;
+      memmove(level, &level[end], level_nr * sizeof *level);
+   }
+   free(seen);
+   free(level);
+   if (ok && !states)
+      ok = (states = malloc(sizeof *states)) != NULL;
+   if (!ok) {
+      free(states);
+      return NULL;
+   }
+   return states;
+}
+
+/* Fills the jump table of a state. Returns false if its transitions are not
+ * sorted, which only happens in corrupted automata.
+ */
+static bool fill_jump(const struct mini *fsa, struct mini_jump *jump, uint64_t state,
+                      uint32_t *before, uint16_t *offsets)
+{
+   memset(jump->labels, 0, sizeof jump->labels);
+   uint64_t pos = state;
+   uint32_t sum = 0;
+   int prev = -1;
+   for (unsigned rank = 0;; rank++) {
+      const uint64_t trans = get_trans(fsa, pos);
+      const uint8_t c = GET_CHAR(trans);
+      if (c <= prev || pos - state > UINT16_MAX)
+         return false;
+      prev = c;
+      jump->labels[c / 64] |= UINT64_C(1) << c % 64;
+      if (offsets)
+         offsets[rank] = (uint16_t)(pos - state);
+      if (before) {
+         before[rank] = sum;
+         sum += get_count(fsa, pos);
+      }
+      if (IS_LAST(trans)) {
+         if (before)
+            before[rank + 1] = sum;
+         break;
+      }
+      pos = next_trans(fsa, pos);
+   }
+   jump->ranks[0] = 0;
+   for (unsigned i = 1; i < 4; i++)
+      jump->ranks[i] = (uint8_t)(jump->ranks[i - 1] + popcount64(jump->labels[i - 1]));
+   return true;
+}
+
+int mn_accelerate(struct mini *fsa, unsigned min_fanout, size_t max_memory)
+{
+   free(fsa->jumps);
+   fsa->jumps = NULL;
+   if (!max_memory)
+      return MN_OK;
+   if (!min_fanout)
+      min_fanout = 1;
+
+   size_t nr;
+   struct mini_jump_state *states = list_jump_states(fsa, min_fanout, &nr);
+   if (!states)
+      return MN_E2BIG;
+   qsort(states, nr, sizeof *states, cmp_jump_states);
+
+   /* Keep as many states as the budget allows, those with the most
+    * transitions first.
+    */
+   uint64_t kept = 0, entries = 0, slots;
+   while (kept < nr && kept < UINT32_MAX &&
+          jumps_size(fsa, kept + 1, entries + states[kept].fanout, &slots) <= max_memory)
+      entries += states[kept++].fanout;
+   if (!kept) {
+      free(states);
+      return MN_OK;
+   }
+
+   const size_t size = jumps_size(fsa, kept, entries, &slots);
+   struct mini_jumps *jt = malloc(size);
+   if (!jt) {
+      free(states);
+      return MN_E2BIG;
+   }
+   struct mini_jump_slot *table = (struct mini_jump_slot *)(jt + 1);
+   struct mini_jump *jumps = (struct mini_jump *)(table + slots);
+   uint32_t *before = fsa->type == MN_NUMBERED ? (uint32_t *)(jumps + kept) : NULL;
+   uint16_t *offsets = NULL;
+   if (fsa->format == MN_FORMAT_COMPACT)
+      offsets = before ? (uint16_t *)(before + entries + kept) : (uint16_t *)(jumps + kept);
+   memset(table, 0, slots * sizeof *table);
+   jt->slots = table;
+   jt->mask = slots - 1;
+   jt->shift = 64 - (unsigned)ctz64(slots);
+   jt->jumps = jumps;
+   jt->before = before;
+   jt->offsets = offsets;
+   jt->depth = 0;
+
+   uint32_t nr_jumps = 0, first = 0;
+   for (uint64_t i = 0; i < kept; i++) {
+      struct mini_jump *jump = &jumps[nr_jumps];
+      if (!fill_jump(fsa, jump, states[i].state, before ? &before[first] : NULL,
+                     offsets ? &offsets[first] : NULL))
+         continue;
+      jump->first = first;
+      first += states[i].fanout + 1;
+      uint64_t slot = states[i].state * MN_JUMP_HASH >> jt->shift;
+      while (table[slot].state)
+         slot = (slot + 1) & jt->mask;
+      table[slot] = (struct mini_jump_slot){states[i].state, nr_jumps++};
+      if (states[i].depth >= jt->depth)
+         jt->depth = states[i].depth + 1;
+   }
+   free(states);
+   fsa->jumps = jt;
    return MN_OK;
 }
 
-static int mn_read(void *fp, void *buf, size_t size)
+/* Only the label and flags of the transitions we skip are decoded. */
+static int contains_compact(const struct mini *fsa, const uint8_t *word, size_t len)
+{
+   const uint8_t *bytes = fsa->transitions;
+   uint64_t trans = get_compact_trans(fsa, 0);
+
+   for (size_t i = 0; i < len; i++) {
+      uint64_t pos = GET_DEST(trans);
+      if (!pos)
+         return 0;
+      const int c = jump_next(fsa, i, pos, word[i], &pos, NULL);
+      if (c >= 0) {
+         if (c != word[i])
+            return 0;
+      } else {
+         while (bytes[pos] != word[i]) {
+            if (IS_LAST(bytes[pos + 1]))
+               return 0;
+            pos += compact_size(fsa, bytes[pos + 1]);
+         }
+      }
+      trans = get_compact_trans(fsa, pos);
+   }
+   return IS_TERMINAL(trans) != 0;
+}
+
+static int contains_packed(const struct mini *fsa, const uint8_t *word, size_t len)
+{
+   uint64_t trans = get_packed_trans(fsa, 0);
+
+   for (size_t i = 0; i < len; i++) {
+      uint64_t pos = GET_DEST(trans);
+      if (!pos)
+         return 0;
+      const int c = jump_next(fsa, i, pos, word[i], &pos, NULL);
+      if (c >= 0) {
+         if (c != word[i])
+            return 0;
+         trans = get_packed_trans(fsa, pos);
+         continue;
+      }
+      while (GET_CHAR(trans = get_packed_trans(fsa, pos)) != word[i]) {
+         if (IS_LAST(trans))
+            return 0;
+         pos++;
+      }
+   }
+   return IS_TERMINAL(trans) != 0;
+}
+
+static int contains_interleaved(const struct mini *fsa, const uint8_t *word, size_t len)
 {
-   if (fread(buf, 1, size, fp) == size)
-      return 0;
-   return -1;
+   uint64_t trans = get_interleaved_trans(fsa, 0);
+
+   for (size_t i = 0; i < len; i++) {
+      uint64_t pos = GET_DEST(trans);
+      if (!pos)
+         return 0;
+      const int c = jump_next(fsa, i, pos, word[i], &pos, NULL);
+      if (c >= 0) {
+         if (c != word[i])
+            return 0;
+         trans = get_interleaved_trans(fsa, pos);
+         continue;
+      }
+      while (GET_CHAR(trans = get_interleaved_trans(fsa, pos)) != word[i]) {
+         if (IS_LAST(trans))
+            return 0;
+         pos++;
+      }
+   }
+   return IS_TERMINAL(trans) != 0;
 }
 
-int mn_load_file(struct mini **fsa, FILE *fp)
+int mn_contains(const struct mini *fsa, const void *word, size_t len)
 {
-   return mn_load(fsa, mn_read, fp);
+   uint64_t pos = 0;
+
+   if (fsa->format == MN_FORMAT_COMPACT)
+      return contains_compact(fsa, word, len);
+   if (fsa->format == MN_FORMAT_PACKED)
+      return contains_packed(fsa, word, len);
+   if (fsa->count_format == MN_COUNTS_INTERLEAVED)
+      return contains_interleaved(fsa, word, len);
+
+   for (size_t i = 0; i < len; i++) {
+      const uint8_t chr = ((const uint8_t *)word)[i];
+      pos = GET_DEST(get_fixed_trans(fsa, pos));
+      if (!pos)
+         return 0;
+      const int c = jump_next(fsa, i, pos, chr, &pos, NULL);
+      if (c >= 0) {
+         if (c != chr)
+            return 0;
+         continue;
+      }
+      while (GET_CHAR(get_fixed_trans(fsa, pos)) != chr) {
+         if (IS_LAST(get_fixed_trans(fsa, pos++)))
+            return 0;
+      }
+   }
+   return IS_TERMINAL(get_fixed_trans(fsa, pos)) != 0;
 }
 
-enum mn_type mn_type(const struct mini *fsa)
+uint32_t mn_size(const struct mini *fsa)
 {
-   return fsa->counts ? MN_NUMBERED : MN_STANDARD;
+   return fsa->words < UINT32_MAX ? fsa->words : UINT32_MAX;
 }
 
-void mn_free(struct mini *fsa)
+static uint32_t locate_compact(const struct mini *fsa, const uint8_t *word, size_t len)
 {
-   free(fsa);
+   const uint8_t *bytes = fsa->transitions;
+   uint64_t trans = get_compact_trans(fsa, 0);
+   uint32_t index = 0;
+
+   for (size_t i = 0; i < len; i++) {
+      uint64_t pos = GET_DEST(trans);
+      if (!pos)
+         return 0;
+      const int c = jump_next(fsa, i, pos, word[i], &pos, &index);
+      if (c >= 0) {
+         if (c != word[i])
+            return 0;
+      } else {
+         while (bytes[pos] != word[i]) {
+            if (IS_LAST(bytes[pos + 1]))
+               return 0;
+            index += get_count(fsa, pos);
+            pos += compact_size(fsa, bytes[pos + 1]);
+         }
+      }
+      trans = get_compact_trans(fsa, pos);
+      if (IS_TERMINAL(trans))
+         index++;
+   }
+   return IS_TERMINAL(trans) ? index : 0;
 }
 
-int mn_contains(const struct mini *fsa, const void *word, size_t len)
+static uint32_t locate_packed(const struct mini *fsa, const uint8_t *word, size_t len)
 {
-   const uint32_t *transitions = fsa->transitions;
-   uint32_t pos = 0;
+   uint64_t trans = get_packed_trans(fsa, 0);
+   uint32_t index = 0;
 
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(transitions[pos]);
+      uint64_t pos = GET_DEST(trans);
       if (!pos)
          return 0;
-      while (GET_CHAR(transitions[pos]) != ((const uint8_t *)word)[i]) {
-         if (IS_LAST(transitions[pos++]))
+      const int c = jump_next(fsa, i, pos, word[i], &pos, &index);
+      if (c >= 0) {
+         if (c != word[i])
             return 0;
+         trans = get_packed_trans(fsa, pos);
+      } else {
+         while (GET_CHAR(trans = get_packed_trans(fsa, pos)) != word[i]) {
+            if (IS_LAST(trans))
+               return 0;
+            index += get_packed_count(fsa, pos++);
+         }
       }
+      if (IS_TERMINAL(trans))
+         index++;
    }
-   return IS_TERMINAL(transitions[pos]);
+   return IS_TERMINAL(trans) ? index : 0;
 }
 
-static uint32_t count_words(const uint32_t *transitions, uint32_t pos)
+static uint32_t locate_narrow(const struct mini *fsa, const uint8_t *word, size_t len)
 {
-   uint32_t count = 0;
-
-   if (!pos)
-      return 0;
-   do {
-      if (IS_TERMINAL(transitions[pos]))
-         count++;
-      count += count_words(transitions, GET_DEST(transitions[pos]));
-   } while (!IS_LAST(transitions[pos++]));
+   uint64_t pos = 0;
+   uint32_t index = 0;
 
-   return count;
+   for (size_t i = 0; i < len; i++) {
+      pos = GET_DEST(get_fixed_trans(fsa, pos));
+      if (!pos)
+         return 0;
+      const int c = jump_next(fsa, i, pos, word[i], &pos, &index);
+      if (c >= 0) {
+         if (c != word[i])
+            return 0;
+      } else {
+         while (GET_CHAR(get_fixed_trans(fsa, pos)) != word[i]) {
+            if (IS_LAST(get_fixed_trans(fsa, pos)))
+               return 0;
+            index += get_narrow_count(fsa, pos++);
+         }
+      }
+      if (IS_TERMINAL(get_fixed_trans(fsa, pos)))
+         index++;
+   }
+   return IS_TERMINAL(get_fixed_trans(fsa, pos)) ? index : 0;
 }
 
-uint32_t mn_size(const struct mini *fsa)
+static uint32_t locate_interleaved(const struct mini *fsa, const uint8_t *word, size_t len)
 {
-   if (fsa->counts)
-      return fsa->counts[0];
-   return count_words(fsa->transitions, GET_DEST(fsa->transitions[0]));
+   uint64_t trans = get_interleaved_trans(fsa, 0);
+   uint32_t index = 0;
+
+   for (size_t i = 0; i < len; i++) {
+      uint64_t pos = GET_DEST(trans);
+      if (!pos)
+         return 0;
+      const int c = jump_next(fsa, i, pos, word[i], &pos, &index);
+      if (c >= 0) {
+         if (c != word[i])
+            return 0;
+         trans = get_interleaved_trans(fsa, pos);
+      } else {
+         while (GET_CHAR(trans = get_interleaved_trans(fsa, pos)) != word[i]) {
+            if (IS_LAST(trans))
+               return 0;
+            index += get_interleaved_count(fsa, pos++);
+         }
+      }
+      if (IS_TERMINAL(trans))
+         index++;
+   }
+   return IS_TERMINAL(trans) ? index : 0;
 }
 
 uint32_t mn_locate(const struct mini *fsa, const void *word, size_t len)
 {
-   const uint32_t *transitions = fsa->transitions;
    const uint32_t *counts = fsa->counts;
-   uint32_t pos = 0;
+   uint64_t pos = 0;
    uint32_t index = 0;
 
-   if (!counts)
+   if (fsa->type != MN_NUMBERED)
       return 0;
+   if (fsa->format == MN_FORMAT_COMPACT)
+      return locate_compact(fsa, word, len);
+   if (fsa->format == MN_FORMAT_PACKED)
+      return locate_packed(fsa, word, len);
+   if (fsa->count_format == MN_COUNTS_INTERLEAVED)
+      return locate_interleaved(fsa, word, len);
+   if (!counts)
+      return locate_narrow(fsa, word, len);
 
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(transitions[pos]);
+      const uint8_t chr = ((const uint8_t *)word)[i];
+      pos = GET_DEST(get_fixed_trans(fsa, pos));
       if (!pos)
          return 0;
-      while (GET_CHAR(transitions[pos]) != ((const uint8_t *)word)[i]) {
-         if (IS_LAST(transitions[pos]))
+      const int c = jump_next(fsa, i, pos, chr, &pos, &index);
+      if (c >= 0) {
+         if (c != chr)
             return 0;
-         index += counts[pos++];
+      } else {
+         while (GET_CHAR(get_fixed_trans(fsa, pos)) != chr) {
+            if (IS_LAST(get_fixed_trans(fsa, pos)))
+               return 0;
+            index += counts[pos++];
+         }
       }
-      if (IS_TERMINAL(transitions[pos]))
+      if (IS_TERMINAL(get_fixed_trans(fsa, pos)))
          index++;
    }
-   return IS_TERMINAL(transitions[pos]) ? index : 0;
+   return IS_TERMINAL(get_fixed_trans(fsa, pos)) ? index : 0;
 }
 
 size_t mn_extract(const struct mini *fsa, uint32_t index, void *buf)
 {
-   const uint32_t *transitions = fsa->transitions;
-   const uint32_t *counts = fsa->counts;
-   uint32_t pos = 0;
+   uint64_t pos = 0;
    size_t len = 0;
 
-   if (!index || !counts || counts[0] < index) {
+   if (!index || fsa->type != MN_NUMBERED || get_count(fsa, 0) < index) {
       ((uint8_t *)buf)[0] = '\0';
       return 0;
    }
 
    do {
-      pos = GET_DEST(transitions[pos]);
-      for (;;) {
-         uint32_t cnt = counts[pos];
-         if (index > cnt) {
+      pos = GET_DEST(get_trans(fsa, pos));
+      if (!jump_count(fsa, len, pos, &index, &pos)) {
+         uint32_t cnt;
+         while (index > (cnt = get_count(fsa, pos))) {
             index -= cnt;
-         } else {
-            ((uint8_t *)buf)[len++] = GET_CHAR(transitions[pos]);
-            if (IS_TERMINAL(transitions[pos]))
-               index--;
-            break;
+            pos = next_trans(fsa, pos);
          }
-         pos++;
       }
+      ((uint8_t *)buf)[len++] = GET_CHAR(get_trans(fsa, pos));
+      if (IS_TERMINAL(get_trans(fsa, pos)))
+         index--;
    } while (index);
 
    ((uint8_t *)buf)[len] = '\0';
@@ -749,15 +5367,20 @@ uint32_t mn_iter_inits_standard(struct mini_iter *it, const struct mini *fsa,
    it->fsa = fsa;
    it->depth = it->root = 0;
 
-   uint32_t pos = 0;
+   uint64_t pos = 0;
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
+      pos = GET_DEST(get_trans(fsa, pos));
       if (!pos)
          goto find_next_word;
-      int c;
-      while ((c = GET_CHAR(fsa->transitions[pos])) < word[i]) {
-         if (IS_LAST(fsa->transitions[pos++]))
-            goto find_next_word;
+      int c = jump_next(fsa, i, pos, word[i], &pos, NULL);
+      if (c > UINT8_MAX)
+         goto find_next_word;
+      if (c < 0) {
+         while ((c = GET_CHAR(get_trans(fsa, pos))) < word[i]) {
+            if (IS_LAST(get_trans(fsa, pos)))
+               goto find_next_word;
+            pos = next_trans(fsa, pos);
+         }
       }
       it->positions[it->depth] = pos;
       it->word[it->depth++] = word[i];
@@ -771,11 +5394,11 @@ uint32_t mn_iter_inits_standard(struct mini_iter *it, const struct mini *fsa,
 find_next_word:
    if (it->depth == 0)
       return init_none(it);
-   while (IS_LAST(fsa->transitions[it->positions[--it->depth]])) {
+   while (IS_LAST(get_trans(fsa, it->positions[--it->depth]))) {
       if (it->depth == 0)
          return init_none(it);
    }
-   it->positions[it->depth]++;
+   it->positions[it->depth] = next_trans(fsa, it->positions[it->depth]);
    return 1;
 }
 
@@ -788,18 +5411,24 @@ uint32_t mn_iter_inits_numbered(struct mini_iter *it, const struct mini *fsa,
    it->fsa = fsa;
    it->depth = it->root = 0;
 
-   uint32_t pos = 0, index = 0;
+   uint64_t pos = 0;
+   uint32_t index = 0;
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
+      pos = GET_DEST(get_trans(fsa, pos));
       if (!pos)
          goto find_next_word;
-      int c;
-      while ((c = GET_CHAR(fsa->transitions[pos])) < word[i]) {
-         index += fsa->counts[pos];
-         if (IS_LAST(fsa->transitions[pos++]))
-            goto find_next_word;
+      int c = jump_next(fsa, i, pos, word[i], &pos, &index);
+      if (c > UINT8_MAX)
+         goto find_next_word;
+      if (c < 0) {
+         while ((c = GET_CHAR(get_trans(fsa, pos))) < word[i]) {
+            index += get_count(fsa, pos);
+            if (IS_LAST(get_trans(fsa, pos)))
+               goto find_next_word;
+            pos = next_trans(fsa, pos);
+         }
       }
-      if (IS_TERMINAL(fsa->transitions[pos]))
+      if (IS_TERMINAL(get_trans(fsa, pos)))
          index++;
       it->positions[it->depth] = pos;
       it->word[it->depth++] = word[i];
@@ -807,7 +5436,7 @@ uint32_t mn_iter_inits_numbered(struct mini_iter *it, const struct mini *fsa,
          break;
    }
 
-   if (!IS_TERMINAL(fsa->transitions[pos]))
+   if (!IS_TERMINAL(get_trans(fsa, pos)))
       index++;
    it->depth--;
    return index;
@@ -816,18 +5445,18 @@ find_next_word:
    if (it->depth == 0)
       return init_none(it);
    index++;
-   while (IS_LAST(fsa->transitions[it->positions[--it->depth]])) {
+   while (IS_LAST(get_trans(fsa, it->positions[--it->depth]))) {
       if (it->depth == 0)
          return init_none(it);
    }
-   it->positions[it->depth]++;
+   it->positions[it->depth] = next_trans(fsa, it->positions[it->depth]);
    return index;
 }
 
 uint32_t mn_iter_inits(struct mini_iter *it, const struct mini *fsa,
                        const void *str, size_t len)
 {
-   return fsa->counts ?
+   return fsa->type == MN_NUMBERED ?
       mn_iter_inits_numbered(it, fsa, str, len) :
       mn_iter_inits_standard(it, fsa, str, len);
 }
@@ -842,14 +5471,21 @@ static uint32_t mn_iter_initp_standard(struct mini_iter *it,
    it->fsa = fsa;
    it->depth = 0;
 
-   uint32_t pos = 0;
+   uint64_t pos = 0;
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
+      pos = GET_DEST(get_trans(fsa, pos));
       if (!pos)
          return init_none(it);
-      while (GET_CHAR(fsa->transitions[pos]) != prefix[i]) {
-         if (IS_LAST(fsa->transitions[pos++]))
+      const int c = jump_next(fsa, i, pos, prefix[i], &pos, NULL);
+      if (c >= 0) {
+         if (c != prefix[i])
             return init_none(it);
+      } else {
+         while (GET_CHAR(get_trans(fsa, pos)) != prefix[i]) {
+            if (IS_LAST(get_trans(fsa, pos)))
+               return init_none(it);
+            pos = next_trans(fsa, pos);
+         }
       }
       it->positions[it->depth] = pos;
       it->word[it->depth++] = prefix[i];
@@ -869,23 +5505,31 @@ static uint32_t mn_iter_initp_numbered(struct mini_iter *it,
    it->fsa = fsa;
    it->depth = 0;
 
-   uint32_t pos = 0, index = 0;
+   uint64_t pos = 0;
+   uint32_t index = 0;
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
+      pos = GET_DEST(get_trans(fsa, pos));
       if (!pos)
          return init_none(it);
-      while (GET_CHAR(fsa->transitions[pos]) != prefix[i]) {
-         if (IS_LAST(fsa->transitions[pos]))
+      const int c = jump_next(fsa, i, pos, prefix[i], &pos, &index);
+      if (c >= 0) {
+         if (c != prefix[i])
             return init_none(it);
-         index += fsa->counts[pos++];
+      } else {
+         while (GET_CHAR(get_trans(fsa, pos)) != prefix[i]) {
+            if (IS_LAST(get_trans(fsa, pos)))
+               return init_none(it);
+            index += get_count(fsa, pos);
+            pos = next_trans(fsa, pos);
+         }
       }
-      if (IS_TERMINAL(fsa->transitions[pos]))
+      if (IS_TERMINAL(get_trans(fsa, pos)))
          index++;
       it->positions[it->depth] = pos;
       it->word[it->depth++] = prefix[i];
    };
 
-   if (!IS_TERMINAL(fsa->transitions[pos]))
+   if (!IS_TERMINAL(get_trans(fsa, pos)))
        index++;
 
    it->root = it->depth--;
@@ -897,7 +5541,7 @@ uint32_t mn_iter_init(struct mini_iter *it, const struct mini *fsa)
    it->fsa = fsa;
    it->depth = it->root = 0;
 
-   uint32_t pos = GET_DEST(fsa->transitions[0]);
+   uint64_t pos = GET_DEST(get_trans(fsa, 0));
    if (!pos)
       return init_none(it);
    it->positions[0] = pos;
@@ -908,7 +5552,7 @@ uint32_t mn_iter_init(struct mini_iter *it, const struct mini *fsa)
 uint32_t mn_iter_initp(struct mini_iter *it, const struct mini *fsa,
                        const void *prefix, size_t len)
 {
-   return fsa->counts ?
+   return fsa->type == MN_NUMBERED ?
       mn_iter_initp_numbered(it, fsa, prefix, len) :
       mn_iter_initp_standard(it, fsa, prefix, len);
 }
@@ -919,25 +5563,24 @@ uint32_t mn_iter_initn(struct mini_iter *it, const struct mini *fsa,
    it->fsa = fsa;
    it->root = it->depth = 0;
 
-   if (!fsa->counts || index == 0 || index > fsa->counts[0])
+   if (fsa->type != MN_NUMBERED || index == 0 || index > get_count(fsa, 0))
       return init_none(it);
 
-   uint32_t pos = 0, index_copy = index;
+   uint64_t pos = 0;
+   uint32_t index_copy = index;
    do {
-      pos = GET_DEST(fsa->transitions[pos]);
-      for (;;) {
-         uint32_t cnt = fsa->counts[pos];
-         if (index > cnt) {
+      pos = GET_DEST(get_trans(fsa, pos));
+      if (!jump_count(fsa, it->depth, pos, &index, &pos)) {
+         uint32_t cnt;
+         while (index > (cnt = get_count(fsa, pos))) {
             index -= cnt;
-         } else {
-            it->word[it->depth] = GET_CHAR(fsa->transitions[pos]);
-            if (IS_TERMINAL(fsa->transitions[pos]))
-               index--;
-            it->positions[it->depth++] = pos;
-            break;
+            pos = next_trans(fsa, pos);
          }
-         pos++;
       }
+      it->word[it->depth] = GET_CHAR(get_trans(fsa, pos));
+      if (IS_TERMINAL(get_trans(fsa, pos)))
+         index--;
+      it->positions[it->depth++] = pos;
    } while (index);
 
    it->depth--;
@@ -946,13 +5589,13 @@ uint32_t mn_iter_initn(struct mini_iter *it, const struct mini *fsa,
 
 const char *mn_iter_next(struct mini_iter *it, size_t *len)
 {
-   const uint32_t *transitions = it->fsa->transitions;
-   uint32_t *positions = it->positions;
+   const struct mini *fsa = it->fsa;
+   uint64_t *positions = it->positions;
    size_t depth = it->depth;
    char *word = it->word;
 
    if (!positions[depth]) {
-      while (IS_LAST(transitions[positions[--depth]]))
+      while (IS_LAST(get_trans(fsa, positions[--depth])))
          if (depth <= it->root)
             goto fini;
       if (depth < it->root) {
@@ -962,12 +5605,12 @@ const char *mn_iter_next(struct mini_iter *it, size_t *len)
             *len = 0;
          return NULL;
       }
-      positions[depth]++;
+      positions[depth] = next_trans(fsa, positions[depth]);
    }
 
-   uint32_t transition;
+   uint64_t transition;
    do {
-      transition = transitions[positions[depth]];
+      transition = get_trans(fsa, positions[depth]);
       word[depth] = GET_CHAR(transition);
       positions[++depth] = GET_DEST(transition);
    } while (!IS_TERMINAL(transition));
@@ -979,6 +5622,424 @@ const char *mn_iter_next(struct mini_iter *it, size_t *len)
 }
 
 
+/*******************************************************************************
+ * Merging
+ ******************************************************************************/
+
+/* Both automata are iterated in parallel, and the smallest of their current
+ * words is added at each step. Words are thus produced in order, without
+ * going through a textual representation.
+ */
+int mn_merge(struct mini_enc *enc, const struct mini *fsa1, const struct mini *fsa2)
+{
+   struct mini_iter it1, it2;
+   mn_iter_init(&it1, fsa1);
+   mn_iter_init(&it2, fsa2);
+
+   size_t len1, len2;
+   const char *word1 = mn_iter_next(&it1, &len1);
+   const char *word2 = mn_iter_next(&it2, &len2);
+   while (word1 || word2) {
+      int cmp = !word1 ? 1 : !word2 ? -1 : lmemcmp(word1, len1, word2, len2);
+      int ret = mn_enc_add(enc, cmp <= 0 ? word1 : word2, cmp <= 0 ? len1 : len2);
+      if (ret)
+         return ret;
+      if (cmp <= 0)
+         word1 = mn_iter_next(&it1, &len1);
+      if (cmp >= 0)
+         word2 = mn_iter_next(&it2, &len2);
+   }
+   return MN_OK;
+}
+
+
+/*******************************************************************************
+ * Overlay
+ ******************************************************************************/
+
+/* Word of a delta set. Words are nul-terminated, so that they can be returned
+ * as is while iterating.
+ */
+struct mini_ov_word {
+   uint16_t len;
+   char data[];
+};
+
+/* Sorted set of words. It is expected to hold a few thousand words at most, so
+ * a sorted array is good enough.
+ */
+struct mini_ov_set {
+   struct mini_ov_word **words;
+   size_t nr;
+   size_t alloc;
+};
+
+/* Changes of a generation: words inserted into the previous generations, and
+ * words removed from them.
+ */
+struct mini_ov_gen {
+   struct mini_ov_set inserts;
+   struct mini_ov_set tombstones;
+};
+
+/* Generations of changes. Changes are made to the live generation. The
+ * snapshot generation holds the changes set apart by mn_overlay_snapshot(),
+ * which compaction reads while new changes are made.
+ */
+enum {
+   MN_OV_SNAPSHOT,
+   MN_OV_LIVE,
+   MN_OV_GENS,
+};
+
+/* The words of the overlay are those of the base automaton, with the changes
+ * of each generation applied in turn: minus its tombstones, plus its inserted
+ * words. Tombstones of a generation are always words of the previous ones, and
+ * its inserted words never are.
+ */
+struct mini_overlay {
+   const struct mini *base;
+   struct mini_ov_gen gens[MN_OV_GENS];
+};
+
+/* Looks up a word in a set. Returns 1 if it is found, 0 otherwise. In both
+ * cases, "pos" is set to the number of words of the set that sort before it.
+ */
+static int set_find(const struct mini_ov_set *set, const void *word, size_t len,
+                    size_t *pos)
+{
+   size_t low = 0, high = set->nr;
+   while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      int cmp = lmemcmp(set->words[mid]->data, set->words[mid]->len, word, len);
+      if (cmp < 0) {
+         low = mid + 1;
+      } else if (cmp > 0) {
+         high = mid;
+      } else {
+         *pos = mid;
+         return 1;
+      }
+   }
+   *pos = low;
+   return 0;
+}
+
+static int set_insert(struct mini_ov_set *set, size_t pos, const void *word, size_t len)
+{
+   if (set->nr == set->alloc) {
+      size_t alloc = set->alloc ? set->alloc * 2 : 16;
+      struct mini_ov_word **words = realloc(set->words, alloc * sizeof *words);
+      if (!words)
+         return MN_E2BIG;
+      set->words = words;
+      set->alloc = alloc;
+   }
+   struct mini_ov_word *ow = malloc(sizeof *ow + len + 1);
+   if (!ow)
+      return MN_E2BIG;
+   ow->len = len;
+   memcpy(ow->data, word, len);
+   ow->data[len] = '\0';
+
+   memmove(&set->words[pos + 1], &set->words[pos], (set->nr - pos) * sizeof *set->words);
+   set->words[pos] = ow;
+   set->nr++;
+   return MN_OK;
+}
+
+static void set_remove(struct mini_ov_set *set, size_t pos)
+{
+   free(set->words[pos]);
+   memmove(&set->words[pos], &set->words[pos + 1], (set->nr - pos - 1) * sizeof *set->words);
+   set->nr--;
+}
+
+static void set_clear(struct mini_ov_set *set)
+{
+   for (size_t i = 0; i < set->nr; i++)
+      free(set->words[i]);
+   free(set->words);
+   *set = (struct mini_ov_set){0};
+}
+
+/* Checks if a word is present once the changes of the generations before
+ * "gen" are applied.
+ */
+static int ov_contains(const struct mini_overlay *ov, size_t gen,
+                       const void *word, size_t len)
+{
+   size_t pos;
+   int found = mn_contains(ov->base, word, len);
+   for (size_t i = 0; i < gen; i++) {
+      const struct mini_ov_gen *g = &ov->gens[i];
+      if (found)
+         found = !g->tombstones.nr || !set_find(&g->tombstones, word, len, &pos);
+      else
+         found = g->inserts.nr && set_find(&g->inserts, word, len, &pos);
+   }
+   return found;
+}
+
+static int ov_insert(struct mini_overlay *ov, size_t gen, const void *word, size_t len)
+{
+   struct mini_ov_gen *g = &ov->gens[gen];
+   size_t pos;
+
+   if (ov_contains(ov, gen, word, len)) {
+      if (set_find(&g->tombstones, word, len, &pos))
+         set_remove(&g->tombstones, pos);
+      return MN_OK;
+   }
+   if (set_find(&g->inserts, word, len, &pos))
+      return MN_OK;
+   return set_insert(&g->inserts, pos, word, len);
+}
+
+static int ov_remove(struct mini_overlay *ov, size_t gen, const void *word, size_t len)
+{
+   struct mini_ov_gen *g = &ov->gens[gen];
+   size_t pos;
+
+   if (ov_contains(ov, gen, word, len)) {
+      if (set_find(&g->tombstones, word, len, &pos))
+         return MN_OK;
+      return set_insert(&g->tombstones, pos, word, len);
+   }
+   if (set_find(&g->inserts, word, len, &pos))
+      set_remove(&g->inserts, pos);
+   return MN_OK;
+}
+
+struct mini_overlay *mn_overlay_new(const struct mini *base)
+{
+   struct mini_overlay *ov = calloc(1, sizeof *ov);
+   if (ov)
+      ov->base = base;
+   return ov;
+}
+
+void mn_overlay_free(struct mini_overlay *ov)
+{
+   if (ov) {
+      for (size_t i = 0; i < MN_OV_GENS; i++) {
+         set_clear(&ov->gens[i].inserts);
+         set_clear(&ov->gens[i].tombstones);
+      }
+      free(ov);
+   }
+}
+
+int mn_overlay_insert(struct mini_overlay *ov, const void *word, size_t len)
+{
+   if (len == 0 || len > MN_MAX_WORD_LEN)
+      return MN_EWORD;
+   return ov_insert(ov, MN_OV_LIVE, word, len);
+}
+
+int mn_overlay_remove(struct mini_overlay *ov, const void *word, size_t len)
+{
+   if (len == 0 || len > MN_MAX_WORD_LEN)
+      return MN_EWORD;
+   return ov_remove(ov, MN_OV_LIVE, word, len);
+}
+
+int mn_overlay_contains(const struct mini_overlay *ov, const void *word, size_t len)
+{
+   return ov_contains(ov, MN_OV_GENS, word, len);
+}
+
+uint32_t mn_overlay_size(const struct mini_overlay *ov)
+{
+   uint64_t nr = ov->base->words;
+   for (size_t i = 0; i < MN_OV_GENS; i++)
+      nr += ov->gens[i].inserts.nr - ov->gens[i].tombstones.nr;
+   return nr < UINT32_MAX ? nr : UINT32_MAX;
+}
+
+size_t mn_overlay_changes(const struct mini_overlay *ov)
+{
+   size_t nr = 0;
+   for (size_t i = 0; i < MN_OV_GENS; i++)
+      nr += ov->gens[i].inserts.nr + ov->gens[i].tombstones.nr;
+   return nr;
+}
+
+uint32_t mn_overlay_locate(const struct mini_overlay *ov, const void *word, size_t len)
+{
+   if (mn_type(ov->base) != MN_NUMBERED)
+      return 0;
+
+   /* Each generation adds the number of words it inserted before the word,
+    * and subtracts the number of words it removed.
+    */
+   uint32_t pos = mn_locate(ov->base, word, len);
+   int found = pos != 0;
+   int64_t shift = 0;
+   for (size_t i = 0; i < MN_OV_GENS; i++) {
+      const struct mini_ov_gen *g = &ov->gens[i];
+      size_t ins, tomb;
+      if (set_find(&g->tombstones, word, len, &tomb))
+         found = 0;
+      if (set_find(&g->inserts, word, len, &ins))
+         found = 1;
+      shift += (int64_t)ins - (int64_t)tomb;
+   }
+   if (!found)
+      return 0;
+
+   /* Number of words of the base automaton that sort before the word. */
+   uint64_t before;
+   if (pos) {
+      before = pos - 1;
+   } else {
+      struct mini_iter it;
+      pos = mn_iter_inits(&it, ov->base, word, len);
+      before = pos ? pos - 1 : ov->base->words;
+   }
+   before += shift;
+   return before < UINT32_MAX ? before + 1 : 0;
+}
+
+static void ov_iter_init(struct mini_overlay_iter *it, const struct mini_overlay *ov,
+                         size_t gens)
+{
+   it->ov = ov;
+   mn_iter_init(&it->base, ov->base);
+   it->base_word = mn_iter_next(&it->base, &it->base_len);
+   for (size_t i = 0; i < MN_OV_GENS; i++)
+      it->ins[i] = it->tomb[i] = 0;
+   it->gens = gens;
+   it->advance = 0;
+}
+
+void mn_overlay_iter_init(struct mini_overlay_iter *it, const struct mini_overlay *ov)
+{
+   ov_iter_init(it, ov, MN_OV_GENS);
+}
+
+const char *mn_overlay_iter_next(struct mini_overlay_iter *it, size_t *len)
+{
+   const struct mini_overlay *ov = it->ov;
+
+   if (it->advance) {
+      it->base_word = mn_iter_next(&it->base, &it->base_len);
+      it->advance = 0;
+   }
+
+   for (;;) {
+      /* Smallest word of the base automaton and of the inserted words. */
+      const char *word = it->base_word;
+      size_t word_len = it->base_len;
+      for (size_t i = 0; i < it->gens; i++) {
+         const struct mini_ov_set *ins = &ov->gens[i].inserts;
+         if (it->ins[i] < ins->nr) {
+            const struct mini_ov_word *ow = ins->words[it->ins[i]];
+            if (!word || lmemcmp(ow->data, ow->len, word, word_len) < 0) {
+               word = ow->data;
+               word_len = ow->len;
+            }
+         }
+      }
+      if (!word) {
+         if (len)
+            *len = 0;
+         return NULL;
+      }
+
+      /* The last generation that changed the word tells if it is present. */
+      const int in_base = word == it->base_word;
+      int found = in_base;
+      for (size_t i = 0; i < it->gens; i++) {
+         const struct mini_ov_gen *g = &ov->gens[i];
+         while (it->tomb[i] < g->tombstones.nr) {
+            const struct mini_ov_word *ow = g->tombstones.words[it->tomb[i]];
+            int cmp = lmemcmp(ow->data, ow->len, word, word_len);
+            if (cmp > 0)
+               break;
+            if (cmp == 0)
+               found = 0;
+            it->tomb[i]++;
+         }
+         if (it->ins[i] < g->inserts.nr) {
+            const struct mini_ov_word *ow = g->inserts.words[it->ins[i]];
+            if (ow->data == word || !lmemcmp(ow->data, ow->len, word, word_len)) {
+               found = 1;
+               it->ins[i]++;
+            }
+         }
+      }
+
+      if (found) {
+         /* The word must stay valid until the next call, so the base iterator
+          * is only advanced then.
+          */
+         it->advance = in_base;
+         if (len)
+            *len = word_len;
+         return word;
+      }
+      if (in_base)
+         it->base_word = mn_iter_next(&it->base, &it->base_len);
+   }
+}
+
+int mn_overlay_snapshot(struct mini_overlay *ov)
+{
+   struct mini_ov_gen *snap = &ov->gens[MN_OV_SNAPSHOT];
+   struct mini_ov_gen *live = &ov->gens[MN_OV_LIVE];
+
+   if (!snap->inserts.nr && !snap->tombstones.nr) {
+      const struct mini_ov_gen tmp = *snap;
+      *snap = *live;
+      *live = tmp;
+      return MN_OK;
+   }
+
+   /* Changes are moved one at a time, starting from the end of the sets, so
+    * that the overlay stays consistent if we run out of memory.
+    */
+   while (live->inserts.nr) {
+      const struct mini_ov_word *ow = live->inserts.words[live->inserts.nr - 1];
+      int ret = ov_insert(ov, MN_OV_SNAPSHOT, ow->data, ow->len);
+      if (ret)
+         return ret;
+      set_remove(&live->inserts, live->inserts.nr - 1);
+   }
+   while (live->tombstones.nr) {
+      const struct mini_ov_word *ow = live->tombstones.words[live->tombstones.nr - 1];
+      int ret = ov_remove(ov, MN_OV_SNAPSHOT, ow->data, ow->len);
+      if (ret)
+         return ret;
+      set_remove(&live->tombstones, live->tombstones.nr - 1);
+   }
+   return MN_OK;
+}
+
+int mn_overlay_compact(const struct mini_overlay *ov, struct mini_enc *enc)
+{
+   /* Changes made since the snapshot are left out. */
+   struct mini_overlay_iter it;
+   ov_iter_init(&it, ov, MN_OV_SNAPSHOT + 1);
+
+   const char *word;
+   size_t len;
+   while ((word = mn_overlay_iter_next(&it, &len))) {
+      int ret = mn_enc_add(enc, word, len);
+      if (ret)
+         return ret;
+   }
+   return MN_OK;
+}
+
+void mn_overlay_rebase(struct mini_overlay *ov, const struct mini *base)
+{
+   set_clear(&ov->gens[MN_OV_SNAPSHOT].inserts);
+   set_clear(&ov->gens[MN_OV_SNAPSHOT].tombstones);
+   ov->base = base;
+}
+
+
 /*******************************************************************************
  * Debugging
  ******************************************************************************/
@@ -999,14 +6060,14 @@ static void mn_dump_txt(const struct mini *fsa, FILE *fp)
 static void mn_dump_tsv(const struct mini *fsa, FILE *fp)
 {
    fputs("char\tterminal\tlast\tdest\tcount\n", fp);
-   for (uint32_t pos = 0; pos < fsa->nr; pos++) {
-      uint32_t trans = fsa->transitions[pos];
+   for (uint64_t pos = 0; pos < fsa->nr; pos = next_trans(fsa, pos)) {
+      uint64_t trans = get_trans(fsa, pos);
       uint8_t ch = GET_CHAR(trans);
       bool is_terminal = IS_TERMINAL(trans);
       bool is_last = IS_LAST(trans);
-      uint32_t dest = GET_DEST(trans);
-      uint32_t count = fsa->counts ? fsa->counts[pos] : 0;
-      fprintf(fp, "0x%x\t%d\t%d\t%"PRIu32"\t%"PRIu32"\n", ch, is_terminal, is_last, dest, count);
+      uint64_t dest = GET_DEST(trans);
+      uint32_t count = fsa->type == MN_NUMBERED ? get_count(fsa, pos) : 0;
+      fprintf(fp, "0x%x\t%d\t%d\t%"PRIu64"\t%"PRIu32"\n", ch, is_terminal, is_last, dest, count);
    }
 }
 
@@ -1015,25 +6076,28 @@ static void mn_dump_dot(const struct mini *fsa, FILE *fp)
    fputs("digraph FSA {\n", fp);
 
    /* If there is a single transition, don't output anything. */
-   uint32_t i = 1;
+   uint64_t i = next_trans(fsa, 0);
    while (i < fsa->nr) {
-      uint32_t j = i;
-      do {
-         uint32_t dest = GET_DEST(fsa->transitions[j]);
-         unsigned char trans_char = GET_CHAR(fsa->transitions[j]);
+      uint64_t j = i;
+      for (;;) {
+         uint64_t dest = GET_DEST(get_trans(fsa, j));
+         unsigned char trans_char = GET_CHAR(get_trans(fsa, j));
          char label[32];
          if (isprint(trans_char) && trans_char != '"')
             snprintf(label, sizeof label, "%c", trans_char);
          else
             snprintf(label, sizeof label, "0x%02x", trans_char);
-         if (fsa->counts)
+         if (fsa->type == MN_NUMBERED)
             snprintf(label + strlen(label), sizeof label - strlen(label),
-                     " (%"PRIu32")", fsa->counts[j]);
-         fprintf(fp, "%"PRIu32" -> %"PRIu32" [label=\"%s\"]\n", i, dest, label);
-         if (IS_TERMINAL(fsa->transitions[j]))
-            fprintf(fp, "%"PRIu32" [style=filled];\n", dest);
-      } while (!IS_LAST(fsa->transitions[j++]));
-      i = j;
+                     " (%"PRIu32")", get_count(fsa, j));
+         fprintf(fp, "%"PRIu64" -> %"PRIu64" [label=\"%s\"]\n", i, dest, label);
+         if (IS_TERMINAL(get_trans(fsa, j)))
+            fprintf(fp, "%"PRIu64" [style=filled];\n", dest);
+         if (IS_LAST(get_trans(fsa, j)))
+            break;
+         j = next_trans(fsa, j);
+      }
+      i = next_trans(fsa, j);
    }
 
    fputs("}\n", fp);
@@ -1,7 +1,7 @@
 #ifndef MINI_H
 #define MINI_H
 
-#define MN_VERSION "0.2"
+#define MN_VERSION "0.3"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -24,6 +24,7 @@ enum {
    MN_EFREEZED,   /* Attempt to add a word to a freezed automaton. */
    MN_E2BIG,      /* Automaton has grown too large. */
    MN_EIO,        /* IO error. */
+   MN_ENATIVE,    /* Automaton not in the native layout of the host. */
 };
 
 /* Returns a string describing an error code. */
@@ -59,6 +60,62 @@ void mn_enc_free(struct mini_enc *);
  */
 int mn_enc_add(struct mini_enc *, const void *word, size_t len);
 
+/* Encodes the words of a buffer, which are separated with a delimiter byte,
+ * e.g. '\n'. Empty words are skipped, and the last word needn't be followed by
+ * a delimiter. This is equivalent to calling mn_enc_add() on each word, but
+ * avoids splitting the buffer beforehand.
+ * On error, the offset of the faulty word in the buffer is stored in "offset",
+ * if it is not NULL. The words preceding it have been added.
+ */
+int mn_enc_add_buffer(struct mini_enc *, const void *data, size_t size,
+                      int delim, size_t *offset);
+
+/* Encodes an array of words, using up to "threads" threads.
+ * Words must satisfy the same constraints as with mn_enc_add(), and must sort
+ * after the words already added. The batch is split into ranges of words that
+ * start with distinct bytes, which are minimized concurrently, and then merged
+ * into the encoder. The resulting automaton is identical to the one that would
+ * be obtained by adding the same words with mn_enc_add().
+ * As with mn_enc_add(), the encoder should be cleared if an error occurs.
+ */
+int mn_enc_add_batch(struct mini_enc *,
+                     const void *const words[], const size_t lens[], size_t nr,
+                     unsigned threads);
+
+/* Switches an encoder to unsorted mode, or back to the default mode if
+ * "max_memory" is zero. This must be done before adding any word, otherwise
+ * MN_EORDER is returned, or MN_EFREEZED if the automaton was dumped.
+ * In unsorted mode, words can be added in any order, and duplicates are
+ * allowed. Words are buffered, and encoded when the automaton is dumped. The
+ * resulting automaton is the same as if the distinct words had been added in
+ * order.
+ * The buffer grows up to "max_memory" bytes. When it is full, its contents are
+ * sorted and written to a temporary file, so memory usage stays bounded. Each
+ * word takes its length plus about 10 bytes in the buffer. Errors related to
+ * temporary files are reported with MN_EIO.
+ */
+int mn_enc_set_unsorted(struct mini_enc *, size_t max_memory);
+
+/* Switches an encoder to streaming mode, or back to the default mode if "fp"
+ * is NULL. This must be done before adding any word, otherwise MN_EORDER is
+ * returned, or MN_EFREEZED if the automaton was dumped.
+ * In streaming mode, the automaton is written to the provided file while it is
+ * being built, as soon as its states are minimized, instead of being kept in
+ * memory until it is dumped. Registered states are read back from the file
+ * through a memory mapping when they must be compared to new ones, so that the
+ * encoder only allocates memory for its states hash table and for the states
+ * along the path of the last word added. The file must be seekable, and opened
+ * in binary mode for both reading and writing (e.g. with mode "w+b"). Its
+ * previous contents are overwritten. Numbered automata additionally need a
+ * temporary file.
+ * The automaton is completed by calling mn_enc_dump_file() with the same file,
+ * which then contains the same bytes as in the default mode. Calling
+ * mn_enc_dump() or mn_enc_dump_file() with another destination copies the
+ * file. mn_enc_clear() switches the encoder back to the default mode. Errors
+ * related to files are reported with MN_EIO.
+ */
+int mn_enc_set_stream(struct mini_enc *, FILE *fp);
+
 /* Dumps an encoded automaton.
  * The provided callback will be called several times for writing the automaton
  * to some file or memory location. It must return zero on success, non-zero on
@@ -83,9 +140,165 @@ int mn_enc_dump_file(struct mini_enc *, FILE *);
 
 /* Clears the internal structures. After this is called, the encoder object can
  * be used again to encode a new set of words.
+ * Memory allocated so far is kept for reuse.
  */
 void mn_enc_clear(struct mini_enc *);
 
+/* Returns the maximum amount of memory, in bytes, used by an encoder since its
+ * creation.
+ * The encoder allocates memory on demand, so that this is proportional to the
+ * size of the automaton being built. This includes the memory used by the
+ * threads of mn_enc_add_batch(), but not the pages of the files mapped in
+ * streaming mode.
+ */
+size_t mn_enc_peak_memory(const struct mini_enc *);
+
+/* Encoder statistics. */
+struct mn_enc_stats {
+   uint64_t states_created;   /* Number of states added to the register. */
+   uint64_t states_merged;    /* Number of states found to be equivalent to a
+                               * state already in the register. */
+   uint64_t probes;           /* Total number of buckets examined while
+                               * looking up states in the register. */
+   uint64_t max_probes;       /* Largest number of buckets examined in a
+                               * single lookup. */
+   size_t buckets;            /* Number of buckets of the register. */
+   double load_factor;        /* Fraction of these buckets that are in use. */
+   double minimize_time;      /* Time spent minimizing, in seconds. */
+   size_t peak_memory;        /* See mn_enc_peak_memory(). */
+   uint64_t overlap_saved;    /* Number of transitions saved by storing
+                               * states inside others, see
+                               * mn_enc_set_overlap(). */
+};
+
+/* Fills a structure with statistics about the construction of the current
+ * automaton. These are reset by mn_enc_clear().
+ * The average probe length is given by:
+ *
+ *    probes / (states_created + states_merged)
+ */
+void mn_enc_stats(const struct mini_enc *, struct mn_enc_stats *);
+
+/* Enables or disables the measurement of the time spent minimizing.
+ * This is disabled by default, because it requires reading the clock each time
+ * a word is added, which noticeably slows down encoding.
+ */
+void mn_enc_set_timing(struct mini_enc *, int enable);
+
+/* Orders of states in an automaton. */
+enum mn_layout {
+   MN_LAYOUT_DEFAULT,   /* Order in which states are minimized, roughly
+                         * reverse post-order. */
+   MN_LAYOUT_BFS,       /* Breadth-first from the start state. */
+   MN_LAYOUT_DFS,       /* Depth-first from the start state. */
+   MN_LAYOUT_PROFILE,   /* Most visited states first, when looking up a
+                         * sample of queries, then depth-first. */
+};
+
+/* Chooses the order in which states are laid out when the automaton is
+ * dumped. The resulting automaton has the same words and ordinals, but states
+ * used together are closer in memory, so that lookups incur fewer cache
+ * misses. The breadth-first order groups the states near the start state, the
+ * depth-first one the states along each path. When lookups are spread evenly
+ * over the lexicon, the default order, which is close to depth-first, is
+ * already good; the profile-guided order pays off when some words are looked
+ * up much more often than others. The profile-guided order needs
+ * a sample of queries, typically taken from a query log, which must stay valid
+ * until the automaton is dumped; it is ignored for other layouts.
+ * Reordering needs about three times as much memory as the automaton itself,
+ * and is not done in streaming mode. The layout is kept by mn_enc_clear().
+ */
+void mn_enc_set_layout(struct mini_enc *, enum mn_layout,
+                       const void *const queries[], const size_t lens[], size_t nr);
+
+/* Encodings of transitions in a dumped automaton. */
+enum mn_format {
+   MN_FORMAT_FIXED,     /* 32 or 64 bits per transition. */
+   MN_FORMAT_COMPACT,   /* Variable-length transitions. */
+   MN_FORMAT_PACKED,    /* As few bits per transition as possible. */
+};
+
+/* Chooses how transitions are encoded when the automaton is dumped.
+ * The fixed format, which is the default, stores each transition as a 32 or
+ * 64 bits integer, plus a 32 bits count for numbered automata. The compact
+ * format stores the label and flags of a transition in two bytes, followed by
+ * its destination and count in as few bytes as needed. States are laid out
+ * depth-first, so that the last transition of a state can often lead to the
+ * state that immediately follows, and need no destination at all. Numbered
+ * automata, and automata of more than 2^22 transitions, are typically 40 to
+ * 60% smaller; smaller standard automata only shrink by about 10%. Lookups are
+ * slower, by up to a factor of two when the automaton fits in the CPU caches,
+ * much less otherwise.
+ * The packed format is the fixed one, with destinations of just as many bits
+ * as needed to address all transitions, and counts of just as many bits as
+ * needed to store the number of words, so that a lexicon of 100,000
+ * transitions takes 27 bits per transition instead of 32. This pays off most
+ * for numbered automata, and for automata of more than 2^22 transitions, which
+ * the fixed format stores on 64 bits. Transitions are still accessed in
+ * constant time, but decoding them makes lookups up to 30% slower, unless
+ * packing lets the automaton fit in a faster level of the CPU caches.
+ * Automata whose transitions would need more than 57 bits are written in the
+ * fixed format.
+ * The state layout is ignored for compact automata, and the format is ignored
+ * in streaming mode. The format is kept by mn_enc_clear().
+ */
+void mn_enc_set_format(struct mini_enc *, enum mn_format);
+
+/* Enables or disables the storage of states inside others.
+ * When the transitions of a state are the last ones of another state, they
+ * are not stored a second time: transitions leading to the first state lead
+ * to the middle of the second one instead. The resulting automaton has the
+ * same words and ordinals, and lookups are as fast, but it is smaller: by 4%
+ * for a lexicon of English words, by less for random strings. This is done
+ * when the automaton is dumped, after the states are reordered, and needs
+ * about three times as much memory as the automaton itself. It is not done
+ * for compact automata, nor in streaming mode. This is disabled by default,
+ * and the setting is kept by mn_enc_clear().
+ */
+void mn_enc_set_overlap(struct mini_enc *, int enable);
+
+/* Encodings of per-transition counts in a numbered automaton. */
+enum mn_counts {
+   MN_COUNTS_FULL,         /* 32 bits per count. */
+   MN_COUNTS_NARROW,       /* 8 bits per count, larger ones stored apart. */
+   MN_COUNTS_INTERLEAVED,  /* 32 bits per count, next to its transition. */
+};
+
+/* Chooses how the counts of numbered automata are stored, when transitions are
+ * in the fixed format. By default, each count takes 32 bits, as much as a
+ * transition of a small automaton. Yet most counts are tiny, as most
+ * transitions lead to a handful of words: narrow counts are stored on a
+ * single byte, and the few counts of 255 or more in a separate table, which
+ * is indexed with a bitmap of 64 transitions plus a 32 bits rank per block.
+ * This takes 9.5 bits per transition instead of 32, so that automata of
+ * 32 bits transitions are about 35% smaller, and others about 23% smaller.
+ * mn_locate(), mn_extract() and the numbered iterators are as fast when the
+ * automaton doesn't fit in the CPU caches, but up to 25% slower otherwise, as
+ * the counts of the transitions near the start state are all stored apart.
+ * Interleaved counts are stored right after their transition, instead of in
+ * an array of their own, so that the automaton is as large as with full
+ * counts, but a transition and its count are in the same cache line. On
+ * automata larger than the CPU caches, this makes mn_extract(), which reads
+ * the count of every transition it visits, 10 to 25% faster, but mn_locate(),
+ * which only reads the counts of the transitions it skips, about 5% slower,
+ * as states then span more cache lines.
+ * This is ignored for other formats, which already store counts in fewer bits,
+ * and in streaming mode. The setting is kept by mn_enc_clear().
+ */
+void mn_enc_set_counts(struct mini_enc *, enum mn_counts);
+
+/* Enables or disables the native layout. Native automata are written exactly
+ * as they are laid out in memory once loaded, with the transitions and counts
+ * of the fixed format in the byte order of the host, so that mn_load_mem()
+ * and mn_load_mmap() can use them in place, in constant time, instead of
+ * reading and converting them. They are a few bytes larger, because of
+ * padding, and can be loaded on any host, and with any loading function, but
+ * hosts of the other byte order have to convert them as usual. This is
+ * ignored in streaming mode. This is disabled by default, and the setting is
+ * kept by mn_enc_clear().
+ */
+void mn_enc_set_native(struct mini_enc *, int enable);
+
 
 /*******************************************************************************
  * Reader
@@ -94,6 +307,7 @@ void mn_enc_clear(struct mini_enc *);
 struct mini;
 
 /* Loads an automaton.
+ * Automata created with previous versions of this library can be loaded, too.
  * The provided callback will be called several times for reading the automaton.
  * It should return zero on success, non-zero on failure. A short read must be
  * considered as an error.
@@ -109,15 +323,159 @@ int mn_load(struct mini **,
  */
 int mn_load_file(struct mini **, FILE *);
 
+/* Same as mn_load_file(), but reads and converts large automata with up to
+ * "threads" threads. The file is split into pieces of a few megabytes, each of
+ * which is read with pread() and converted to host order by the thread that
+ * read it. This is only done if the file is a regular one.
+ */
+int mn_load_parallel(struct mini **, FILE *, unsigned threads);
+
+/* Loads an automaton from a buffer of "size" bytes, which must stay valid and
+ * unmodified until the automaton is freed. Native automata written on a host
+ * of the same byte order, see mn_enc_set_native(), are used in place, if the
+ * buffer is aligned on eight bytes: this takes constant time, and only a few
+ * bytes of memory. Their contents are then trusted, apart from the header,
+ * which is checked as usual. Other automata are copied, as with mn_load().
+ * Data following the automaton in the buffer is ignored.
+ */
+int mn_load_mem(struct mini **, const void *data, size_t size);
+
+/* Loads an automaton from a file, by mapping it in memory. The automaton
+ * starts at the current position of the file, which is left unchanged. Native
+ * automata are used in place, as with mn_load_mem(): the pages of the file are
+ * then shared with other processes that map it, and read from disk when they
+ * are first accessed. The file can be closed afterwards, but must not be
+ * modified while the automaton is in use. Other automata are copied from the
+ * mapping. Files that can't be mapped, such as pipes, are read as with
+ * mn_load_file(), which moves their position past the automaton.
+ */
+int mn_load_mmap(struct mini **, FILE *);
+
+/* Same as mn_load_mem(), but never copies the automaton: fails with
+ * MN_ENATIVE if it can't be used in place. This is meant for automata compiled
+ * into a program, as generated by "mini embed", which then take no time and
+ * no memory to load, apart from a small allocation.
+ */
+int mn_wrap(struct mini **, const void *data, size_t size);
+
+/* Checks the structure of a loaded automaton. Loading functions only check the
+ * header, which is protected by a checksum, so that they stay fast, and take
+ * constant time for automata used in place. This checks, in time linear in
+ * the size of the automaton, that the transitions of every state reachable
+ * from the start state lead to states within the automaton, that they end
+ * with a last transition and are sorted by label, that words are at most
+ * MN_MAX_WORD_LEN bytes long, so that the automaton is acyclic, and that
+ * counts match the number of words recognized from the transitions they
+ * belong to, and the number of words in the header. Once this succeeds, no
+ * function reads out of the bounds of the automaton, whatever its contents.
+ * Memory used is about 18 bytes per transition, or per byte of transitions if
+ * compact. Returns MN_ECORRUPT if a check fails.
+ */
+int mn_verify(const struct mini *);
+
+/* Writes an automaton as a native one, see mn_enc_set_native(), whatever the
+ * way it was created. Its words, format and counts encoding are unchanged.
+ * The provided callback is called as with mn_enc_dump().
+ */
+int mn_save_native(const struct mini *,
+                   int (*write)(void *arg, const void *data, size_t size),
+                   void *arg);
+
+/* Copies an automaton to a POSIX shared memory segment named "name", such as
+ * "/words", as a native one, see mn_save_native(), so that other processes can
+ * use it with mn_attach() without loading it. A segment of the same name is
+ * replaced, but processes attached to it keep using it. The segment lasts
+ * until it is removed with mn_unpublish(), or the host reboots. Returns
+ * MN_EIO if it can't be created.
+ */
+int mn_publish(const struct mini *, const char *name);
+
+/* Uses an automaton published with mn_publish() in place, read-only, as with
+ * mn_wrap(): all the processes attached to a segment share its pages, so that
+ * it takes memory once per host, and not once per process. Returns MN_EIO if
+ * there is no such segment, MN_EMAGIC if it is still being published, and
+ * MN_ENATIVE if it was published on a host of another byte order.
+ */
+int mn_attach(struct mini **, const char *name);
+
+/* Removes a segment created with mn_publish(). Processes attached to it keep
+ * using it until they free their automaton. Returns MN_EIO if there is no such
+ * segment.
+ */
+int mn_unpublish(const char *name);
+
+/* Memory hints, for mn_advise(). */
+enum {
+   MN_ADVISE_HUGE_PAGES = 1 << 0,
+   MN_ADVISE_PREFAULT = 1 << 1,
+   MN_ADVISE_LOCK = 1 << 2,
+};
+
+/* Changes the way the arrays of a loaded automaton are kept in memory, to
+ * make lookups in large automata faster. "flags" is a combination of:
+ * - MN_ADVISE_HUGE_PAGES: back the automaton with huge pages, so that random
+ *   lookups miss the TLB less often. Copied automata of at least 2 MB are
+ *   moved to memory that is allocated with MAP_HUGETLB if huge pages are
+ *   reserved, or aligned on 2 MB and marked with MADV_HUGEPAGE otherwise.
+ *   Automata used in place by mn_load_mmap() are marked with MADV_HUGEPAGE,
+ *   which only has an effect on file systems that support it. This is a hint,
+ *   and never fails.
+ * - MN_ADVISE_PREFAULT: touch every page of the automaton, so that the first
+ *   lookups don't have to read them from disk or allocate them.
+ * - MN_ADVISE_LOCK: lock the pages of the automaton in memory, with mlock(),
+ *   so that they are never paged out. Fails with MN_EIO if the limit on locked
+ *   memory of the process is too low. Pages are unlocked by mn_free().
+ * Automata used in place by mn_wrap() or mn_load_mem() are prefaulted and
+ * locked, but never moved. This should be called before the automaton is
+ * shared between threads.
+ */
+int mn_advise(struct mini *, int flags);
+
+/* Builds jump tables for the states of a loaded automaton that have at least
+ * "min_fanout" transitions, so that lookups find the transition to follow in
+ * these states in constant time, instead of scanning their transitions. This
+ * pays off for the states near the start state, which have dozens of
+ * transitions in natural language lexicons. Tables are built level by level
+ * from the start state, as long as the states that have at least
+ * "min_fanout" transitions hold at least half of the transitions of their
+ * level, and are only looked for at these levels, so that deeper lookups
+ * don't pay for them. 8 is a good value for "min_fanout". The table of a
+ * state takes about 100 bytes, plus 4 bytes per transition if the automaton is
+ * numbered, and 2 more if it is compact. States are chosen by decreasing
+ * number of transitions, as long as the tables take at most "max_memory"
+ * bytes in total. Tables are kept apart from the automaton, which is
+ * unchanged: they are not saved along with it, and each process that uses a
+ * shared automaton builds its own. Calling this again replaces the tables,
+ * and a "max_memory" of zero frees them. All the lookup functions use the
+ * tables. This should be called before the automaton is shared between
+ * threads. Returns MN_E2BIG if there isn't enough memory, in which case the
+ * automaton has no tables.
+ */
+int mn_accelerate(struct mini *, unsigned min_fanout, size_t max_memory);
+
 /* Destructor. */
 void mn_free(struct mini *);
 
 /* Returns the type of an automaton. */
 enum mn_type mn_type(const struct mini *);
 
+/* Returns the encoding of the transitions of an automaton. */
+enum mn_format mn_format(const struct mini *);
+
+/* Returns the encoding of the counts of an automaton. This is MN_COUNTS_FULL
+ * unless the automaton is numbered, in the fixed format, and was created with
+ * narrow counts.
+ */
+enum mn_counts mn_counts(const struct mini *);
+
+/* Returns whether an automaton was written in the native layout, see
+ * mn_enc_set_native().
+ */
+int mn_native(const struct mini *);
+
 /* Returns the number of words in an automaton.
- * If the automaton is numbered, this is a constant time operation. Otherwise,
- * this requires traversing the entire automaton.
+ * This is a constant time operation. The returned value is capped at
+ * UINT32_MAX.
  */
 uint32_t mn_size(const struct mini *);
 
@@ -151,7 +509,7 @@ struct mini_iter {
    const struct mini *fsa;                    /* Attached automaton. */
    size_t root;                               /* Root depth. */
    size_t depth;                              /* Current stack depth. */
-   uint32_t positions[MN_MAX_WORD_LEN + 1];   /* Offsets stack. */
+   uint64_t positions[MN_MAX_WORD_LEN + 1];   /* Offsets stack. */
    char word[MN_MAX_WORD_LEN + 1];            /* Current word. */
 };
 
@@ -201,6 +559,143 @@ uint32_t mn_iter_initn(struct mini_iter *, const struct mini *, uint32_t pos);
 const char *mn_iter_next(struct mini_iter *, size_t *len);
 
 
+/*******************************************************************************
+ * Merging
+ ******************************************************************************/
+
+/* Adds the union of the words of two automata to an encoder.
+ * The automata can be of any type, and the type of the result is the one of the
+ * encoder. Words common to both automata are added once. In sorted mode, the
+ * words of both automata must sort after the ones already added to the
+ * encoder. The cost is proportional to the size of the union.
+ * On error, returns the error code of the failed call to mn_enc_add().
+ */
+int mn_merge(struct mini_enc *, const struct mini *, const struct mini *);
+
+
+/*******************************************************************************
+ * Overlay
+ ******************************************************************************/
+
+/* An overlay makes an automaton updatable. It holds a set of words inserted
+ * into the automaton, and a set of words removed from it, both of which are
+ * consulted when looking up words. These sets are meant to stay small: they
+ * should be folded periodically into a new automaton with mn_overlay_compact(),
+ * which then replaces the old one with mn_overlay_rebase().
+ *
+ * Functions that take a const overlay only read it, and can be called
+ * concurrently from several threads, provided no other function is called
+ * at the same time. With a reader-writer lock, lookups take the read lock,
+ * and changes the write lock. Compaction blocks neither: the changes made so
+ * far are first set apart with mn_overlay_snapshot(), under the write lock.
+ * mn_overlay_compact() only reads these changes and the base automaton, which
+ * are not modified until mn_overlay_rebase(), so it can run without the lock
+ * while lookups and changes go on. mn_overlay_rebase() then replaces the base
+ * automaton, under the write lock, and discards the changes set apart, but
+ * keeps the changes made since the snapshot.
+ */
+struct mini_overlay;
+
+/* Allocates a new overlay on top of an automaton. The automaton is not owned
+ * by the overlay, and must outlive it, or at least be replaced beforehand
+ * with mn_overlay_rebase().
+ * Returns NULL if there is not enough memory.
+ */
+struct mini_overlay *mn_overlay_new(const struct mini *base);
+
+/* Destructor. */
+void mn_overlay_free(struct mini_overlay *);
+
+/* Adds a word to an overlay. Adding a word that is already present is not an
+ * error. The length of the word must be greater than zero and not exceed
+ * MN_MAX_WORD_LEN.
+ * Returns MN_EWORD if the word is empty or too long, MN_E2BIG if there is not
+ * enough memory.
+ */
+int mn_overlay_insert(struct mini_overlay *, const void *word, size_t len);
+
+/* Removes a word from an overlay. Removing a word that is not present is not
+ * an error. Constraints are the same as with mn_overlay_insert().
+ * Returns MN_EWORD if the word is empty or too long, MN_E2BIG if there is not
+ * enough memory.
+ */
+int mn_overlay_remove(struct mini_overlay *, const void *word, size_t len);
+
+/* Checks if an overlay contains a word.
+ * Returns 1 if so, 0 otherwise. If the overlay holds no changes, this is
+ * almost as fast as mn_contains().
+ */
+int mn_overlay_contains(const struct mini_overlay *, const void *word, size_t len);
+
+/* Returns the number of words of an overlay, capped at UINT32_MAX. */
+uint32_t mn_overlay_size(const struct mini_overlay *);
+
+/* Returns the number of changes held by an overlay, that is, the number of
+ * words that were inserted or removed and that haven't been folded into the
+ * base automaton yet, including the changes set apart by
+ * mn_overlay_snapshot().
+ */
+size_t mn_overlay_changes(const struct mini_overlay *);
+
+/* Returns the ordinal of a word, taking changes into account.
+ * This only works if the base automaton is numbered, otherwise 0 is returned.
+ * Ordinals of words that follow changed words shift accordingly, so they are
+ * not stable across changes. Locating an inserted word requires an additional
+ * traversal of the base automaton.
+ */
+uint32_t mn_overlay_locate(const struct mini_overlay *, const void *word, size_t len);
+
+/* Overlay iterator. */
+struct mini_overlay_iter {
+   const struct mini_overlay *ov;   /* Attached overlay. */
+   struct mini_iter base;           /* Iterator over the base automaton. */
+   const char *base_word;           /* Current word of the base automaton. */
+   size_t base_len;                 /* Length of this word. */
+   size_t ins[2];                   /* Index of the next inserted word, and */
+   size_t tomb[2];                  /* of the next removed word, for the
+                                     * changes set apart and the others. */
+   size_t gens;                     /* Number of these sets iterated on. */
+   int advance;                     /* Whether "base" must be advanced. */
+};
+
+/* Returns an iterator over the words of an overlay, in lexicographical order.
+ * The overlay must not be modified while it is being iterated on.
+ */
+void mn_overlay_iter_init(struct mini_overlay_iter *, const struct mini_overlay *);
+
+/* Fetches the next word from an overlay iterator.
+ * Works as mn_iter_next().
+ */
+const char *mn_overlay_iter_next(struct mini_overlay_iter *, size_t *len);
+
+/* Sets apart the changes made to an overlay so far, so that they can be
+ * compacted while new changes are made. Changes set apart by a previous call
+ * and not yet discarded by mn_overlay_rebase() are kept, so that this can be
+ * called again after a failed compaction, but not while one is running.
+ * Returns MN_E2BIG if there is not enough memory, in which case some changes
+ * may not have been set apart, but the words of the overlay are unchanged.
+ */
+int mn_overlay_snapshot(struct mini_overlay *);
+
+/* Adds the words of an overlay to an encoder, so that a new automaton that
+ * includes the changes set apart by mn_overlay_snapshot() can be created.
+ * Changes made since then are not included. The overlay itself is not
+ * modified.
+ * In sorted mode, the words must sort after the ones already added to the
+ * encoder.
+ * On error, returns the error code of the failed call to mn_enc_add().
+ */
+int mn_overlay_compact(const struct mini_overlay *, struct mini_enc *);
+
+/* Replaces the base automaton of an overlay, and discards the changes set
+ * apart by mn_overlay_snapshot(). This is meant to be called with the
+ * automaton created from mn_overlay_compact(), whose words include these
+ * changes; the changes made since the snapshot are kept, and apply to the new
+ * automaton. The previous base automaton is not freed.
+ */
+void mn_overlay_rebase(struct mini_overlay *, const struct mini *base);
+
+
 /*******************************************************************************
  * Debugging.
  ******************************************************************************/
@@ -24,6 +24,53 @@ local function encode_fsa(path, itor, type)
    assert(enc:dump(path))
 end
 
+-- Checks all the lookup functions of an automaton against the sorted list of
+-- its words.
+local function check_lexicon(lex, ref_words, fsa_type)
+   assert(lex:verify())
+   assert(lex:type() == fsa_type)
+   assert(lex:size() == #ref_words and #lex == #ref_words)
+
+   local cnt = 0
+   for word in lex:iter() do
+      cnt = cnt + 1
+      assert(word == ref_words[cnt])
+   end
+   assert(cnt == #ref_words)
+
+   for i, word in ipairs(ref_words) do
+      assert(lex:contains(word))
+      if fsa_type == "numbered" then
+         assert(lex:locate(word) == i)
+         assert(lex:extract(i) == word)
+      else
+         assert(not lex:locate(word))
+      end
+   end
+   assert(not lex:contains("\255\255\255"))
+   assert(not lex:extract(#ref_words + 1))
+end
+
+-- Computes the CRC32C of a string, as stored in the header of automata.
+local function crc32c(data)
+   local crc = 0xffffffff
+   for i = 1, #data do
+      crc = bit32.bxor(crc, data:byte(i))
+      for _ = 1, 8 do
+         crc = bit32.bxor(bit32.rshift(crc, 1), bit32.band(0x82f63b78, -bit32.band(crc, 1)))
+      end
+   end
+   crc = bit32.bnot(crc)
+   return string.char(bit32.extract(crc, 24, 8), bit32.extract(crc, 16, 8),
+                      bit32.extract(crc, 8, 8), bit32.extract(crc, 0, 8))
+end
+
+-- Sets the checksum of the 48 bytes header of an automaton.
+local function set_checksum(data)
+   local header = data:sub(1, 40) .. "\0\0\0\0" .. data:sub(45, 48)
+   return data:sub(1, 40) .. crc32c(header) .. data:sub(45)
+end
+
 local test = {}
 
 function test.basic()
@@ -135,6 +182,39 @@ function test.functions()
    end
 end
 
+local function read_words()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+   return words
+end
+
+-- Counts must be right for all the states of a large automaton.
+function test.numbering()
+   local words = read_words()
+   local path = os.tmpname()
+   encode_fsa(path, get_iter(words), "numbered")
+   check_lexicon(assert(mini.load(path)), words, "numbered")
+   -- Same for a lexicon in which many words share their prefix.
+   local prefixed = {}
+   for i = 1, 1000 do prefixed[i] = string.format("a%05d", i) end
+   encode_fsa(path, get_iter(prefixed), "numbered")
+   check_lexicon(assert(mini.load(path)), prefixed, "numbered")
+   os.remove(path)
+end
+
+-- The number of words of standard automata is stored, not counted.
+function test.size()
+   local words = read_words()
+   local path = os.tmpname()
+   encode_fsa(path, get_iter(words), "standard")
+   check_lexicon(assert(mini.load(path)), words, "standard")
+   encode_fsa(path, get_iter{"a"}, "standard")
+   assert(assert(mini.load(path)):size() == 1)
+   encode_fsa(path, get_iter{}, "standard")
+   assert(assert(mini.load(path)):size() == 0)
+   os.remove(path)
+end
+
 function test.empty_lexicon()
    local path = os.tmpname()
    encode_fsa(path, function() return nil end)
@@ -197,6 +277,22 @@ function test.fsa_types()
    os.remove(path)
 end
 
+-- Files written in version 1 of the format should still load.
+function test.v1_files()
+   local lex = assert(mini.load("core_dump.mn"))
+   local words = {}
+   for word in lex:iter() do table.insert(words, word) end
+   assert(#words > 0)
+   check_lexicon(lex, words, lex:type())
+
+   -- Encoding the same words again gives the same lexicon, in version 2.
+   local path = os.tmpname()
+   encode_fsa(path, get_iter(words), lex:type())
+   assert(io.open(path, "rb"):read(8) == "mini\0\0\0\2")
+   check_lexicon(assert(mini.load(path)), words, lex:type())
+   os.remove(path)
+end
+
 -- Ensure a lexicon object is not collected while there are remaining iterators.
 -- This must be run under valgrind to be useful at all.
 function test.lexicon_collection(module)
@@ -227,6 +323,827 @@ function test.dump_several_times()
    os.remove(path1); os.remove(path2)
 end
 
+-- Returns all the words of three letters from a to z, in order. Their
+-- minimal automaton has 4 states.
+local function three_letter_words()
+   local letters = "abcdefghijklmnopqrstuvwxyz"
+   local words = {}
+   for i = 1, #letters do
+      for j = 1, #letters do
+         for k = 1, #letters do
+            table.insert(words, letters:sub(i, i) .. letters:sub(j, j) .. letters:sub(k, k))
+         end
+      end
+   end
+   return words
+end
+
+-- Equivalent states must all be merged, however many states the register
+-- holds.
+function test.minimization()
+   local words = three_letter_words()
+   local path = os.tmpname()
+   encode_fsa(path, get_iter(words), "standard")
+   -- 4 states and 78 transitions, plus the header and the root transition.
+   assert(#io.open(path, "rb"):read("*a") == 48 + 79 * 4)
+   check_lexicon(assert(mini.load(path)), words, "standard")
+
+   -- The register is kept when clearing the encoder.
+   local enc = mini.encoder()
+   for word in io.lines("words.txt") do enc:add(word) end
+   enc:clear()
+   for _, word in ipairs(words) do enc:add(word) end
+   local path2 = os.tmpname()
+   assert(enc:dump(path2))
+   assert(io.open(path, "rb"):read("*a") == io.open(path2, "rb"):read("*a"))
+   os.remove(path); os.remove(path2)
+end
+
+-- Encoders allocate memory as words are added.
+function test.peak_memory()
+   local enc = mini.encoder("numbered")
+   enc:add("a")
+   local small = enc:peak_memory()
+   assert(small > 0 and small < 1024 * 1024)
+   enc:clear()
+   for word in io.lines("words.txt") do enc:add(word) end
+   local large = enc:peak_memory()
+   assert(large > small)
+   -- Memory is kept for reuse.
+   enc:clear()
+   enc:add("a")
+   assert(enc:peak_memory() == large)
+end
+
+function test.encoder_stats()
+   local enc = mini.encoder()
+   local words = three_letter_words()
+   for _, word in ipairs(words) do enc:add(word) end
+   local path = os.tmpname()
+   assert(enc:dump(path))
+   os.remove(path)
+
+   local stats = enc:stats()
+   assert(stats.states_created == 4)
+   -- One lookup per state of the trie of the words.
+   assert(stats.states_created + stats.states_merged == 26^3 + 26^2 + 26 + 1)
+   assert(stats.probes >= stats.states_created + stats.states_merged)
+   assert(stats.max_probes >= 1)
+   assert(stats.buckets > 0 and stats.load_factor > 0 and stats.load_factor < 1)
+   assert(stats.peak_memory == enc:peak_memory())
+
+   enc:clear()
+   stats = enc:stats()
+   assert(stats.states_created == 0 and stats.states_merged == 0)
+   assert(stats.probes == 0)
+end
+
+-- Batches give the same automaton as words added one by one.
+function test.add_batch()
+   local words = read_words()
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      local path1, path2 = os.tmpname(), os.tmpname()
+      encode_fsa(path1, get_iter(words), fsa_type)
+
+      local enc = mini.encoder(fsa_type)
+      local half = math.random(#words)
+      for i = 1, half do enc:add(words[i]) end
+      local rest = {}
+      for i = half + 1, #words do table.insert(rest, words[i]) end
+      enc:add_batch(rest, 4)
+      assert(enc:dump(path2))
+      assert(io.open(path1, "rb"):read("*a") == io.open(path2, "rb"):read("*a"))
+
+      enc:clear()
+      enc:add_batch(words)
+      assert(enc:dump(path2))
+      assert(io.open(path1, "rb"):read("*a") == io.open(path2, "rb"):read("*a"))
+      os.remove(path1); os.remove(path2)
+   end
+
+   local enc = mini.encoder()
+   assert(not pcall(enc.add_batch, enc, {"b", "a"}, 2))
+   enc:clear()
+   enc:add("b")
+   assert(not pcall(enc.add_batch, enc, {"a"}, 2))
+   enc:clear()
+   assert(not pcall(enc.add_batch, enc, {"a", {}}))
+end
+
+-- Buffers give the same automaton as words added one by one.
+function test.add_buffer()
+   local words = read_words()
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      local path1, path2 = os.tmpname(), os.tmpname()
+      encode_fsa(path1, get_iter(words), fsa_type)
+
+      local enc = mini.encoder(fsa_type)
+      enc:add_buffer(table.concat(words, "\n") .. "\n")
+      assert(enc:dump(path2))
+      assert(io.open(path1, "rb"):read("*a") == io.open(path2, "rb"):read("*a"))
+
+      enc:clear()
+      local half = math.random(#words)
+      enc:add_buffer(table.concat(words, "\0\0", 1, half), "\0")
+      enc:add_buffer(table.concat(words, "\n", half + 1))
+      assert(enc:dump(path2))
+      assert(io.open(path1, "rb"):read("*a") == io.open(path2, "rb"):read("*a"))
+      os.remove(path1); os.remove(path2)
+   end
+
+   local enc = mini.encoder()
+   assert(not pcall(enc.add_buffer, enc, "b\na"))
+   enc:clear()
+   assert(not pcall(enc.add_buffer, enc, "a", "\n\n"))
+end
+
+-- Merging two automata gives the same automaton as encoding their union.
+function test.merge()
+   local words = read_words()
+   local words1, words2 = {}, {}
+   for i, word in ipairs(words) do
+      if i % 2 == 0 then table.insert(words1, word) end
+      if i % 3 == 0 then table.insert(words2, word) end
+   end
+   local union = {}
+   for i, word in ipairs(words) do
+      if i % 2 == 0 or i % 3 == 0 then table.insert(union, word) end
+   end
+   local path1, path2 = os.tmpname(), os.tmpname()
+   local path3, path4 = os.tmpname(), os.tmpname()
+   encode_fsa(path1, get_iter(words1), "standard")
+   encode_fsa(path2, get_iter(words2), "numbered")
+   local fsa1, fsa2 = assert(mini.load(path1)), assert(mini.load(path2))
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      encode_fsa(path3, get_iter(union), fsa_type)
+      local enc = mini.encoder(fsa_type)
+      enc:merge(fsa1, fsa2)
+      assert(enc:dump(path4))
+      assert(io.open(path3, "rb"):read("*a") == io.open(path4, "rb"):read("*a"))
+   end
+
+   local enc = mini.encoder()
+   enc:add(words[#words])
+   assert(not pcall(enc.merge, enc, fsa1, fsa2))
+   os.remove(path1); os.remove(path2); os.remove(path3); os.remove(path4)
+end
+
+-- Overlays must behave as the lexicon they represent.
+function test.overlay()
+   local words = read_words()
+   local base = {}
+   for i = 1, #words, 2 do table.insert(base, words[i]) end
+   local path1, path2 = os.tmpname(), os.tmpname()
+   encode_fsa(path1, get_iter(base), "numbered")
+   local overlay = mini.overlay(assert(mini.load(path1)))
+   assert(#overlay == #base and overlay:changes() == 0)
+
+   -- Insert or remove random words, including words not in the lexicon.
+   local present = {}
+   for _, word in ipairs(base) do present[word] = true end
+   local function update(nr)
+      for _ = 1, nr do
+         local word = words[math.random(#words)]
+         if math.random(2) == 1 then
+            overlay:insert(word)
+            present[word] = true
+         else
+            overlay:remove(word)
+            present[word] = nil
+         end
+      end
+   end
+   local function check()
+      local expect = {}
+      for _, word in ipairs(words) do
+         if present[word] then table.insert(expect, word) end
+      end
+      assert(#overlay == #expect)
+      for _, word in ipairs(words) do
+         assert(overlay:contains(word) == (present[word] == true))
+      end
+      assert(not overlay:contains("") and not overlay:contains("\255"))
+      for i, word in ipairs(expect) do assert(overlay:locate(word) == i) end
+      local i = 0
+      for word in overlay:iter() do
+         i = i + 1
+         assert(word == expect[i])
+      end
+      assert(i == #expect)
+      return expect
+   end
+   update(1000)
+   check()
+
+   -- Changes made after a snapshot are left out of compaction, and kept by
+   -- rebasing. Snapshots taken before a rebase accumulate.
+   overlay:snapshot()
+   update(500)
+   check()
+   overlay:snapshot()
+   local expect = check()
+   update(500)
+   check()
+
+   -- Compaction gives the same automaton as encoding the lexicon directly.
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      encode_fsa(path1, get_iter(expect), fsa_type)
+      local enc = mini.encoder(fsa_type)
+      overlay:compact(enc)
+      assert(enc:dump(path2))
+      assert(io.open(path1, "rb"):read("*a") == io.open(path2, "rb"):read("*a"))
+   end
+   local changes = overlay:changes()
+   overlay:rebase(assert(mini.load(path2)))
+   assert(overlay:changes() < changes)
+   check_lexicon(mini.load(path2), expect, "numbered")
+   check()
+
+   -- Without new changes, rebasing discards all of them.
+   overlay:snapshot()
+   expect = check()
+   local enc = mini.encoder("numbered")
+   overlay:compact(enc)
+   assert(enc:dump(path2))
+   overlay:rebase(assert(mini.load(path2)))
+   assert(#overlay == #expect and overlay:changes() == 0)
+   check()
+
+   assert(not pcall(overlay.insert, overlay, ""))
+   assert(not pcall(overlay.remove, overlay, string.rep("a", mini.MAX_WORD_LEN + 1)))
+   os.remove(path1); os.remove(path2)
+end
+
+-- Reordering states must not change words nor ordinals.
+function test.layout()
+   local words = read_words()
+   local queries = {}
+   for i = 1, #words, 5 do table.insert(queries, words[i]:sub(1, 3)) end
+   table.insert(queries, "")
+   table.insert(queries, "\255")
+   local path1, path2 = os.tmpname(), os.tmpname()
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      encode_fsa(path1, get_iter(words), fsa_type)
+      local size = #io.open(path1, "rb"):read("*a")
+      for _, layout in ipairs{"bfs", "dfs", "profile", "default"} do
+         local enc = mini.encoder(fsa_type)
+         enc:set_layout(layout, queries)
+         for _, word in ipairs(words) do enc:add(word) end
+         assert(enc:dump(path2))
+         local data = io.open(path2, "rb"):read("*a")
+         assert(#data == size)
+         check_lexicon(assert(mini.load(path2)), words, fsa_type)
+         if layout == "default" then
+            assert(data == io.open(path1, "rb"):read("*a"))
+         end
+      end
+   end
+   local enc = mini.encoder()
+   assert(not pcall(enc.set_layout, enc, "profile"))
+   assert(not pcall(enc.set_layout, enc, "foo"))
+   os.remove(path1); os.remove(path2)
+end
+
+-- Compact and packed automata behave like fixed-width ones, in less space.
+function test.formats()
+   local words = read_words()
+   local path1, path2 = os.tmpname(), os.tmpname()
+   for _, format in ipairs{"compact", "packed"} do
+      for _, fsa_type in ipairs{"standard", "numbered"} do
+         for _, lexicon in ipairs{words, {"a"}, {"a", "ab", "b"}, {}} do
+            encode_fsa(path1, get_iter(lexicon), fsa_type)
+            local enc = mini.encoder(fsa_type)
+            enc:set_format(format)
+            -- Ignored in the compact format. Packed automata are relaid out,
+            -- so they differ from the default layout.
+            enc:set_layout("bfs")
+            for _, word in ipairs(lexicon) do enc:add(word) end
+            assert(enc:dump(path2))
+            if format == "packed" and lexicon == words then
+               local enc = mini.encoder(fsa_type)
+               enc:set_format(format)
+               for _, word in ipairs(lexicon) do enc:add(word) end
+               local path3 = os.tmpname()
+               assert(enc:dump(path3))
+               assert(io.open(path2, "rb"):read("*a") ~= io.open(path3, "rb"):read("*a"))
+               check_lexicon(assert(mini.load(path3)), lexicon, fsa_type)
+               os.remove(path3)
+            end
+            local fixed, other = assert(mini.load(path1)), assert(mini.load(path2))
+            assert(fixed:format() == "fixed" and other:format() == format)
+            check_lexicon(other, lexicon, fsa_type)
+            if lexicon == words then
+               local size1 = #io.open(path1, "rb"):read("*a")
+               local size2 = #io.open(path2, "rb"):read("*a")
+               assert(size2 < size1)
+               for _, from in ipairs{"", "a", "sub", "diction", "zz", "\255"} do
+                  for _, mode in ipairs{"string", "prefix"} do
+                     local it1, it2 = fixed:iter(from, mode), other:iter(from, mode)
+                     repeat
+                        local word = it1()
+                        assert(word == it2())
+                     until not word
+                  end
+               end
+               if fsa_type == "numbered" then
+                  for _, pos in ipairs{1, 333, #words, -1} do
+                     local it1, it2 = fixed:iter(pos), other:iter(pos)
+                     repeat
+                        local word = it1()
+                        assert(word == it2())
+                     until not word
+                  end
+               end
+            end
+         end
+      end
+   end
+   local enc = mini.encoder()
+   assert(not pcall(enc.set_format, enc, "foo"))
+   os.remove(path1); os.remove(path2)
+end
+
+-- Storing states inside others makes automata smaller, but changes neither
+-- the words they recognize nor their ordinals.
+function test.overlap()
+   local words = read_words()
+   local path1, path2 = os.tmpname(), os.tmpname()
+   for _, format in ipairs{"fixed", "packed", "compact"} do
+      for _, layout in ipairs{"default", "dfs"} do
+         for _, fsa_type in ipairs{"standard", "numbered"} do
+            for _, lexicon in ipairs{words, {"a"}, {"ab", "b"}, {}} do
+               local encs = {}
+               for i, path in ipairs{path1, path2} do
+                  local enc = mini.encoder(fsa_type)
+                  enc:set_format(format)
+                  enc:set_layout(layout)
+                  enc:set_overlap(i == 2)
+                  for _, word in ipairs(lexicon) do enc:add(word) end
+                  assert(enc:dump(path))
+                  encs[i] = enc
+               end
+               local plain, overlapped = assert(mini.load(path1)), assert(mini.load(path2))
+               check_lexicon(overlapped, lexicon, fsa_type)
+               local size1 = #io.open(path1, "rb"):read("*a")
+               local size2 = #io.open(path2, "rb"):read("*a")
+               local saved = encs[2]:stats().overlap_saved
+               -- The state reached after "a" in "ab" is the end of the start
+               -- state.
+               if format == "compact" or #lexicon < 2 then
+                  assert(size2 == size1)
+               else
+                  assert(size2 < size1 and saved > 0)
+               end
+               if format == "compact" then assert(saved == 0) end
+               for _, from in ipairs{"", "a", "sub", "zz"} do
+                  local it1, it2 = plain:iter(from), overlapped:iter(from)
+                  repeat
+                     local word = it1()
+                     assert(word == it2())
+                  until not word
+               end
+               if fsa_type == "numbered" and #lexicon > 0 then
+                  local it1, it2 = plain:iter(1), overlapped:iter(1)
+                  repeat
+                     local word, pos = it1()
+                     local word2, pos2 = it2()
+                     assert(word == word2 and pos == pos2)
+                  until not word
+               end
+            end
+         end
+      end
+   end
+   os.remove(path1); os.remove(path2)
+end
+
+-- Narrow counts make numbered automata smaller, and interleaved counts faster,
+-- without changing ordinals.
+function test.counts()
+   local words = read_words()
+   local path1, path2 = os.tmpname(), os.tmpname()
+   for _, counts in ipairs{"narrow", "interleaved"} do
+      for _, fsa_type in ipairs{"standard", "numbered"} do
+         for _, overlap in ipairs{false, true} do
+            for _, lexicon in ipairs{words, {"a"}, {"a", "ab", "b"}, {}} do
+               for i, path in ipairs{path1, path2} do
+                  local enc = mini.encoder(fsa_type)
+                  enc:set_overlap(overlap)
+                  enc:set_counts(i == 1 and "full" or counts)
+                  for _, word in ipairs(lexicon) do enc:add(word) end
+                  assert(enc:dump(path))
+               end
+               local full, other = assert(mini.load(path1)), assert(mini.load(path2))
+               assert(full:counts() == "full")
+               assert(other:counts() == (fsa_type == "numbered" and counts or "full"))
+               check_lexicon(other, lexicon, fsa_type)
+               local size1 = #io.open(path1, "rb"):read("*a")
+               local size2 = #io.open(path2, "rb"):read("*a")
+               if fsa_type == "standard" or counts == "interleaved" then
+                  assert(size2 == size1)
+               elseif lexicon == words then
+                  assert(size2 < size1 * 0.7)
+               end
+               if fsa_type == "numbered" and lexicon == words then
+                  for _, pos in ipairs{1, 333, #words, -1} do
+                     local it1, it2 = full:iter(pos), other:iter(pos)
+                     repeat
+                        local word = it1()
+                        assert(word == it2())
+                     until not word
+                  end
+                  for _, from in ipairs{"", "sub", "zz"} do
+                     local it1, it2 = full:iter(from, "prefix"), other:iter(from, "prefix")
+                     repeat
+                        local word = it1()
+                        assert(word == it2())
+                     until not word
+                  end
+               end
+            end
+         end
+      end
+   end
+
+   -- Ranks of narrow counts must match the bitmaps of counts stored apart.
+   local enc = mini.encoder("numbered")
+   enc:set_counts("narrow")
+   assert(enc:dump(path2))
+   local data = io.open(path2, "rb"):read("*a")
+   local corrupt = io.open(path1, "wb")
+   corrupt:write(data:sub(1, -2) .. "\255")
+   corrupt:close()
+   assert(not mini.load(path1))
+   assert(not pcall(enc.set_counts, enc, "foo"))
+   os.remove(path1); os.remove(path2)
+end
+
+function test.native()
+   local words = read_words()
+   local path1, path2, path3 = os.tmpname(), os.tmpname(), os.tmpname()
+   local cases = {
+      {"fixed", "full"}, {"fixed", "narrow"}, {"fixed", "interleaved"},
+      {"compact", "full"}, {"packed", "full"},
+   }
+   for _, case in ipairs(cases) do
+      for _, fsa_type in ipairs{"standard", "numbered"} do
+         for _, lexicon in ipairs{words, {"a"}, {"a", "ab", "b"}, {}} do
+            for i, path in ipairs{path1, path2} do
+               local enc = mini.encoder(fsa_type)
+               enc:set_format(case[1])
+               enc:set_counts(case[2])
+               enc:set_native(i == 2)
+               for _, word in ipairs(lexicon) do enc:add(word) end
+               assert(enc:dump(path))
+            end
+            for _, map in ipairs{false, true} do
+               local lex = assert(mini.load(path2, map))
+               assert(lex:format() == case[1])
+               check_lexicon(lex, lexicon, fsa_type)
+            end
+            check_lexicon(assert(mini.load(path1, true)), lexicon, fsa_type)
+            local data1 = io.open(path1, "rb"):read("*a")
+            local data2 = io.open(path2, "rb"):read("*a")
+            assert(#data2 >= #data1 and #data2 < #data1 + 32)
+            -- Saving a loaded automaton gives the same file as encoding it.
+            for _, path in ipairs{path1, path2} do
+               for _, map in ipairs{false, true} do
+                  assert(mini.load(path, map):save(path3))
+                  assert(io.open(path3, "rb"):read("*a") == data2)
+               end
+            end
+         end
+      end
+   end
+
+   -- Native automata written on a host of the other byte order are converted.
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      local enc = mini.encoder(fsa_type)
+      enc:set_native(true)
+      for _, word in ipairs(words) do enc:add(word) end
+      assert(enc:dump(path1))
+      local data = io.open(path1, "rb"):read("*a")
+      local flags = data:byte(9)
+      assert(flags == 128 or flags == 192)
+      local swapped = {data:sub(1, 8), string.char(flags == 192 and 128 or 192), data:sub(10, 48)}
+      for pos = 49, #data, 4 do
+         table.insert(swapped, data:sub(pos, pos + 3):reverse())
+      end
+      local fp = io.open(path2, "wb")
+      fp:write(set_checksum(table.concat(swapped)))
+      fp:close()
+      for _, map in ipairs{false, true} do
+         check_lexicon(assert(mini.load(path2, map)), words, fsa_type)
+      end
+   end
+   os.remove(path1); os.remove(path2); os.remove(path3)
+end
+
+-- Corrupt headers are rejected when loading, corrupt transitions and counts
+-- by lexicon:verify().
+function test.verify()
+   local words = read_words()
+   local path = os.tmpname()
+   local function get32(data, pos)
+      local a, b, c, d = data:byte(pos, pos + 3)
+      return ((a * 256 + b) * 256 + c) * 256 + d
+   end
+   local function set32(data, pos, n)
+      local bytes = string.char(bit32.extract(n, 24, 8), bit32.extract(n, 16, 8),
+                                bit32.extract(n, 8, 8), bit32.extract(n, 0, 8))
+      return data:sub(1, pos - 1) .. bytes .. data:sub(pos + 4)
+   end
+   local function load(data)
+      local fp = io.open(path, "wb")
+      fp:write(data)
+      fp:close()
+      return mini.load(path)
+   end
+
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      encode_fsa(path, get_iter(words), fsa_type)
+      local data = io.open(path, "rb"):read("*a")
+      assert(data:sub(41, 44) == crc32c(data:sub(1, 40) .. "\0\0\0\0" .. data:sub(45, 48)))
+      -- Number of transitions.
+      local nr = get32(data, 21)
+      assert(not load(set32(data, 21, nr - 1)))
+      assert(load(set_checksum(set32(data, 21, nr - 1))))
+      -- A destination out of bounds, then the start state, which makes the
+      -- automaton cyclic.
+      local pos = 49 + math.floor(nr / 2) * 4
+      local trans = get32(data, pos)
+      local label_flags = bit32.band(trans, 1023)
+      assert(not assert(load(set32(data, pos, bit32.bor(label_flags, 0xfffffc00)))):verify())
+      local root = bit32.band(get32(data, 49), 0xfffffc00)
+      assert(not assert(load(set32(data, pos, bit32.bor(label_flags, root)))):verify())
+      -- A transition that leads nowhere, and isn't terminal.
+      assert(not assert(load(set32(data, pos, bit32.band(trans, 1021)))):verify())
+      -- Counts of numbered automata.
+      if fsa_type == "numbered" then
+         local last = #data - 3
+         assert(not assert(load(set32(data, last, get32(data, last) + 1))):verify())
+      end
+      check_lexicon(assert(load(data)), words, fsa_type)
+   end
+   os.remove(path)
+end
+
+-- Large automata are read in several pieces, split at arbitrary places.
+function test.parallel_load()
+   local set = {}
+   for _ = 1, 250000 do
+      local chars = {}
+      for i = 1, math.random(4, 16) do chars[i] = string.char(math.random(97, 122)) end
+      set[table.concat(chars)] = true
+   end
+   local words = {}
+   for word in pairs(set) do table.insert(words, word) end
+   table.sort(words)
+
+   local path = os.tmpname()
+   for _, counts in ipairs{"full", "narrow", "interleaved"} do
+      for _, native in ipairs{false, true} do
+         local enc = mini.encoder("numbered")
+         enc:set_counts(counts)
+         enc:set_native(native)
+         for _, word in ipairs(words) do enc:add(word) end
+         assert(enc:dump(path))
+         assert(#io.open(path, "rb"):read("*a") > 4 * 1024 * 1024)
+         local lex = assert(mini.load(path, false, 4))
+         check_lexicon(lex, words, "numbered")
+      end
+   end
+   os.remove(path)
+end
+
+-- Published lexicons can be attached to, and outlive their segment.
+function test.publish()
+   local words = read_words()
+   local path = os.tmpname()
+   local name = "/" .. path:match("[^/]+$")
+   local cases = {
+      {"fixed", "full"}, {"fixed", "narrow"}, {"fixed", "interleaved"},
+      {"compact", "full"}, {"packed", "full"},
+   }
+   for _, case in ipairs(cases) do
+      for _, fsa_type in ipairs{"standard", "numbered"} do
+         for _, lexicon in ipairs{words, {"a"}, {}} do
+            local enc = mini.encoder(fsa_type)
+            enc:set_format(case[1])
+            enc:set_counts(case[2])
+            for _, word in ipairs(lexicon) do enc:add(word) end
+            assert(enc:dump(path))
+            assert(mini.load(path):publish(name))
+            local lex = assert(mini.attach(name))
+            assert(lex:format() == case[1])
+            assert(lex:counts() == (fsa_type == "numbered" and case[2] or "full"))
+            -- Replacing the segment doesn't affect attached lexicons.
+            assert(mini.load(path, true):publish(name))
+            check_lexicon(assert(mini.attach(name)), lexicon, fsa_type)
+            assert(mini.unpublish(name))
+            check_lexicon(lex, lexicon, fsa_type)
+            assert(not mini.attach(name))
+            assert(not mini.unpublish(name))
+         end
+      end
+   end
+
+   -- The magic identifier of a segment is written last, so attaching to a
+   -- segment being published fails, however much of it was written. On Linux,
+   -- segments are files of /dev/shm.
+   encode_fsa(path, get_iter(words))
+   assert(mini.load(path):publish(name))
+   local fp = io.open("/dev/shm" .. name, "rb")
+   if fp then
+      local data = fp:read("*a")
+      fp:close()
+      assert(data:sub(1, 4) == "mini")
+      local function write(contents)
+         local fp = assert(io.open("/dev/shm" .. name, "wb"))
+         fp:write(contents)
+         fp:close()
+      end
+      for _, len in ipairs{48, 1000, #data} do
+         write("\0\0\0\0" .. data:sub(5, len))
+         local lex, err = mini.attach(name)
+         assert(not lex and err == "magic identifier mismatch")
+      end
+      write(data)
+      check_lexicon(assert(mini.attach(name)), words, "standard")
+   end
+   assert(mini.unpublish(name))
+   os.remove(path)
+end
+
+-- Lexicons are unchanged when moved to huge pages, whether copied or mapped.
+function test.advise()
+   local set = {}
+   for _ = 1, 100000 do
+      local chars = {}
+      for i = 1, math.random(4, 16) do chars[i] = string.char(math.random(97, 122)) end
+      set[table.concat(chars)] = true
+   end
+   local words = {}
+   for word in pairs(set) do table.insert(words, word) end
+   table.sort(words)
+
+   local path = os.tmpname()
+   for _, format in ipairs{"fixed", "compact", "packed"} do
+      for _, native in ipairs{false, true} do
+         local enc = mini.encoder("numbered")
+         enc:set_format(format)
+         enc:set_native(native)
+         for _, word in ipairs(words) do enc:add(word) end
+         assert(enc:dump(path))
+         for _, map in ipairs{false, true} do
+            local lex = assert(mini.load(path, map))
+            local iter = lex:iter()
+            assert(iter() == words[1])
+            assert(lex:advise("huge_pages", "prefault"))
+            assert(iter() == words[2])
+            -- Locking fails if the limit of the process is too low.
+            local ok, err = lex:advise("lock")
+            assert(ok or type(err) == "string")
+            assert(lex:advise("huge_pages"))
+            check_lexicon(lex, words, "numbered")
+         end
+      end
+   end
+   os.remove(path)
+end
+
+-- Lookups give the same results with jump tables, whatever the states that
+-- have one.
+function test.accelerate()
+   local set = {}
+   for _ = 1, 20000 do
+      local chars = {}
+      for i = 1, math.random(1, 8) do
+         chars[i] = string.char(i <= 2 and math.random(0, 255) or math.random(97, 100))
+      end
+      set[table.concat(chars)] = true
+   end
+   local words = {}
+   for word in pairs(set) do table.insert(words, word) end
+   table.sort(words)
+
+   local path = os.tmpname()
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      for _, format in ipairs{"fixed", "compact", "packed"} do
+         for _, counts in ipairs{"full", "narrow", "interleaved"} do
+            if format == "fixed" or counts == "full" then
+               local enc = mini.encoder(fsa_type)
+               enc:set_format(format)
+               enc:set_counts(counts)
+               for _, word in ipairs(words) do enc:add(word) end
+               assert(enc:dump(path))
+               local ref = assert(mini.load(path))
+               local lex = assert(mini.load(path))
+               for _, params in ipairs{{1, 2^30}, {4, 2^30}, {}, {1, 5000}, {1, 0}} do
+                  assert(lex:accelerate(params[1], params[2]))
+                  check_lexicon(lex, words, fsa_type)
+                  for _ = 1, 200 do
+                     local chars = {}
+                     for i = 1, math.random(0, 4) do
+                        chars[i] = string.char(i <= 2 and math.random(0, 255) or math.random(96, 101))
+                     end
+                     local str = table.concat(chars)
+                     assert(lex:contains(str) == ref:contains(str))
+                     assert(lex:locate(str) == ref:locate(str))
+                     for _, mode in ipairs{"string", "prefix"} do
+                        local it1, pos1 = lex:iter(str, mode)
+                        local it2, pos2 = ref:iter(str, mode)
+                        assert(pos1 == pos2)
+                        for _ = 1, 3 do assert(it1() == it2()) end
+                     end
+                  end
+               end
+            end
+         end
+      end
+   end
+   os.remove(path)
+end
+
+-- Unsorted input gives the same automaton as sorted input without duplicates.
+function test.unsorted()
+   local words = read_words()
+   local shuffled = {}
+   for i, word in ipairs(words) do
+      table.insert(shuffled, word)
+      if i % 7 == 0 then table.insert(shuffled, word) end
+   end
+   for i = #shuffled, 2, -1 do
+      local j = math.random(i)
+      shuffled[i], shuffled[j] = shuffled[j], shuffled[i]
+   end
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      local path1, path2 = os.tmpname(), os.tmpname()
+      encode_fsa(path1, get_iter(words), fsa_type)
+      -- With enough memory, and with spills to temporary files.
+      for _, max_memory in ipairs{64 * 1024 * 1024, 64 * 1024} do
+         local enc = mini.encoder(fsa_type)
+         assert(enc:set_unsorted(max_memory))
+         for _, word in ipairs(shuffled) do enc:add(word) end
+         assert(enc:dump(path2))
+         assert(io.open(path1, "rb"):read("*a") == io.open(path2, "rb"):read("*a"))
+      end
+      -- The mode can't be changed once words were added.
+      local enc = mini.encoder(fsa_type)
+      enc:add(words[1])
+      assert(not enc:set_unsorted(64 * 1024))
+      enc:clear()
+      assert(enc:set_unsorted(64 * 1024))
+      enc:add(words[2])
+      assert(not enc:set_unsorted(0))
+      assert(enc:dump(path2))
+      assert(not enc:set_unsorted(0))
+      os.remove(path1); os.remove(path2)
+   end
+end
+
+-- Streaming mode writes the same bytes as the default mode.
+function test.stream()
+   local words = read_words()
+   for _, fsa_type in ipairs{"standard", "numbered"} do
+      for _, lexicon in ipairs{words, {"a"}, {}} do
+         local path1, path2, path3 = os.tmpname(), os.tmpname(), os.tmpname()
+         encode_fsa(path1, get_iter(lexicon), fsa_type)
+
+         local enc = mini.encoder(fsa_type)
+         assert(enc:set_stream(path2))
+         for _, word in ipairs(lexicon) do enc:add(word) end
+         assert(enc:dump())
+         -- Dumping to another file copies the automaton.
+         assert(enc:dump(path3))
+         local data = io.open(path1, "rb"):read("*a")
+         assert(io.open(path2, "rb"):read("*a") == data)
+         assert(io.open(path3, "rb"):read("*a") == data)
+         check_lexicon(assert(mini.load(path2)), lexicon, fsa_type)
+
+         -- Clearing the encoder leaves streaming mode.
+         enc:clear()
+         for _, word in ipairs(lexicon) do enc:add(word) end
+         assert(not pcall(enc.dump, enc))
+         os.remove(path1); os.remove(path2); os.remove(path3)
+      end
+
+      -- The mode can't be changed once words were added.
+      local path = os.tmpname()
+      local enc = mini.encoder(fsa_type)
+      enc:add("a")
+      assert(not enc:set_stream(path))
+      enc:clear()
+      assert(enc:set_stream(path))
+      enc:add("a")
+      assert(not enc:set_stream())
+      assert(enc:dump())
+      assert(not enc:set_stream())
+      check_lexicon(assert(mini.load(path)), {"a"}, fsa_type)
+      os.remove(path)
+   end
+end
+
 -- Should be able to reuse the same encoder several times.
 function test.reuse_several_times()
    local enc = mini.encoder()